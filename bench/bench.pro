@@ -0,0 +1,17 @@
+TEMPLATE = app
+
+TARGET=qcontenthub-bench
+
+SOURCES += qcontenthub_bench.cpp
+HEADERS += ../qcontenthub.h
+
+CONFIG += release
+QT -= gui core
+
+LIBS = -lmsgpack-rpc -lpthread
+
+INSTALLDIR=/opt/qcontent/3rdparty/
+
+target.path  = $$INSTALLDIR/bin
+
+INSTALLS += target
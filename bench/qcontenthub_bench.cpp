@@ -0,0 +1,504 @@
+// Load generator for the hub and the url queue, reports throughput and
+// latency percentiles per operation.
+#include <msgpack/rpc/client.h>
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../qcontenthub.h"
+
+// latency histogram in microsecs, values below HIST_SUB are exact and
+// every power of two above is split into HIST_SUB linear buckets, which
+// keeps the error of any percentile below 1/HIST_SUB
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram_t {
+    histogram_t(): count(0), max(0), counts(HIST_BUCKETS, 0) {}
+
+    static int index(uint64_t v) {
+        if (v < HIST_SUB) {
+            return v;
+        }
+        int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+        return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+    }
+
+    // largest value falling into bucket i
+    static uint64_t value(int i) {
+        if (i < HIST_SUB) {
+            return i;
+        }
+        int shift = i / HIST_SUB - 1;
+        return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+    }
+
+    void add(uint64_t v) {
+        counts[index(v)]++;
+        count++;
+        if (v > max) {
+            max = v;
+        }
+    }
+
+    void merge(const histogram_t &other) {
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            counts[i] += other.counts[i];
+        }
+        count += other.count;
+        if (other.max > max) {
+            max = other.max;
+        }
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = (uint64_t)ceil(count * p / 100.0);
+        uint64_t seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank && seen > 0) {
+                return value(i) < max ? value(i) : max;
+            }
+        }
+        return max;
+    }
+
+    uint64_t count;
+    uint64_t max;
+    std::vector<uint64_t> counts;
+};
+
+struct op_stats_t {
+    op_stats_t(): again(0), errors(0), items(0), bytes(0) {}
+
+    histogram_t latency;
+    // answered with again: queue full or empty, site not due yet
+    uint64_t again;
+    uint64_t errors;
+    // urls or items moved, more than the ops with batches
+    uint64_t items;
+    uint64_t bytes;
+};
+
+enum { OP_PUSH, OP_POP, OP_COUNT };
+static const char *op_names[OP_COUNT] = { "push", "pop" };
+
+static std::string host = "127.0.0.1";
+static int port = 7676;
+static bool url_mode = false;
+static int clients = 16;
+static int duration = 10;
+// ops/s of all clients together, 0 for as fast as possible
+static double rate = 0;
+static int push_percent = 50;
+static int queues = 1;
+static int sites = 1000;
+static int capacity = 100000;
+static bool blocking = false;
+// urls per url queue push and pop, above 1 with push_urls and pop_urls
+static int batch = 1;
+static bool verbose = false;
+// payload bytes: fixed, uniform in [size_min, size_max] or exponential
+enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP };
+static int size_dist = SIZE_FIXED;
+static int size_min = 100;
+static int size_max = 100;
+static double size_mean = 100;
+
+struct client_t {
+    client_t(): id(0) {}
+
+    int id;
+    pthread_t tid;
+    op_stats_t ops[OP_COUNT];
+};
+
+static uint64_t now_usec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int payload_size(unsigned int *seed)
+{
+    int size;
+    switch (size_dist) {
+    case SIZE_UNIFORM:
+        size = size_min + rand_r(seed) % (size_max - size_min + 1);
+        break;
+    case SIZE_EXP:
+        size = (int)(-size_mean * log((rand_r(seed) + 1.0) / (RAND_MAX + 2.0)));
+        break;
+    default:
+        size = size_min;
+    }
+    if (size < size_min) {
+        size = size_min;
+    }
+    if (size > size_max) {
+        size = size_max;
+    }
+    return size;
+}
+
+static std::string queue_name(int i)
+{
+    char buf[32];
+    sprintf(buf, "bench_queue_%d", i);
+    return buf;
+}
+
+static std::string site_name(int i)
+{
+    char buf[32];
+    sprintf(buf, "bench-site-%d.com", i);
+    return buf;
+}
+
+// one request, answers the status class of the reply
+static int do_op(msgpack::rpc::client &c, int op, unsigned int *seed, op_stats_t &stats)
+{
+    if (op == OP_PUSH && url_mode && batch > 1) {
+        std::vector<std::pair<std::string, std::string> > urls(batch);
+        for (int i = 0; i < batch; i++) {
+            urls[i].first = site_name(rand_r(seed) % sites);
+            urls[i].second = "http://" + urls[i].first + "/";
+            urls[i].second.resize(payload_size(seed), 'x');
+        }
+        std::vector<int> status = c.call("push_urls", urls).get<std::vector<int> >();
+        int result = QCONTENTHUB_AGAIN;
+        for (size_t i = 0; i < status.size(); i++) {
+            if (status[i] == QCONTENTHUB_OK) {
+                stats.items++;
+                stats.bytes += urls[i].second.size();
+                result = QCONTENTHUB_OK;
+            }
+        }
+        return result;
+    }
+
+    if (op == OP_PUSH) {
+        std::string payload;
+        std::string target;
+        if (url_mode) {
+            target = site_name(rand_r(seed) % sites);
+            payload = "http://" + target + "/";
+        } else {
+            target = queue_name(rand_r(seed) % queues);
+        }
+        payload.resize(payload_size(seed), 'x');
+        int result;
+        if (url_mode) {
+            result = c.call("push", target, payload).get<int>();
+        } else {
+            result = c.call(blocking ? "push" : "push_nowait", target, payload).get<int>();
+        }
+        if (result == QCONTENTHUB_OK) {
+            stats.items++;
+            stats.bytes += payload.size();
+        }
+        return result;
+    }
+
+    if (url_mode && batch > 1) {
+        msgpack::type::tuple<std::vector<std::string>, int64_t> ret;
+        ret = c.call("pop_urls", batch).get<msgpack::type::tuple<std::vector<std::string>, int64_t> >();
+        std::vector<std::string> &urls = ret.get<0>();
+        if (urls.empty()) {
+            return QCONTENTHUB_AGAIN;
+        }
+        for (size_t i = 0; i < urls.size(); i++) {
+            stats.bytes += urls[i].size();
+        }
+        stats.items += urls.size();
+        return QCONTENTHUB_OK;
+    }
+
+    std::string content;
+    if (url_mode) {
+        content = c.call("pop").get<std::string>();
+    } else {
+        content = c.call(blocking ? "pop" : "pop_nowait", queue_name(rand_r(seed) % queues)).get<std::string>();
+    }
+    if (content == QCONTENTHUB_STRAGAIN) {
+        return QCONTENTHUB_AGAIN;
+    }
+    if (content == QCONTENTHUB_STRERROR) {
+        return QCONTENTHUB_ERROR;
+    }
+    stats.items++;
+    stats.bytes += content.size();
+    return QCONTENTHUB_OK;
+}
+
+static void *client_main(void *arg)
+{
+    client_t *cl = (client_t *)arg;
+    unsigned int seed = cl->id * 7919 + 1;
+    msgpack::rpc::client c(host, port);
+    c.set_timeout(120);
+
+    uint64_t start = now_usec();
+    uint64_t end = start + (uint64_t)duration * 1000000;
+    // with a target rate every client sends on its own fixed schedule and
+    // latency counts from the scheduled time, so a stalled server shows up
+    // in the percentiles instead of just lowering the send rate
+    double interval = rate > 0 ? clients * 1000000.0 / rate : 0;
+    uint64_t n = 0;
+    for (;;) {
+        uint64_t scheduled = now_usec();
+        if (interval > 0) {
+            scheduled = start + (uint64_t)(n * interval) + (uint64_t)(cl->id * interval / clients);
+            uint64_t t = now_usec();
+            if (scheduled > t) {
+                usleep(scheduled - t);
+            }
+        }
+        if (scheduled >= end) {
+            break;
+        }
+        n++;
+
+        int op = (int)(rand_r(&seed) % 100) < push_percent ? OP_PUSH : OP_POP;
+        op_stats_t &stats = cl->ops[op];
+        int result;
+        try {
+            result = do_op(c, op, &seed, stats);
+        } catch (std::exception &e) {
+            result = QCONTENTHUB_ERROR;
+        }
+        stats.latency.add(now_usec() - scheduled);
+        if (result == QCONTENTHUB_AGAIN) {
+            stats.again++;
+        } else if (result != QCONTENTHUB_OK) {
+            stats.errors++;
+        }
+    }
+    return NULL;
+}
+
+static void setup()
+{
+    msgpack::rpc::client c(host, port);
+    c.set_timeout(120);
+    if (url_mode) {
+        return;
+    }
+    for (int i = 0; i < queues; i++) {
+        c.call("add", queue_name(i), capacity).get<int>();
+    }
+}
+
+static void report(const std::vector<client_t> &cls, double secs)
+{
+    uint64_t total = 0;
+    uint64_t items = 0;
+    uint64_t bytes = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        op_stats_t sum;
+        for (size_t i = 0; i < cls.size(); i++) {
+            sum.latency.merge(cls[i].ops[op].latency);
+            sum.again += cls[i].ops[op].again;
+            sum.errors += cls[i].ops[op].errors;
+            sum.items += cls[i].ops[op].items;
+            sum.bytes += cls[i].ops[op].bytes;
+        }
+        total += sum.latency.count;
+        items += sum.items;
+        bytes += sum.bytes;
+        printf("%-5s %10llu ops %10.1f ops/s %10.1f items/s %8llu again %6llu errors  p50 %6llu  p99 %6llu  p999 %6llu  max %7llu us\n",
+                op_names[op], (unsigned long long)sum.latency.count, sum.latency.count / secs, sum.items / secs,
+                (unsigned long long)sum.again, (unsigned long long)sum.errors,
+                (unsigned long long)sum.latency.percentile(50),
+                (unsigned long long)sum.latency.percentile(99),
+                (unsigned long long)sum.latency.percentile(99.9),
+                (unsigned long long)sum.latency.max);
+        if (verbose) {
+            for (int i = 0; i < HIST_BUCKETS; i++) {
+                if (sum.latency.counts[i] > 0) {
+                    printf("      <= %8llu us %10llu\n", (unsigned long long)histogram_t::value(i),
+                            (unsigned long long)sum.latency.counts[i]);
+                }
+            }
+        }
+    }
+    printf("total %10llu ops %10.1f ops/s %10.1f items/s %10.2f MB/s\n", (unsigned long long)total,
+            total / secs, items / secs, bytes / secs / (1024 * 1024));
+}
+
+static bool parse_size(const char *arg)
+{
+    if (strncmp(arg, "exp:", 4) == 0) {
+        size_dist = SIZE_EXP;
+        size_mean = atof(arg + 4);
+        size_min = 1;
+        size_max = (int)(size_mean * 20);
+        return size_mean > 0;
+    }
+    const char *dash = strchr(arg, '-');
+    if (dash != NULL) {
+        size_dist = SIZE_UNIFORM;
+        size_min = atoi(arg);
+        size_max = atoi(dash + 1);
+        return size_min >= 0 && size_max >= size_min;
+    }
+    size_dist = SIZE_FIXED;
+    size_min = size_max = atoi(arg);
+    return size_min >= 0;
+}
+
+static void print_usage(FILE* stream, int exit_code)
+{
+    fprintf(stream, "Usage: qcontenthub-bench [options]\n");
+    fprintf(stream,
+            "  -h --help              Display this usage information\n"
+            "  -H --host <host>       Server host(default 127.0.0.1)\n"
+            "  -p --port <num>        Server port(default 7676)\n"
+            "  -u --url-queue         Benchmark the url queue push and pop\n"
+            "  -c --clients <num>     Concurrent clients(default 16)\n"
+            "  -t --time <secs>       Duration(default 10)\n"
+            "  -r --rate <num>        Target ops/s of all clients(default 0, unlimited)\n"
+            "  -x --push <percent>    Share of pushes in the mix(default 50)\n"
+            "  -s --size <spec>       Payload bytes: N, MIN-MAX uniform or exp:MEAN(default 100)\n"
+            "  -q --queues <num>      Hub queues used(default 1)\n"
+            "  -C --capacity <num>    Capacity of the hub queues added(default 100000)\n"
+            "  -n --sites <num>       Url queue sites used(default 1000)\n"
+            "  -i --interval <ms>     Set the url queue default interval first\n"
+            "  -w --wait              Blocking hub push and pop instead of the nowait ones\n"
+            "  -b --batch <num>       Urls per url queue push and pop, with push_urls and pop_urls above 1(default 1)\n"
+            "  -v --verbose           Print the full latency histograms\n");
+
+    exit(exit_code);
+}
+
+int main(int argc, char *argv[])
+{
+    int interval = -1;
+    const char* const short_options = "hH:p:uc:t:r:x:s:q:C:n:i:wb:v";
+    const struct option long_options[] = {
+        { "help",     0, NULL, 'h' },
+        { "host",     1, NULL, 'H' },
+        { "port",     1, NULL, 'p' },
+        { "url-queue", 0, NULL, 'u' },
+        { "clients",  1, NULL, 'c' },
+        { "time",     1, NULL, 't' },
+        { "rate",     1, NULL, 'r' },
+        { "push",     1, NULL, 'x' },
+        { "size",     1, NULL, 's' },
+        { "queues",   1, NULL, 'q' },
+        { "capacity", 1, NULL, 'C' },
+        { "sites",    1, NULL, 'n' },
+        { "interval", 1, NULL, 'i' },
+        { "wait",     0, NULL, 'w' },
+        { "batch",    1, NULL, 'b' },
+        { "verbose",  0, NULL, 'v' },
+        { NULL,       0, NULL, 0   }
+    };
+
+    int next_option;
+    do {
+        next_option = getopt_long(argc, argv, short_options, long_options, NULL);
+        switch (next_option) {
+            case 'h':
+                print_usage(stdout, EXIT_SUCCESS);
+            case 'H':
+                host = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'u':
+                url_mode = true;
+                break;
+            case 'c':
+                clients = atoi(optarg);
+                break;
+            case 't':
+                duration = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'x':
+                push_percent = atoi(optarg);
+                break;
+            case 's':
+                if (!parse_size(optarg)) {
+                    print_usage(stderr, EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                queues = atoi(optarg);
+                break;
+            case 'C':
+                capacity = atoi(optarg);
+                break;
+            case 'n':
+                sites = atoi(optarg);
+                break;
+            case 'i':
+                interval = atoi(optarg);
+                break;
+            case 'w':
+                blocking = true;
+                break;
+            case 'b':
+                batch = atoi(optarg);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case -1:
+                break;
+            case '?':
+                print_usage(stderr, EXIT_FAILURE);
+            default:
+                print_usage(stderr, EXIT_FAILURE);
+        }
+    } while (next_option != -1);
+
+    if (clients <= 0 || duration <= 0 || queues <= 0 || sites <= 0 || batch <= 0) {
+        print_usage(stderr, EXIT_FAILURE);
+    }
+
+    try {
+        setup();
+        if (url_mode && interval >= 0) {
+            msgpack::rpc::client c(host, port);
+            c.call("set_default_interval", interval).get<int>();
+        }
+    } catch (std::exception &e) {
+        fprintf(stderr, "setup: %s\n", e.what());
+        return EXIT_FAILURE;
+    }
+
+    printf("%s %s:%d, %d clients, %ds, rate %s, %d%% push, %d %s, size %d-%d\n",
+            url_mode ? "url queue" : "hub", host.c_str(), port, clients, duration,
+            rate > 0 ? "limited" : "unlimited", push_percent,
+            url_mode ? sites : queues, url_mode ? "sites" : "queues", size_min, size_max);
+
+    std::vector<client_t> cls(clients);
+    uint64_t start = now_usec();
+    for (int i = 0; i < clients; i++) {
+        cls[i].id = i;
+        pthread_create(&cls[i].tid, NULL, client_main, &cls[i]);
+    }
+    for (int i = 0; i < clients; i++) {
+        pthread_join(cls[i].tid, NULL);
+    }
+    double secs = (now_usec() - start) / 1000000.0;
+
+    report(cls, secs);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,18 @@
+TEMPLATE = lib
+
+TARGET=qcontenthub
+
+SOURCES += qcontenthub_rpc.cpp qcontenthub_registry.cpp qcontenthub_log.cpp qcontenthub_metrics.cpp qcontenthub_shm.cpp qcontenthub_client.cpp
+SOURCES += qurlqueue_rpc.cpp qurlqueue_list.cpp qurlqueue_filter.cpp qurlqueue_store.cpp
+HEADERS += qcontenthub_rpc.h qcontenthub_ring.h qcontenthub_item.h qcontenthub_metrics.h qcontenthub_registry.h qcontenthub_log.h qcontenthub_shm.h qcontenthub_client.h qurlqueue_rpc.h qurlqueue_heap.h qurlqueue_list.h qurlqueue_filter.h qurlqueue_store.h qcontenthub.h
+
+CONFIG += release staticlib
+QT -= gui core
+
+INSTALLDIR=/opt/qcontent/3rdparty/
+
+target.path  = $$INSTALLDIR/lib
+headers.path = $$INSTALLDIR/include/qcontenthub
+headers.files = $$HEADERS
+
+INSTALLS += target headers
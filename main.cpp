@@ -11,7 +11,19 @@ void print_usage(FILE* stream, int exit_code) {
             "  -d --deamon           Run as a daemon\n"
             "  -p --port <num>       TCP port number to listen on(default 7676)\n"
             "  -u --url-queue        Url queue\n"
-            "  -m --multiple <num>   Threads num(default 100, must greater than 10)\n");
+            "  -m --multiple <num>   Threads num(default 100, must greater than 10)\n"
+            "  -s --store <dir>      Keep hub queues or the url frontier below dir\n"
+            "  -o --dump-dir <dir>   Directory of the url queue's dump_file(default off)\n"
+            "  -b --max-memory <MB>  Bytes budget of all hub queues(default 0, unlimited)\n"
+            "  -n --shards <num>     Site map shards of the url queue(default 64)\n"
+            "  -D --dedup <MB>       Drop urls pushed again, filter memory(default 0, off)\n"
+            "  -f --dedup-fp <rate>  False positive rate of the url filter(default 0.001)\n"
+            "  -r --dedup-rotate <secs> Forget urls after one to two periods(default 86400)\n"
+            "  -i --snapshot-interval <secs> Snapshot the url frontier(default 600)\n"
+            "  -a --adaptive <min>:<max> Adapt site intervals to report_fetch within millisecs(default off)\n"
+            "  -g --groups <file>    Politeness groups of the url queue, lines of rule <suffix>,\n"
+            "                        site <site> <group> or interval <group> <ms>\n"
+            "  -S --shm              Offer shared memory channels to hub clients on this host\n");
 
     exit(exit_code);
 }
@@ -26,15 +38,38 @@ int main(int argc, char *argv[])
     int multiple = 100;
     int help = 0;
     bool url_queue = false;
+    std::string store_dir;
+    std::string dump_dir;
+    int64_t max_memory = 0;
+    int shards = QURLQUEUE_DEFAULT_SHARDS;
+    size_t dedup_bytes = 0;
+    double dedup_fp = 0.001;
+    int dedup_rotate = 86400;
+    int snapshot_interval = 600;
+    int adapt_min = 0;
+    int adapt_max = 0;
+    std::string groups_file;
+    bool shm = false;
     pid_t   pid, sid;
 
-    const char* const short_options = "hdp:mu";
+    const char* const short_options = "hdp:m:us:o:b:n:D:f:r:i:a:g:S";
     const struct option long_options[] = {
         { "help",     0, NULL, 'h' },
         { "daemon",   0, NULL, 'd' },
         { "port",     1, NULL, 'p' },
         { "multiple", 1, NULL, 'm' },
         { "url-queue", 0, NULL, 'u' },
+        { "store",    1, NULL, 's' },
+        { "dump-dir", 1, NULL, 'o' },
+        { "max-memory", 1, NULL, 'b' },
+        { "shards",   1, NULL, 'n' },
+        { "dedup",    1, NULL, 'D' },
+        { "dedup-fp", 1, NULL, 'f' },
+        { "dedup-rotate", 1, NULL, 'r' },
+        { "snapshot-interval", 1, NULL, 'i' },
+        { "adaptive", 1, NULL, 'a' },
+        { "groups",   1, NULL, 'g' },
+        { "shm",      0, NULL, 'S' },
         { NULL,       0, NULL, 0   }
     };
 
@@ -58,6 +93,41 @@ int main(int argc, char *argv[])
             case 'u':
                 url_queue = true;
                 break;
+            case 's':
+                store_dir = optarg;
+                break;
+            case 'o':
+                dump_dir = optarg;
+                break;
+            case 'b':
+                max_memory = atoll(optarg) * 1024 * 1024;
+                break;
+            case 'n':
+                shards = atoi(optarg);
+                break;
+            case 'D':
+                dedup_bytes = atoll(optarg) * 1024 * 1024;
+                break;
+            case 'f':
+                dedup_fp = atof(optarg);
+                break;
+            case 'r':
+                dedup_rotate = atoi(optarg);
+                break;
+            case 'i':
+                snapshot_interval = atoi(optarg);
+                break;
+            case 'a':
+                if (sscanf(optarg, "%d:%d", &adapt_min, &adapt_max) != 2 || adapt_max < adapt_min) {
+                    print_usage(stderr, 1);
+                }
+                break;
+            case 'g':
+                groups_file = optarg;
+                break;
+            case 'S':
+                shm = true;
+                break;
             case -1:
                 break;
             case '?':
@@ -97,14 +167,38 @@ int main(int argc, char *argv[])
 
     if (url_queue) {
         msgpack::rpc::loop lo;
-        qurlqueue::QUrlQueueServer svr(lo);
-	    lo->add_timer(0.1, 0.001, mp::bind(&qurlqueue::QUrlQueueServer::set_current_time));
+        qurlqueue::QUrlQueueServer svr(lo, shards);
+	    lo->add_timer(0.1, 0.001, mp::bind(&qurlqueue::QUrlQueueServer::tick, &svr));
+
+        if (dedup_bytes > 0) {
+            qurlqueue::QUrlQueueServer::set_current_time();
+            svr.set_dedup(dedup_bytes, dedup_fp, dedup_rotate);
+            lo->add_timer(1.0, 1.0, mp::bind(&qurlqueue::QUrlQueueServer::rotate_filters, &svr));
+        }
+        if (!store_dir.empty()) {
+            svr.set_store_dir(store_dir, snapshot_interval);
+        }
+        if (!dump_dir.empty()) {
+            svr.set_dump_dir(dump_dir);
+        }
+        svr.set_adaptive_interval(adapt_min, adapt_max);
+        if (!groups_file.empty() && !svr.load_groups(groups_file)) {
+            perror(groups_file.c_str());
+            exit(EXIT_FAILURE);
+        }
 
         svr.instance.listen("0.0.0.0", port);
         svr.start(multiple);
     } else {
-        QContentHubServer svr;
+        msgpack::rpc::loop lo;
+        QContentHubServer svr(lo);
+        lo->add_timer(0.1, 0.1, mp::bind(&QContentHubServer::expire_waiters, &svr));
 
+        if (!store_dir.empty()) {
+            svr.set_store_dir(store_dir);
+        }
+        svr.set_max_bytes(max_memory);
+        svr.set_shm(shm);
         svr.listen(port);
         svr.start(multiple);
     }
@@ -3,6 +3,15 @@
 
 #define DEFAULT_QUEUE_CAPACITY 1000
 
+// millisecs a parked push or pop waits before it is answered with again
+#define QCONTENTHUB_WAIT_TIMEOUT 60000
+
+// queue flags, the optional third argument of add
+// lock-free bounded ring instead of a locked std::queue
+#define QCONTENTHUB_QUEUE_RING 0x1
+// keep the items in a segment log below the --store directory
+#define QCONTENTHUB_QUEUE_PERSIST 0x2
+
 #define QCONTENTHUB_OK 0
 #define QCONTENTHUB_WARN 2
 #define QCONTENTHUB_ERROR -1
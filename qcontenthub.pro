@@ -1,20 +1,11 @@
-TEMPLATE = app
-
-TARGET=qcontenthubd
-
-SOURCES += qcontenthub_rpc.cpp
-SOURCES += qurlqueue_rpc.cpp main.cpp
-HEADERS += qcontenthub_rpc.h qurlqueue_rpc.h qcontenthub.h
-
-CONFIG += release
-QT -= gui core
-
-LIBS = -lmsgpack-rpc -lrt
-
-INSTALLDIR=/opt/qcontent/3rdparty/
-
-target.path  = $$INSTALLDIR/bin
-
-INSTALLS += target
+TEMPLATE = subdirs
 
+# libqcontenthub holds the hub queues and the url queue, qcontenthubd
+# serves them over msgpack-rpc
+SUBDIRS = lib daemon
 
+lib.file = libqcontenthub.pro
+lib.makefile = Makefile.lib
+daemon.file = qcontenthubd.pro
+daemon.makefile = Makefile.daemon
+daemon.depends = lib
@@ -0,0 +1,250 @@
+#include "qcontenthub_client.h"
+#include "qcontenthub.h"
+#include "qcontenthub_metrics.h"
+
+#include <unistd.h>
+
+bool QContentHubFuture::ready() const
+{
+    pthread_mutex_lock(&m_result->lock);
+    bool done = m_result->done;
+    pthread_mutex_unlock(&m_result->lock);
+    return done;
+}
+
+void QContentHubFuture::wait() const
+{
+    pthread_mutex_lock(&m_result->lock);
+    while (!m_result->done) {
+        pthread_cond_wait(&m_result->cond, &m_result->lock);
+    }
+    pthread_mutex_unlock(&m_result->lock);
+}
+
+int QContentHubFuture::status() const
+{
+    wait();
+    return m_result->status;
+}
+
+const std::string &QContentHubFuture::data() const
+{
+    wait();
+    return m_result->data;
+}
+
+const std::vector<std::string> &QContentHubFuture::items() const
+{
+    wait();
+    return m_result->items;
+}
+
+// reply callback of a future, C++03 has no closures
+struct reply_fn_t {
+    explicit reply_fn_t(const QContentHubClient::call_ptr &c): call(c) {}
+    void operator()(msgpack::rpc::future f) {
+        call->client->reply(f, call);
+    }
+    QContentHubClient::call_ptr call;
+};
+
+QContentHubClient::QContentHubClient(const std::string &host, uint16_t port, int connections, int threads): m_next(0), m_in_flight(0), m_has_batches(false), m_window_us(QCONTENTHUB_CLIENT_WINDOW), m_max_items(QCONTENTHUB_CLIENT_BATCH)
+{
+    pthread_mutex_init(&m_batch_lock, NULL);
+    for (int i = 0; i < (connections > 0 ? connections : 1); i++) {
+        m_connections.push_back(new msgpack::rpc::client(host, port, m_loop));
+    }
+    m_loop->add_timer(QCONTENTHUB_CLIENT_TICK / 1000000.0, QCONTENTHUB_CLIENT_TICK / 1000000.0, mp::bind(&QContentHubClient::flush_due, this));
+    m_loop->start(threads > 0 ? threads : 1);
+}
+
+QContentHubClient::~QContentHubClient()
+{
+    flush();
+    // every call ends with a reply or the session's timeout
+    while (m_in_flight > 0) {
+        usleep(1000);
+    }
+    m_loop->end();
+    m_loop->join();
+    for (size_t i = 0; i < m_connections.size(); i++) {
+        delete m_connections[i];
+    }
+    pthread_mutex_destroy(&m_batch_lock);
+}
+
+void QContentHubClient::set_batching(int window_us, int max_items)
+{
+    m_window_us = window_us;
+    m_max_items = max_items;
+}
+
+msgpack::rpc::client *QContentHubClient::next_connection()
+{
+    return m_connections[__sync_fetch_and_add(&m_next, 1) % m_connections.size()];
+}
+
+void QContentHubClient::attach(msgpack::rpc::future f, const call_ptr &call)
+{
+    // the loop threads may set the reply before the callback is attached,
+    // and msgpack-rpc only runs a callback for a reply set after it
+    f.attach_callback(reply_fn_t(call));
+    if (f.is_finished()) {
+        reply(f, call);
+    }
+}
+
+void QContentHubClient::reply(msgpack::rpc::future f, const call_ptr &call)
+{
+    if (!__sync_bool_compare_and_swap(&call->replied, 0, 1)) {
+        return;
+    }
+    std::vector<client_result_ptr> &results = call->results;
+    try {
+        switch (call->kind) {
+        case call_t::PUSH:
+            results[0]->complete(f.get<int>());
+            break;
+        case call_t::PUSH_BATCH: {
+            // the number of leading items the hub took, or an error
+            int accepted = f.get<int>();
+            for (size_t i = 0; i < results.size(); i++) {
+                if (accepted < 0) {
+                    results[i]->complete(QCONTENTHUB_ERROR);
+                } else {
+                    results[i]->complete((int)i < accepted ? QCONTENTHUB_OK : QCONTENTHUB_AGAIN);
+                }
+            }
+            break;
+        }
+        case call_t::POP: {
+            std::string &data = results[0]->data;
+            data = f.get<std::string>();
+            if (data == QCONTENTHUB_STRAGAIN) {
+                results[0]->complete(QCONTENTHUB_AGAIN);
+            } else if (data == QCONTENTHUB_STRERROR) {
+                results[0]->complete(QCONTENTHUB_ERROR);
+            } else {
+                results[0]->complete(QCONTENTHUB_OK);
+            }
+            break;
+        }
+        case call_t::POP_BATCH:
+            results[0]->items = f.get<std::vector<std::string> >();
+            results[0]->complete(results[0]->items.empty() ? QCONTENTHUB_AGAIN : QCONTENTHUB_OK);
+            break;
+        }
+    } catch (std::exception &e) {
+        // a timeout or a broken connection, none of the results came
+        for (size_t i = 0; i < results.size(); i++) {
+            if (!results[i]->done) {
+                results[i]->complete(QCONTENTHUB_ERROR);
+            }
+        }
+    }
+    __sync_fetch_and_sub(&m_in_flight, 1);
+}
+
+QContentHubFuture QContentHubClient::push(const std::string &queue, const std::string &data)
+{
+    client_result_ptr result(new client_result_t());
+    if (m_window_us <= 0 || m_max_items <= 1) {
+        call_ptr call(new call_t(this, call_t::PUSH));
+        call->items.push_back(data);
+        call->results.push_back(result);
+        __sync_fetch_and_add(&m_in_flight, 1);
+        attach(next_connection()->call("push", queue, call->items[0]), call);
+        return QContentHubFuture(result);
+    }
+
+    batch_t full;
+    pthread_mutex_lock(&m_batch_lock);
+    batch_t &batch = m_batches[queue];
+    if (batch.items.empty()) {
+        batch.first_usec = qcontenthub_usec();
+    }
+    batch.items.push_back(data);
+    batch.results.push_back(result);
+    if ((int)batch.items.size() >= m_max_items) {
+        full.items.swap(batch.items);
+        full.results.swap(batch.results);
+        m_batches.erase(queue);
+    }
+    m_has_batches = !m_batches.empty();
+    pthread_mutex_unlock(&m_batch_lock);
+
+    if (!full.items.empty()) {
+        send_batch(queue, full);
+    }
+    return QContentHubFuture(result);
+}
+
+void QContentHubClient::send_batch(const std::string &queue, batch_t &batch)
+{
+    call_ptr call(new call_t(this, call_t::PUSH_BATCH));
+    call->items.swap(batch.items);
+    call->results.swap(batch.results);
+    __sync_fetch_and_add(&m_in_flight, 1);
+    attach(next_connection()->call("push_batch", queue, call->items), call);
+}
+
+QContentHubFuture QContentHubClient::pop(const std::string &queue, bool wait)
+{
+    client_result_ptr result(new client_result_t());
+    call_ptr call(new call_t(this, call_t::POP));
+    call->results.push_back(result);
+    __sync_fetch_and_add(&m_in_flight, 1);
+    attach(next_connection()->call(wait ? "pop" : "pop_nowait", queue), call);
+    return QContentHubFuture(result);
+}
+
+QContentHubFuture QContentHubClient::pop_batch(const std::string &queue, int max_items, int max_wait)
+{
+    client_result_ptr result(new client_result_t());
+    call_ptr call(new call_t(this, call_t::POP_BATCH));
+    call->results.push_back(result);
+    __sync_fetch_and_add(&m_in_flight, 1);
+    attach(next_connection()->call("pop_batch", queue, max_items, max_wait), call);
+    return QContentHubFuture(result);
+}
+
+void QContentHubClient::flush()
+{
+    std::map<std::string, batch_t> batches;
+    pthread_mutex_lock(&m_batch_lock);
+    batches.swap(m_batches);
+    m_has_batches = false;
+    pthread_mutex_unlock(&m_batch_lock);
+
+    for (std::map<std::string, batch_t>::iterator it = batches.begin(); it != batches.end(); it++) {
+        send_batch(it->first, it->second);
+    }
+}
+
+bool QContentHubClient::flush_due()
+{
+    if (!m_has_batches) {
+        return true;
+    }
+
+    std::map<std::string, batch_t> due;
+    uint64_t now = qcontenthub_usec();
+    pthread_mutex_lock(&m_batch_lock);
+    std::map<std::string, batch_t>::iterator it = m_batches.begin();
+    while (it != m_batches.end()) {
+        std::map<std::string, batch_t>::iterator cur = it++;
+        if (cur->second.first_usec + m_window_us <= now) {
+            batch_t &batch = due[cur->first];
+            batch.items.swap(cur->second.items);
+            batch.results.swap(cur->second.results);
+            m_batches.erase(cur);
+        }
+    }
+    m_has_batches = !m_batches.empty();
+    pthread_mutex_unlock(&m_batch_lock);
+
+    for (it = due.begin(); it != due.end(); it++) {
+        send_batch(it->first, it->second);
+    }
+    return true;
+}
@@ -0,0 +1,150 @@
+#ifndef QCONTENTHUB_CLIENT_H
+#define QCONTENTHUB_CLIENT_H
+
+#include <msgpack/rpc/client.h>
+#include <mp/memory.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// pushes to a queue gathered into one push_batch by default, and the
+// microsecs the first of them may wait for the rest
+#define QCONTENTHUB_CLIENT_BATCH 64
+#define QCONTENTHUB_CLIENT_WINDOW 1000
+// microsecs between runs of the batch timer
+#define QCONTENTHUB_CLIENT_TICK 250
+
+// reply shared by a QContentHubFuture and the callback answering it
+struct client_result_t {
+    client_result_t(): done(false), status(0) {
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+    ~client_result_t() {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&lock);
+    }
+
+    void complete(int s) {
+        pthread_mutex_lock(&lock);
+        status = s;
+        done = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+    }
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    int status;
+    // payload of a pop, items of a pop_batch
+    std::string data;
+    std::vector<std::string> items;
+};
+
+typedef mp::shared_ptr<client_result_t> client_result_ptr;
+
+// Result of an asynchronous call of QContentHubClient, copyable; every
+// accessor but ready() waits for the reply.
+class QContentHubFuture {
+public:
+    explicit QContentHubFuture(const client_result_ptr &r): m_result(r) {}
+
+    bool ready() const;
+    void wait() const;
+    // QCONTENTHUB_OK, QCONTENTHUB_AGAIN or QCONTENTHUB_ERROR
+    int status() const;
+    const std::string &data() const;
+    const std::vector<std::string> &items() const;
+
+private:
+    client_result_ptr m_result;
+};
+
+// Asynchronous client of the hub queues. Calls return at once with a
+// future and go out over a pool of connections, each carrying many
+// requests in flight. Pushes to a queue are gathered into one
+// push_batch until max_items are waiting or the first has waited
+// window_us, and each push's future gets its item's status from the
+// batch reply. Every method is thread safe.
+class QContentHubClient {
+public:
+    // threads run the replies and the batch timer
+    QContentHubClient(const std::string &host, uint16_t port, int connections = 4, int threads = 2);
+    // sends the gathered pushes and waits for every call in flight
+    ~QContentHubClient();
+
+    // window_us 0 or max_items 1 sends every push on its own
+    void set_batching(int window_us, int max_items);
+
+    // parks on a full queue like push, QCONTENTHUB_AGAIN after the hub's
+    // wait timeout
+    QContentHubFuture push(const std::string &queue, const std::string &data);
+    // wait parks on an empty queue like pop, otherwise pop_nowait;
+    // QCONTENTHUB_AGAIN when there was nothing to pop
+    QContentHubFuture pop(const std::string &queue, bool wait = false);
+    // up to max_items items, waiting max_wait millisecs for the first
+    QContentHubFuture pop_batch(const std::string &queue, int max_items, int max_wait);
+    // sends the gathered pushes now
+    void flush();
+
+    // loop timer, sends the batches whose window has passed
+    bool flush_due();
+
+private:
+    QContentHubClient(const QContentHubClient &);
+    QContentHubClient &operator=(const QContentHubClient &);
+
+    // a call sent and not answered yet, shared by its reply callback and
+    // the thread that attached it
+    struct call_t {
+        enum { PUSH, PUSH_BATCH, POP, POP_BATCH };
+
+        call_t(QContentHubClient *c, int k): client(c), kind(k), replied(0) {}
+
+        QContentHubClient *client;
+        int kind;
+        // set by the one reply() that answers the call
+        volatile int replied;
+        // payloads kept until the reply, the request may reference them
+        std::vector<std::string> items;
+        std::vector<client_result_ptr> results;
+    };
+    typedef mp::shared_ptr<call_t> call_ptr;
+    friend struct reply_fn_t;
+
+    struct batch_t {
+        batch_t(): first_usec(0) {}
+        uint64_t first_usec;
+        std::vector<std::string> items;
+        std::vector<client_result_ptr> results;
+    };
+
+    msgpack::rpc::client *next_connection();
+    // hands call to the reply callback of f, or answers it at once when
+    // the reply came in before the callback was attached; m_in_flight was
+    // raised before f was sent
+    void attach(msgpack::rpc::future f, const call_ptr &call);
+    // answers call once, however many times it is run
+    void reply(msgpack::rpc::future f, const call_ptr &call);
+    void send_batch(const std::string &queue, batch_t &batch);
+
+    msgpack::rpc::loop m_loop;
+    std::vector<msgpack::rpc::client *> m_connections;
+    volatile unsigned int m_next;
+    // calls sent and not answered
+    volatile int m_in_flight;
+
+    // guards the gathered pushes
+    pthread_mutex_t m_batch_lock;
+    std::map<std::string, batch_t> m_batches;
+    // mirrors !m_batches.empty() for the timer
+    volatile bool m_has_batches;
+    volatile int m_window_us;
+    volatile int m_max_items;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef QCONTENTHUB_ITEM_H
+#define QCONTENTHUB_ITEM_H
+
+#include <msgpack.hpp>
+#include <mp/memory.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <string>
+
+// payloads from this size on are referenced instead of copied
+#define QCONTENTHUB_ZEROCOPY_SIZE (16 * 1024)
+
+// Payload of a queue item. A large payload stays in the zone its push was
+// unpacked into, which holds the receive buffer, and is written into the
+// pop reply by reference. A small one is copied so that it does not pin a
+// whole receive buffer while it sits in the queue.
+class QContentItem {
+public:
+    QContentItem(): m_ref(NULL), m_size(0), m_stamp(0) {}
+
+    // obj must be a raw living in life
+    void assign(const msgpack::object &obj, const mp::shared_ptr<msgpack::zone> &life) {
+        if (obj.type != msgpack::type::RAW) {
+            throw msgpack::type_error();
+        }
+        if (obj.via.raw.size >= QCONTENTHUB_ZEROCOPY_SIZE) {
+            m_ref = obj.via.raw.ptr;
+            m_size = obj.via.raw.size;
+            m_life = life;
+            std::string().swap(m_copy);
+        } else {
+            m_ref = NULL;
+            m_size = 0;
+            m_life.reset();
+            m_copy.assign(obj.via.raw.ptr, obj.via.raw.size);
+        }
+    }
+
+    // takes the bytes of str, which is left empty
+    void take(std::string &str) {
+        m_ref = NULL;
+        m_size = 0;
+        m_life.reset();
+        m_copy.swap(str);
+        std::string().swap(str);
+    }
+
+    void swap(QContentItem &other) {
+        std::swap(m_ref, other.m_ref);
+        std::swap(m_size, other.m_size);
+        std::swap(m_stamp, other.m_stamp);
+        m_life.swap(other.m_life);
+        m_copy.swap(other.m_copy);
+    }
+
+    const char *data() const { return m_ref != NULL ? m_ref : m_copy.data(); }
+    size_t size() const { return m_ref != NULL ? m_size : m_copy.size(); }
+
+    // monotonic microsecs the item entered its queue
+    uint64_t stamp() const { return m_stamp; }
+    void set_stamp(uint64_t usec) { m_stamp = usec; }
+
+private:
+    const char *m_ref;
+    size_t m_size;
+    uint64_t m_stamp;
+    mp::shared_ptr<msgpack::zone> m_life;
+    std::string m_copy;
+};
+
+#endif
@@ -0,0 +1,549 @@
+#include "qcontenthub_log.h"
+#include "qcontenthub.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#define RECORD_HEADER_SIZE 8
+
+static uint32_t crc_table[256];
+
+static struct crc_table_init_t {
+    crc_table_init_t() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            crc_table[i] = c;
+        }
+    }
+} crc_table_init;
+
+uint32_t qcontenthub_crc32(const char *data, size_t size)
+{
+    uint32_t c = 0xffffffff;
+    for (size_t i = 0; i < size; i++) {
+        c = crc_table[(c ^ (unsigned char)data[i]) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xffffffff;
+}
+
+static std::string segment_path(const std::string &dir, uint64_t base)
+{
+    char buf[32];
+    sprintf(buf, "/%016llx.log", (unsigned long long)base);
+    return dir + buf;
+}
+
+static void sync_dir(const std::string &dir)
+{
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+QContentFlushSignal::QContentFlushSignal(): m_sleeping(0), m_woken(0)
+{
+    pthread_mutex_init(&m_lock, NULL);
+    pthread_cond_init(&m_cond, NULL);
+}
+
+QContentFlushSignal::~QContentFlushSignal()
+{
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_lock);
+}
+
+void QContentFlushSignal::wake()
+{
+    if (!m_woken) {
+        m_woken = 1;
+    }
+    // pairs with the fence in wait(): either the sleeper sees m_woken or
+    // we see m_sleeping
+    __sync_synchronize();
+    if (m_sleeping) {
+        pthread_mutex_lock(&m_lock);
+        pthread_cond_signal(&m_cond);
+        pthread_mutex_unlock(&m_lock);
+    }
+}
+
+void QContentFlushSignal::wait(int timeout_ms)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t usec = now.tv_usec + (uint64_t)timeout_ms * 1000;
+    struct timespec deadline;
+    deadline.tv_sec = now.tv_sec + usec / 1000000;
+    deadline.tv_nsec = (usec % 1000000) * 1000;
+
+    pthread_mutex_lock(&m_lock);
+    m_sleeping = 1;
+    __sync_synchronize();
+    if (!m_woken) {
+        pthread_cond_timedwait(&m_cond, &m_lock, &deadline);
+    }
+    m_sleeping = 0;
+    m_woken = 0;
+    pthread_mutex_unlock(&m_lock);
+}
+
+QContentLog::QContentLog(const std::string &dir, QContentFlushSignal *signal): m_dir(dir), m_signal(signal), m_refs(1), m_fd(-1), m_removed(false), m_segment_size(0), m_checkpointed(0), m_end(0), m_consumed(0), m_failed(false), m_dropped(false), m_lost_from(0)
+{
+    pthread_mutex_init(&m_io_lock, NULL);
+    pthread_mutex_init(&m_lock, NULL);
+}
+
+QContentLog::~QContentLog()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+    pthread_mutex_destroy(&m_io_lock);
+    pthread_mutex_destroy(&m_lock);
+}
+
+void QContentLog::retain()
+{
+    __sync_add_and_fetch(&m_refs, 1);
+}
+
+void QContentLog::release()
+{
+    if (__sync_sub_and_fetch(&m_refs, 1) == 0) {
+        delete this;
+    }
+}
+
+int QContentLog::open(std::queue<std::string> &items)
+{
+    if (mkdir(m_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        perror(m_dir.c_str());
+        return QCONTENTHUB_ERROR;
+    }
+
+    uint64_t consumed = 0;
+    FILE *fp = fopen((m_dir + "/offset").c_str(), "r");
+    if (fp != NULL) {
+        unsigned long long offset;
+        if (fscanf(fp, "%llu", &offset) == 1) {
+            consumed = offset;
+        }
+        fclose(fp);
+    }
+
+    std::vector<uint64_t> segments;
+    DIR *d = opendir(m_dir.c_str());
+    if (d == NULL) {
+        perror(m_dir.c_str());
+        return QCONTENTHUB_ERROR;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        unsigned long long base;
+        char suffix[8];
+        if (strlen(entry->d_name) == 20 && sscanf(entry->d_name, "%16llx%4s", &base, suffix) == 2 && strcmp(suffix, ".log") == 0) {
+            segments.push_back(base);
+        }
+    }
+    closedir(d);
+    std::sort(segments.begin(), segments.end());
+
+    // replay everything past the checkpoint, stop at the first record a
+    // crash left torn and drop whatever follows it
+    uint64_t end = consumed;
+    uint64_t last_size = 0;
+    bool torn = false;
+    std::vector<uint64_t> kept;
+    for (size_t i = 0; i < segments.size(); i++) {
+        std::string path = segment_path(m_dir, segments[i]);
+        if (torn) {
+            unlink(path.c_str());
+            continue;
+        }
+
+        int fd = ::open(path.c_str(), O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            perror(path.c_str());
+            if (fd >= 0) {
+                close(fd);
+            }
+            return QCONTENTHUB_ERROR;
+        }
+
+        uint64_t size = st.st_size;
+        uint64_t pos = consumed > segments[i] ? consumed - segments[i] : 0;
+        if (pos < size) {
+            char *data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                perror(path.c_str());
+                close(fd);
+                return QCONTENTHUB_ERROR;
+            }
+            madvise(data, size, MADV_SEQUENTIAL);
+            while (pos + RECORD_HEADER_SIZE <= size) {
+                uint32_t len, crc;
+                memcpy(&len, data + pos, 4);
+                memcpy(&crc, data + pos + 4, 4);
+                if (pos + RECORD_HEADER_SIZE + len > size || qcontenthub_crc32(data + pos + RECORD_HEADER_SIZE, len) != crc) {
+                    break;
+                }
+                items.push(std::string(data + pos + RECORD_HEADER_SIZE, len));
+                pos += RECORD_HEADER_SIZE + len;
+            }
+            munmap(data, size);
+
+            if (pos < size) {
+                fprintf(stderr, "%s: torn record at %llu, truncated\n", path.c_str(), (unsigned long long)pos);
+                if (ftruncate(fd, pos) != 0) {
+                    perror(path.c_str());
+                }
+                size = pos;
+                torn = true;
+            }
+        }
+        close(fd);
+
+        end = segments[i] + size;
+        last_size = size;
+        kept.push_back(segments[i]);
+    }
+
+    // the checkpoint can be ahead of data that never reached the disk
+    if (consumed > end) {
+        consumed = end;
+    }
+
+    m_end = end;
+    m_consumed = consumed;
+    m_checkpointed = consumed;
+    if (kept.empty()) {
+        if (!open_segment(end)) {
+            return QCONTENTHUB_ERROR;
+        }
+    } else {
+        std::string path = segment_path(m_dir, kept.back());
+        m_fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+        if (m_fd < 0) {
+            perror(path.c_str());
+            return QCONTENTHUB_ERROR;
+        }
+        m_segments = kept;
+        m_segment_size = last_size;
+    }
+    drop_segments(consumed);
+
+    return QCONTENTHUB_OK;
+}
+
+bool QContentLog::write_meta(int capacity, int flags, int64_t max_bytes)
+{
+    // remove() holds the io lock too, so a deleted queue gets no meta back
+    pthread_mutex_lock(&m_io_lock);
+    if (m_removed) {
+        pthread_mutex_unlock(&m_io_lock);
+        return false;
+    }
+    std::string path = m_dir + "/meta";
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (fp == NULL) {
+        perror(tmp.c_str());
+        pthread_mutex_unlock(&m_io_lock);
+        return false;
+    }
+    fprintf(fp, "%d %d %lld\n", capacity, flags, (long long)max_bytes);
+    fflush(fp);
+    fsync(fileno(fp));
+    fclose(fp);
+    bool ret = rename(tmp.c_str(), path.c_str()) == 0;
+    pthread_mutex_unlock(&m_io_lock);
+    return ret;
+}
+
+bool QContentLog::read_meta(const std::string &dir, int &capacity, int &flags, int64_t &max_bytes)
+{
+    FILE *fp = fopen((dir + "/meta").c_str(), "r");
+    if (fp == NULL) {
+        return false;
+    }
+    // older meta files have no byte limit
+    long long bytes = 0;
+    bool ret = fscanf(fp, "%d %d %lld", &capacity, &flags, &bytes) >= 2;
+    max_bytes = bytes;
+    fclose(fp);
+    return ret;
+}
+
+void QContentLog::append(const char *data, size_t size)
+{
+    uint32_t len = size;
+    uint32_t crc = qcontenthub_crc32(data, size);
+
+    pthread_mutex_lock(&m_lock);
+    m_buf.append((const char *)&len, 4);
+    m_buf.append((const char *)&crc, 4);
+    m_buf.append(data, size);
+    m_end += RECORD_HEADER_SIZE + len;
+    pthread_mutex_unlock(&m_lock);
+
+    if (m_signal != NULL) {
+        m_signal->wake();
+    }
+}
+
+void QContentLog::consume(size_t obj_size)
+{
+    pthread_mutex_lock(&m_lock);
+    m_consumed += RECORD_HEADER_SIZE + obj_size;
+    pthread_mutex_unlock(&m_lock);
+}
+
+void QContentLog::reply_after_commit(const msgpack::rpc::request &req, int result)
+{
+    pthread_mutex_lock(&m_lock);
+    if (m_removed || m_dropped) {
+        // the record of a push after drop_lost() is gone with the rest
+        if (m_dropped) {
+            result = QCONTENTHUB_ERROR;
+        }
+        pthread_mutex_unlock(&m_lock);
+        msgpack::rpc::request r(req);
+        r.result(result);
+        return;
+    }
+    m_pending.push_back(pending_t(req, result));
+    pthread_mutex_unlock(&m_lock);
+}
+
+int QContentLog::commit()
+{
+    std::string buf;
+    std::vector<pending_t> pending;
+    int ret = QCONTENTHUB_OK;
+
+    pthread_mutex_lock(&m_io_lock);
+    pthread_mutex_lock(&m_lock);
+    // the pushes of a failed log wait in m_pending for fail_pending()
+    if (!m_failed) {
+        buf.swap(m_buf);
+        pending.swap(m_pending);
+    }
+    uint64_t consumed = m_consumed;
+    pthread_mutex_unlock(&m_lock);
+
+    if (m_removed || (buf.empty() && pending.empty() && consumed == m_checkpointed)) {
+        pthread_mutex_unlock(&m_io_lock);
+        return QCONTENTHUB_AGAIN;
+    }
+
+    if (!buf.empty()) {
+        size_t written = 0;
+        while (written < buf.size()) {
+            ssize_t n = write(m_fd, buf.data() + written, buf.size() - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0) {
+                break;
+            }
+            written += n;
+        }
+        if (written < buf.size() || fdatasync(m_fd) != 0) {
+            perror(m_dir.c_str());
+            // cut the torn or unsynced bytes, a replay stops at the first
+            // bad record and would lose everything appended after them
+            if (ftruncate(m_fd, m_segment_size) != 0) {
+                perror(m_dir.c_str());
+            }
+            pthread_mutex_lock(&m_lock);
+            m_failed = true;
+            m_lost_from = m_segments.back() + m_segment_size;
+            if (consumed > m_lost_from) {
+                consumed = m_lost_from;
+            }
+            pending.insert(pending.end(), m_pending.begin(), m_pending.end());
+            m_pending.swap(pending);
+            pending.clear();
+            pthread_mutex_unlock(&m_lock);
+            ret = QCONTENTHUB_ERROR;
+        } else {
+            m_segment_size += written;
+            if (m_segment_size >= QCONTENTHUB_SEGMENT_SIZE) {
+                open_segment(m_segments.back() + m_segment_size);
+            }
+        }
+    }
+
+    if (consumed != m_checkpointed) {
+        checkpoint(consumed);
+        drop_segments(consumed);
+    }
+    pthread_mutex_unlock(&m_io_lock);
+
+    reply(pending);
+    return ret;
+}
+
+uint64_t QContentLog::drop_lost()
+{
+    pthread_mutex_lock(&m_lock);
+    uint64_t from = std::max(m_lost_from, m_consumed);
+    uint64_t lost = m_end > from ? m_end - from : 0;
+    m_buf.clear();
+    m_end = m_lost_from;
+    if (m_consumed > m_lost_from) {
+        m_consumed = m_lost_from;
+    }
+    m_dropped = true;
+    pthread_mutex_unlock(&m_lock);
+    return lost;
+}
+
+void QContentLog::fail_pending()
+{
+    std::vector<pending_t> pending;
+    pthread_mutex_lock(&m_lock);
+    pending.swap(m_pending);
+    pthread_mutex_unlock(&m_lock);
+
+    for (size_t i = 0; i < pending.size(); i++) {
+        pending[i].result = QCONTENTHUB_ERROR;
+    }
+    reply(pending);
+}
+
+uint64_t QContentLog::record_size(size_t size)
+{
+    return RECORD_HEADER_SIZE + size;
+}
+
+void QContentLog::remove()
+{
+    std::vector<pending_t> pending;
+
+    pthread_mutex_lock(&m_io_lock);
+    pthread_mutex_lock(&m_lock);
+    m_removed = true;
+    m_buf.clear();
+    pending.swap(m_pending);
+    bool failed = m_failed;
+    pthread_mutex_unlock(&m_lock);
+
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+    for (size_t i = 0; i < m_segments.size(); i++) {
+        unlink(segment_path(m_dir, m_segments[i]).c_str());
+    }
+    m_segments.clear();
+    unlink((m_dir + "/offset").c_str());
+    unlink((m_dir + "/meta").c_str());
+    rmdir(m_dir.c_str());
+    pthread_mutex_unlock(&m_io_lock);
+
+    // the items were accepted before del dropped them, unless their
+    // records never reached the disk
+    if (failed) {
+        for (size_t i = 0; i < pending.size(); i++) {
+            pending[i].result = QCONTENTHUB_ERROR;
+        }
+    }
+    reply(pending);
+}
+
+bool QContentLog::open_segment(uint64_t base)
+{
+    std::string path = segment_path(m_dir, base);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror(path.c_str());
+        return false;
+    }
+    sync_dir(m_dir);
+
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+    m_fd = fd;
+    m_segments.push_back(base);
+    m_segment_size = 0;
+    return true;
+}
+
+void QContentLog::checkpoint(uint64_t consumed)
+{
+    // not synced: a stale checkpoint only means records are delivered again
+    std::string path = m_dir + "/offset";
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (fp == NULL) {
+        perror(tmp.c_str());
+        return;
+    }
+    fprintf(fp, "%llu\n", (unsigned long long)consumed);
+    fclose(fp);
+    if (rename(tmp.c_str(), path.c_str()) == 0) {
+        m_checkpointed = consumed;
+    }
+}
+
+void QContentLog::drop_segments(uint64_t consumed)
+{
+    size_t drop = 0;
+    while (drop + 1 < m_segments.size() && m_segments[drop + 1] <= consumed) {
+        unlink(segment_path(m_dir, m_segments[drop]).c_str());
+        drop++;
+    }
+    m_segments.erase(m_segments.begin(), m_segments.begin() + drop);
+}
+
+void QContentLog::reply(std::vector<pending_t> &pending)
+{
+    for (size_t i = 0; i < pending.size(); i++) {
+        pending[i].req.result(pending[i].result);
+    }
+}
+
+std::string QContentLog::queue_dir(const std::string &store, const std::string &name)
+{
+    // queue names may hold any byte, so hex encode them
+    static const char hex[] = "0123456789abcdef";
+    std::string dir = store + "/q_";
+    for (size_t i = 0; i < name.size(); i++) {
+        dir.push_back(hex[(unsigned char)name[i] >> 4]);
+        dir.push_back(hex[(unsigned char)name[i] & 0xf]);
+    }
+    return dir;
+}
+
+bool QContentLog::queue_name(const std::string &entry, std::string &name)
+{
+    if (entry.compare(0, 2, "q_") != 0 || entry.size() % 2 != 0) {
+        return false;
+    }
+    name.clear();
+    for (size_t i = 2; i < entry.size(); i += 2) {
+        unsigned int c;
+        if (sscanf(entry.c_str() + i, "%2x", &c) != 1) {
+            return false;
+        }
+        name.push_back((char)c);
+    }
+    return true;
+}
@@ -0,0 +1,154 @@
+#ifndef QCONTENTHUB_LOG_H
+#define QCONTENTHUB_LOG_H
+
+#include <msgpack/rpc/server.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <queue>
+#include <string>
+#include <vector>
+
+// roll over to a new segment file past this size
+#define QCONTENTHUB_SEGMENT_SIZE (64 * 1024 * 1024)
+// millisecs an idle flusher sleeps before it checkpoints the pops
+#define QCONTENTHUB_CHECKPOINT_INTERVAL 100
+
+// crc of a record payload, also used by the url queue store
+uint32_t qcontenthub_crc32(const char *data, size_t size);
+
+// Sleep and wake-up of the thread running QContentLog::commit(). An
+// append wakes it, and only takes the lock while it sleeps.
+class QContentFlushSignal {
+public:
+    QContentFlushSignal();
+    ~QContentFlushSignal();
+
+    void wake();
+    // returns once woken, at once if woken since the last wait, or after
+    // timeout_ms
+    void wait(int timeout_ms);
+
+private:
+    QContentFlushSignal(const QContentFlushSignal &);
+    QContentFlushSignal &operator=(const QContentFlushSignal &);
+
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_cond;
+    volatile int m_sleeping;
+    volatile int m_woken;
+};
+
+// Append-only segment log of a persistent hub queue.
+//
+// A queue directory holds a meta file (capacity, flags and byte limit), a
+// checkpoint file with the offset of the first unconsumed record, and
+// segment files named after the logical offset of their first record. A
+// record is a 32 bit length, a 32 bit crc of the payload and the payload.
+//
+// append() only copies into a buffer under the queue lock, so records
+// are logged in queue order. commit(), run by the flusher thread, writes
+// the buffer with one write and one fdatasync and only then answers the
+// pushes registered with reply_after_commit() (group commit). Pops
+// advance the consumed offset, which is checkpointed lazily, so a crash
+// may deliver records popped since the last commit again.
+//
+// A failed write or sync cuts the segment back to the last synced record
+// and leaves the log failed: it takes no more records, and the pushes of
+// the records that did not make it are answered QCONTENTHUB_ERROR once
+// the queue has dropped their items with drop_lost().
+class QContentLog {
+public:
+    // appends wake signal when there is one
+    explicit QContentLog(const std::string &dir, QContentFlushSignal *signal = NULL);
+
+    // reference counted, so the flusher can do io on a log whose queue is
+    // freed meanwhile; starts with one reference
+    void retain();
+    void release();
+
+    // creates the directory or replays the records not consumed yet into
+    // items, cutting off a torn tail left by a crash
+    int open(std::queue<std::string> &items);
+
+    // takes the io lock, call it without the queue lock
+    bool write_meta(int capacity, int flags, int64_t max_bytes);
+    static bool read_meta(const std::string &dir, int &capacity, int &flags, int64_t &max_bytes);
+
+    // the caller holds the queue lock
+    void append(const char *data, size_t size);
+    void consume(size_t obj_size);
+
+    // answers req with result once every record appended so far is on disk
+    void reply_after_commit(const msgpack::rpc::request &req, int result);
+
+    // writes and syncs the buffered records, answers the pending pushes,
+    // checkpoints and drops fully consumed segments; QCONTENTHUB_AGAIN
+    // when there was nothing to do, QCONTENTHUB_ERROR when the log failed
+    // in this call
+    int commit();
+
+    bool failed() const { return m_failed; }
+    // on a failed log, called under the queue lock: forgets the records
+    // past the last synced one and returns the bytes they took, the
+    // queue drops the items of as many records from its tail
+    uint64_t drop_lost();
+    // answers the pushes of the lost records with QCONTENTHUB_ERROR
+    void fail_pending();
+
+    // bytes a payload of size takes in a segment
+    static uint64_t record_size(size_t size);
+
+    // deletes the files of a deleted queue
+    void remove();
+
+    // directory of queue name below the store directory, and back
+    static std::string queue_dir(const std::string &store, const std::string &name);
+    static bool queue_name(const std::string &entry, std::string &name);
+
+private:
+    QContentLog(const QContentLog &);
+    QContentLog &operator=(const QContentLog &);
+    ~QContentLog();
+
+    struct pending_t {
+        pending_t(const msgpack::rpc::request &r, int res): req(r), result(res) {}
+        msgpack::rpc::request req;
+        int result;
+    };
+
+    bool open_segment(uint64_t base);
+    void checkpoint(uint64_t consumed);
+    void drop_segments(uint64_t consumed);
+    void reply(std::vector<pending_t> &pending);
+
+    std::string m_dir;
+    QContentFlushSignal *m_signal;
+    volatile int m_refs;
+
+    // guards the file state below, held by commit() while it does io so
+    // appenders are never stuck behind a fdatasync
+    pthread_mutex_t m_io_lock;
+    int m_fd;
+    bool m_removed;
+    // base offsets of the segment files, the last one is open in m_fd
+    std::vector<uint64_t> m_segments;
+    uint64_t m_segment_size;
+    uint64_t m_checkpointed;
+
+    // guards the members below, taken inside the queue lock by append()
+    pthread_mutex_t m_lock;
+    std::string m_buf;
+    std::vector<pending_t> m_pending;
+    // logical offset just past the last record appended
+    uint64_t m_end;
+    // logical offset of the first record not popped yet
+    uint64_t m_consumed;
+    // set by a failed commit, with the logical offset past the last synced
+    // record; dropped once drop_lost() has run
+    volatile bool m_failed;
+    bool m_dropped;
+    uint64_t m_lost_from;
+};
+
+#endif
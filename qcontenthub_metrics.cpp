@@ -0,0 +1,180 @@
+#include "qcontenthub_metrics.h"
+
+#include <cstdio>
+#include <set>
+
+void metric_set_t::add_latency(const std::string &name, const QContentHistogram &h)
+{
+    std::map<std::string, uint64_t> &l = latency[name];
+    l["count"] = h.count();
+    l["sum"] = h.sum();
+    l["p50"] = h.percentile(50);
+    l["p99"] = h.percentile(99);
+    l["p999"] = h.percentile(99.9);
+}
+
+void metric_set_t::append_stat(std::string &out) const
+{
+    char buf[64];
+    for (std::map<std::string, uint64_t>::const_iterator it = counters.begin(); it != counters.end(); it++) {
+        sprintf(buf, " %llu\n", (unsigned long long)it->second);
+        out.append("STAT ");
+        out.append(it->first);
+        out.append(buf);
+    }
+    for (std::map<std::string, int64_t>::const_iterator it = gauges.begin(); it != gauges.end(); it++) {
+        sprintf(buf, " %lld\n", (long long)it->second);
+        out.append("STAT ");
+        out.append(it->first);
+        out.append(buf);
+    }
+    for (std::map<std::string, std::map<std::string, uint64_t> >::const_iterator it = latency.begin(); it != latency.end(); it++) {
+        const std::map<std::string, uint64_t> &l = it->second;
+        for (std::map<std::string, uint64_t>::const_iterator lit = l.begin(); lit != l.end(); lit++) {
+            sprintf(buf, " %llu\n", (unsigned long long)lit->second);
+            out.append("STAT ");
+            out.append(it->first);
+            out.append("_");
+            out.append(lit->first);
+            out.append(lit->first == "count" ? "" : "_us");
+            out.append(buf);
+        }
+    }
+}
+
+// label values may hold anything a queue or site name holds
+static void append_label(std::string &out, const std::string &key, const std::string &value)
+{
+    out.append(key);
+    out.append("=\"");
+    for (size_t i = 0; i < value.size(); i++) {
+        char c = value[i];
+        if (c == '\\' || c == '"') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (c == '\n') {
+            out.append("\\n");
+        } else {
+            out.push_back(c);
+        }
+    }
+    out.append("\"");
+}
+
+static void append_sample(std::string &out, const std::string &name, const std::string &labels, const char *value)
+{
+    out.append(name);
+    if (!labels.empty()) {
+        out.append("{");
+        out.append(labels);
+        out.append("}");
+    }
+    out.append(" ");
+    out.append(value);
+    out.append("\n");
+}
+
+static void append_type(std::string &out, const std::string &name, const char *type)
+{
+    out.append("# TYPE ");
+    out.append(name);
+    out.append(" ");
+    out.append(type);
+    out.append("\n");
+}
+
+// the samples of every set in sets for one metric, below one TYPE line
+static void append_metric(std::string &out, const std::string &name, const std::string &key, int kind,
+        const std::map<std::string, const metric_set_t *> &sets, const std::string &label)
+{
+    static const char *quantiles[3][2] = { { "p50", "0.5" }, { "p99", "0.99" }, { "p999", "0.999" } };
+    static const char *types[3] = { "counter", "gauge", "summary" };
+    char buf[64];
+
+    append_type(out, name, types[kind]);
+    for (std::map<std::string, const metric_set_t *>::const_iterator it = sets.begin(); it != sets.end(); it++) {
+        const metric_set_t &set = *it->second;
+        std::string labels;
+        if (!label.empty()) {
+            append_label(labels, label, it->first);
+        }
+        if (kind == 0) {
+            std::map<std::string, uint64_t>::const_iterator c = set.counters.find(key);
+            if (c != set.counters.end()) {
+                sprintf(buf, "%llu", (unsigned long long)c->second);
+                append_sample(out, name, labels, buf);
+            }
+        } else if (kind == 1) {
+            std::map<std::string, int64_t>::const_iterator g = set.gauges.find(key);
+            if (g != set.gauges.end()) {
+                sprintf(buf, "%lld", (long long)g->second);
+                append_sample(out, name, labels, buf);
+            }
+        } else {
+            std::map<std::string, std::map<std::string, uint64_t> >::const_iterator l = set.latency.find(key);
+            if (l == set.latency.end()) {
+                continue;
+            }
+            for (int i = 0; i < 3; i++) {
+                std::map<std::string, uint64_t>::const_iterator q = l->second.find(quantiles[i][0]);
+                std::string qlabels = labels;
+                if (!qlabels.empty()) {
+                    qlabels.append(",");
+                }
+                append_label(qlabels, "quantile", quantiles[i][1]);
+                sprintf(buf, "%llu", (unsigned long long)(q == l->second.end() ? 0 : q->second));
+                append_sample(out, name, qlabels, buf);
+            }
+            std::map<std::string, uint64_t>::const_iterator sum = l->second.find("sum");
+            std::map<std::string, uint64_t>::const_iterator count = l->second.find("count");
+            sprintf(buf, "%llu", (unsigned long long)(sum == l->second.end() ? 0 : sum->second));
+            append_sample(out, name + "_sum", labels, buf);
+            sprintf(buf, "%llu", (unsigned long long)(count == l->second.end() ? 0 : count->second));
+            append_sample(out, name + "_count", labels, buf);
+        }
+    }
+}
+
+static void append_sets(std::string &out, const std::string &prefix,
+        const std::map<std::string, const metric_set_t *> &sets, const std::string &label)
+{
+    std::set<std::string> names[3];
+    for (std::map<std::string, const metric_set_t *>::const_iterator it = sets.begin(); it != sets.end(); it++) {
+        const metric_set_t &set = *it->second;
+        for (std::map<std::string, uint64_t>::const_iterator c = set.counters.begin(); c != set.counters.end(); c++) {
+            names[0].insert(c->first);
+        }
+        for (std::map<std::string, int64_t>::const_iterator g = set.gauges.begin(); g != set.gauges.end(); g++) {
+            names[1].insert(g->first);
+        }
+        for (std::map<std::string, std::map<std::string, uint64_t> >::const_iterator l = set.latency.begin(); l != set.latency.end(); l++) {
+            names[2].insert(l->first);
+        }
+    }
+    for (int kind = 0; kind < 3; kind++) {
+        for (std::set<std::string>::const_iterator it = names[kind].begin(); it != names[kind].end(); it++) {
+            std::string name = prefix + "_" + *it;
+            if (kind == 0) {
+                name.append("_total");
+            } else if (kind == 2) {
+                name.append("_us");
+            }
+            append_metric(out, name, *it, kind, sets, label);
+        }
+    }
+}
+
+std::string metrics_snapshot_t::text() const
+{
+    std::string out;
+    std::map<std::string, const metric_set_t *> sets;
+    sets[""] = &server;
+    append_sets(out, prefix, sets, "");
+
+    sets.clear();
+    for (std::map<std::string, metric_set_t>::const_iterator it = children.begin(); it != children.end(); it++) {
+        sets[it->first] = &it->second;
+    }
+    append_sets(out, prefix + "_" + child, sets, child);
+    return out;
+}
@@ -0,0 +1,129 @@
+#ifndef QCONTENTHUB_METRICS_H
+#define QCONTENTHUB_METRICS_H
+
+#include <msgpack.hpp>
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <string>
+
+// monotonic microsecs for durations
+static inline uint64_t qcontenthub_usec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Histogram of microsecs with one bucket per power of two, updated with
+// relaxed atomic adds so recording never takes a lock. Percentiles are
+// the upper bound of their bucket, so they are off by up to 2x.
+class QContentHistogram {
+public:
+    enum { BUCKETS = 40 };
+
+    QContentHistogram(): m_sum(0) {
+        memset((void *)m_counts, 0, sizeof(m_counts));
+    }
+
+    void add(uint64_t usec) {
+        int b = usec == 0 ? 0 : 64 - __builtin_clzll(usec);
+        if (b >= BUCKETS) {
+            b = BUCKETS - 1;
+        }
+        __atomic_fetch_add(&m_counts[b], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&m_sum, usec, __ATOMIC_RELAXED);
+    }
+
+    uint64_t count() const {
+        uint64_t n = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            n += __atomic_load_n(&m_counts[b], __ATOMIC_RELAXED);
+        }
+        return n;
+    }
+
+    uint64_t sum() const {
+        return __atomic_load_n(&m_sum, __ATOMIC_RELAXED);
+    }
+
+    // p in percent, 0 when empty
+    uint64_t percentile(double p) const {
+        uint64_t counts[BUCKETS];
+        uint64_t n = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            counts[b] = __atomic_load_n(&m_counts[b], __ATOMIC_RELAXED);
+            n += counts[b];
+        }
+        // nearest rank, counted from 0
+        uint64_t rank = (uint64_t)ceil(n * p / 100.0);
+        rank = rank > 0 ? rank - 1 : 0;
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS && n > 0; b++) {
+            seen += counts[b];
+            if (seen > rank) {
+                return b == 0 ? 0 : ((uint64_t)1 << b) - 1;
+            }
+        }
+        return 0;
+    }
+
+private:
+    // bucket b > 0 counts values in [2^(b-1), 2^b)
+    volatile uint64_t m_counts[BUCKETS];
+    volatile uint64_t m_sum;
+};
+
+// Metrics of a server, a queue or a site, packed as a msgpack map of
+// {"counters": {name: n}, "gauges": {name: n},
+//  "latency_us": {name: {"count", "sum", "p50", "p99", "p999"}}}
+struct metric_set_t {
+    std::map<std::string, uint64_t> counters;
+    std::map<std::string, int64_t> gauges;
+    std::map<std::string, std::map<std::string, uint64_t> > latency;
+
+    void add_latency(const std::string &name, const QContentHistogram &h);
+    // memcached style STAT lines
+    void append_stat(std::string &out) const;
+
+    template <typename Packer>
+    void msgpack_pack(Packer &pk) const {
+        pk.pack_map(3);
+        pk.pack(std::string("counters"));
+        pk.pack(counters);
+        pk.pack(std::string("gauges"));
+        pk.pack(gauges);
+        pk.pack(std::string("latency_us"));
+        pk.pack(latency);
+    }
+};
+
+// Reply of the metrics RPC, the server set and one set per queue or site,
+// packed as {"server": set, "<child>s": {name: set}}. It is built from a
+// copy taken under the server locks, so rendering holds no lock.
+struct metrics_snapshot_t {
+    metrics_snapshot_t(const std::string &p, const std::string &c): prefix(p), child(c) {}
+
+    // Prometheus text exposition, metric names start with prefix and the
+    // per child ones carry a child="name" label
+    std::string text() const;
+
+    template <typename Packer>
+    void msgpack_pack(Packer &pk) const {
+        pk.pack_map(2);
+        pk.pack(std::string("server"));
+        pk.pack(server);
+        pk.pack(child + "s");
+        pk.pack(children);
+    }
+
+    std::string prefix;
+    std::string child;
+    metric_set_t server;
+    std::map<std::string, metric_set_t> children;
+};
+
+#endif
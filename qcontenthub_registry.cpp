@@ -0,0 +1,183 @@
+#include "qcontenthub_registry.h"
+#include "qcontenthub.h"
+
+#include <stdlib.h>
+#include <new>
+
+QueueRegistry::QueueRegistry(void (*free_queue)(queue_t *)): m_map(new map_t()), m_epoch(1), m_free_queue(free_queue)
+{
+    pthread_key_create(&m_reader_key, &QueueRegistry::release_reader);
+    pthread_mutex_init(&m_readers_lock, NULL);
+    pthread_mutex_init(&m_write_lock, NULL);
+}
+
+QueueRegistry::~QueueRegistry()
+{
+    pthread_key_delete(m_reader_key);
+
+    for (size_t i = 0; i < m_retired.size(); i++) {
+        delete m_retired[i].map;
+        if (m_retired[i].queue != NULL) {
+            m_free_queue(m_retired[i].queue);
+        }
+    }
+    for (map_t::iterator it = m_map->begin(); it != m_map->end(); it++) {
+        m_free_queue(it->second);
+    }
+    delete m_map;
+
+    for (size_t i = 0; i < m_readers.size(); i++) {
+        free(m_readers[i]);
+    }
+    pthread_mutex_destroy(&m_readers_lock);
+    pthread_mutex_destroy(&m_write_lock);
+}
+
+QueueRegistry::reader_t *QueueRegistry::get_reader()
+{
+    reader_t *r = (reader_t *)pthread_getspecific(m_reader_key);
+    if (r != NULL) {
+        return r;
+    }
+
+    // first guard on this thread, reuse the slot of an exited thread
+    pthread_mutex_lock(&m_readers_lock);
+    for (size_t i = 0; i < m_readers.size(); i++) {
+        // released without the lock by release_reader()
+        if (!__atomic_load_n(&m_readers[i]->in_use, __ATOMIC_ACQUIRE)) {
+            r = m_readers[i];
+            break;
+        }
+    }
+    if (r == NULL) {
+        void *mem = NULL;
+        if (posix_memalign(&mem, 64, sizeof(reader_t)) != 0) {
+            pthread_mutex_unlock(&m_readers_lock);
+            throw std::bad_alloc();
+        }
+        r = (reader_t *)mem;
+        m_readers.push_back(r);
+    }
+    r->epoch = 0;
+    r->depth = 0;
+    r->in_use = true;
+    pthread_mutex_unlock(&m_readers_lock);
+
+    pthread_setspecific(m_reader_key, r);
+    return r;
+}
+
+void QueueRegistry::release_reader(void *reader)
+{
+    reader_t *r = (reader_t *)reader;
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->in_use, false, __ATOMIC_RELEASE);
+}
+
+QueueRegistry::guard::guard(QueueRegistry &registry): m_registry(registry), m_reader(registry.get_reader())
+{
+    if (m_reader->depth++ == 0) {
+        // pin before loading the snapshot, see publish()
+        uint64_t epoch = __atomic_load_n(&registry.m_epoch, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&m_reader->epoch, epoch, __ATOMIC_SEQ_CST);
+    }
+    m_map = __atomic_load_n(&registry.m_map, __ATOMIC_SEQ_CST);
+}
+
+QueueRegistry::guard::~guard()
+{
+    if (--m_reader->depth == 0) {
+        __atomic_store_n(&m_reader->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+queue_t *QueueRegistry::guard::find(const std::string &name) const
+{
+    map_t::const_iterator it = m_map->find(name);
+    if (it == m_map->end()) {
+        return NULL;
+    }
+    return it->second;
+}
+
+int QueueRegistry::add(const std::string &name, queue_t *q)
+{
+    pthread_mutex_lock(&m_write_lock);
+    if (m_map->find(name) != m_map->end()) {
+        pthread_mutex_unlock(&m_write_lock);
+        return QCONTENTHUB_WARN;
+    }
+    map_t *map = new map_t(*m_map);
+    (*map)[name] = q;
+    publish(map, NULL);
+    pthread_mutex_unlock(&m_write_lock);
+    return QCONTENTHUB_OK;
+}
+
+bool QueueRegistry::remove(const std::string &name, queue_t *q)
+{
+    pthread_mutex_lock(&m_write_lock);
+    map_t::iterator it = m_map->find(name);
+    if (it == m_map->end() || it->second != q) {
+        pthread_mutex_unlock(&m_write_lock);
+        return false;
+    }
+    map_t *map = new map_t(*m_map);
+    map->erase(name);
+    publish(map, q);
+    pthread_mutex_unlock(&m_write_lock);
+    return true;
+}
+
+void QueueRegistry::publish(map_t *map, queue_t *removed)
+{
+    retired_t retired;
+    retired.map = m_map;
+    retired.queue = removed;
+
+    // A guard that pinned an epoch older than the new one may still hold
+    // the old snapshot. A guard pinning the new epoch or later loads its
+    // snapshot after this store and cannot see the retired objects.
+    __atomic_store_n(&m_map, map, __ATOMIC_SEQ_CST);
+    retired.epoch = __atomic_add_fetch(&m_epoch, 1, __ATOMIC_SEQ_CST);
+    m_retired.push_back(retired);
+
+    reclaim_locked();
+}
+
+void QueueRegistry::reclaim()
+{
+    pthread_mutex_lock(&m_write_lock);
+    reclaim_locked();
+    pthread_mutex_unlock(&m_write_lock);
+}
+
+void QueueRegistry::reclaim_locked()
+{
+    if (m_retired.empty()) {
+        return;
+    }
+
+    uint64_t oldest = __atomic_load_n(&m_epoch, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&m_readers_lock);
+    for (size_t i = 0; i < m_readers.size(); i++) {
+        uint64_t epoch = __atomic_load_n(&m_readers[i]->epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    pthread_mutex_unlock(&m_readers_lock);
+
+    size_t kept = 0;
+    for (size_t i = 0; i < m_retired.size(); i++) {
+        if (m_retired[i].epoch <= oldest) {
+            delete m_retired[i].map;
+            if (m_retired[i].queue != NULL) {
+                m_free_queue(m_retired[i].queue);
+            }
+        } else {
+            m_retired[kept++] = m_retired[i];
+        }
+    }
+    m_retired.resize(kept);
+}
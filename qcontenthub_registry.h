@@ -0,0 +1,90 @@
+#ifndef QCONTENTHUB_REGISTRY_H
+#define QCONTENTHUB_REGISTRY_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+
+struct queue_t;
+
+// Queue name lookup for the hub, built for a read-mostly workload.
+//
+// The name table is an immutable hash map snapshot. Readers never lock:
+// a guard pins the current epoch in a per-thread slot, reads the
+// snapshot and unpins. add and remove copy the snapshot under a mutex,
+// publish the copy and retire the old snapshot (and a removed queue)
+// until every guard that could still see it is gone.
+class QueueRegistry {
+public:
+    typedef std::tr1::unordered_map<std::string, queue_t *> map_t;
+
+private:
+    struct reader_t {
+        // epoch pinned by the thread, 0 when outside any guard
+        volatile uint64_t epoch;
+        int depth;
+        bool in_use;
+    } __attribute__((aligned(64)));
+
+    struct retired_t {
+        uint64_t epoch;
+        map_t *map;
+        queue_t *queue;
+    };
+
+public:
+    // free_queue releases queues retired by remove()
+    explicit QueueRegistry(void (*free_queue)(queue_t *));
+    ~QueueRegistry();
+
+    // pins the snapshot current at construction, queues found through it
+    // stay allocated until the guard goes away; guards may nest
+    class guard {
+    public:
+        explicit guard(QueueRegistry &registry);
+        ~guard();
+
+        queue_t *find(const std::string &name) const;
+        const map_t &map() const { return *m_map; }
+
+    private:
+        guard(const guard &);
+        guard &operator=(const guard &);
+
+        QueueRegistry &m_registry;
+        reader_t *m_reader;
+        const map_t *m_map;
+    };
+
+    // QCONTENTHUB_OK, or QCONTENTHUB_WARN when the name is taken
+    int add(const std::string &name, queue_t *q);
+    // unlinks name if it still maps to q, q is freed once no guard sees it
+    bool remove(const std::string &name, queue_t *q);
+    // frees retired snapshots and queues that no guard can see any more
+    void reclaim();
+
+private:
+    QueueRegistry(const QueueRegistry &);
+    QueueRegistry &operator=(const QueueRegistry &);
+
+    reader_t *get_reader();
+    static void release_reader(void *reader);
+    // the caller holds m_write_lock
+    void publish(map_t *map, queue_t *removed);
+    void reclaim_locked();
+
+    map_t * volatile m_map;
+    volatile uint64_t m_epoch;
+    void (*m_free_queue)(queue_t *);
+
+    pthread_key_t m_reader_key;
+    pthread_mutex_t m_readers_lock;
+    std::vector<reader_t *> m_readers;
+
+    pthread_mutex_t m_write_lock;
+    std::vector<retired_t> m_retired;
+};
+
+#endif
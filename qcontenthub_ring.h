@@ -0,0 +1,141 @@
+#ifndef QCONTENTHUB_RING_H
+#define QCONTENTHUB_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+
+#define QCONTENTHUB_CACHE_LINE 64
+
+// Bounded lock-free multi-producer multi-consumer ring. Every slot
+// carries a sequence number telling producers and consumers whose turn
+// it is, so the only shared writes are one CAS on head or tail per
+// operation. Items are swapped in and out, never copied, so T needs a
+// default constructor and swap().
+template <typename T>
+class QContentRing {
+public:
+    // slots is rounded up to a power of two
+    explicit QContentRing(size_t slots);
+    ~QContentRing();
+
+    // swaps obj into the ring, fails when the ring already holds more
+    // than limit items or has no free slot
+    bool push(T &obj, size_t limit);
+    // swaps the oldest item into obj, fails when the ring is empty
+    bool pop(T &obj);
+
+    // approximate while producers or consumers are running
+    size_t size() const;
+    size_t slots() const { return m_mask + 1; }
+
+private:
+    QContentRing(const QContentRing &);
+    QContentRing &operator=(const QContentRing &);
+
+    struct slot_t {
+        volatile uint64_t seq;
+        T data;
+    } __attribute__((aligned(QCONTENTHUB_CACHE_LINE)));
+
+    slot_t *m_slots;
+    size_t m_mask;
+
+    char m_pad0[QCONTENTHUB_CACHE_LINE];
+    volatile uint64_t m_head;
+    char m_pad1[QCONTENTHUB_CACHE_LINE - sizeof(uint64_t)];
+    volatile uint64_t m_tail;
+    char m_pad2[QCONTENTHUB_CACHE_LINE - sizeof(uint64_t)];
+};
+
+template <typename T>
+QContentRing<T>::QContentRing(size_t slots): m_slots(NULL), m_mask(0), m_head(0), m_tail(0)
+{
+    size_t n = 2;
+    while (n < slots) {
+        n <<= 1;
+    }
+
+    void *mem = NULL;
+    if (posix_memalign(&mem, QCONTENTHUB_CACHE_LINE, n * sizeof(slot_t)) != 0) {
+        throw std::bad_alloc();
+    }
+    m_slots = (slot_t *)mem;
+    for (size_t i = 0; i < n; i++) {
+        new (&m_slots[i]) slot_t();
+        m_slots[i].seq = i;
+    }
+    m_mask = n - 1;
+}
+
+template <typename T>
+QContentRing<T>::~QContentRing()
+{
+    for (size_t i = 0; i <= m_mask; i++) {
+        m_slots[i].~slot_t();
+    }
+    free(m_slots);
+}
+
+template <typename T>
+bool QContentRing<T>::push(T &obj, size_t limit)
+{
+    uint64_t pos = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot_t *slot = &m_slots[pos & m_mask];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t)(seq - pos);
+        if (dif == 0) {
+            int64_t size = (int64_t)(pos - __atomic_load_n(&m_tail, __ATOMIC_RELAXED));
+            if (size > (int64_t)limit) {
+                return false;
+            }
+            if (__atomic_compare_exchange_n(&m_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                slot->data.swap(obj);
+                __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            // the failed exchange reloaded pos
+        } else if (dif < 0) {
+            // the consumer of this slot one lap ago has not finished
+            return false;
+        } else {
+            pos = __atomic_load_n(&m_head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+template <typename T>
+bool QContentRing<T>::pop(T &obj)
+{
+    uint64_t pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot_t *slot = &m_slots[pos & m_mask];
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t)(seq - (pos + 1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&m_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                // leave an empty item behind in the slot
+                T().swap(obj);
+                obj.swap(slot->data);
+                __atomic_store_n(&slot->seq, pos + m_mask + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&m_tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+template <typename T>
+size_t QContentRing<T>::size() const
+{
+    uint64_t tail = __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+    uint64_t head = __atomic_load_n(&m_head, __ATOMIC_ACQUIRE);
+    return head > tail ? head - tail : 0;
+}
+
+#endif
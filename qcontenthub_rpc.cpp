@@ -1,8 +1,18 @@
 #include  "qcontenthub_rpc.h"
+#include "qcontenthub_shm.h"
 
 #include <time.h>
 #include <sys/time.h>
 #include <cassert>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
 
 #define ENTER_FUNCTION \
     std::cout << "enter " << __FUNCTION__ << std::endl;
@@ -10,261 +20,845 @@
 #define QUIT_FUNCTION \
     std::cout << "quit " << __FUNCTION__ << std::endl;
 
-int QContentHubServer::add_queue(const std::string &name, int capacity)
+int QContentHubServer::add_queue(const std::string &name, int capacity, int flags, int64_t max_bytes)
 {
-	mp::sync<queue_map_t>::ref ref(q_map);
-    queue_map_it_t it = ref->find(name);
-    if (it == ref->end()) {
-        queue_t * q = new queue_t();
-        if (q == NULL) {
+    if (flags & QCONTENTHUB_QUEUE_PERSIST) {
+        if (m_store_dir.empty()) {
+            flags &= ~QCONTENTHUB_QUEUE_PERSIST;
+        } else {
+            // records are logged in queue order under q->lock, which the
+            // lock-free ring would skip
+            flags &= ~QCONTENTHUB_QUEUE_RING;
+
+            // do not replay the files of a live queue
+            QueueRegistry::guard guard(m_queues);
+            if (guard.find(name) != NULL) {
+                return QCONTENTHUB_WARN;
+            }
+        }
+    }
+
+    queue_t * q = new queue_t();
+    if (q == NULL) {
+        return QCONTENTHUB_ERROR;
+    }
+    pthread_mutex_init(&q->lock,NULL);
+
+    q->stop = 0;
+    q->deleted = 0;
+    q->capacity = capacity;
+    q->bytes = 0;
+    q->max_bytes = max_bytes;
+    q->budget = &m_budget;
+    q->flags = flags;
+    q->ring = NULL;
+    if (flags & QCONTENTHUB_QUEUE_RING) {
+        // the queue is full once it holds more than capacity items
+        q->ring = new QContentRing<QContentItem>(capacity > 0 ? capacity + 1 : 1);
+    }
+    q->has_pop_waiters = 0;
+    q->has_push_waiters = 0;
+    q->log = NULL;
+    if (flags & QCONTENTHUB_QUEUE_PERSIST) {
+        q->log = new QContentLog(QContentLog::queue_dir(m_store_dir, name), &m_flush_signal);
+        std::queue<std::string> items;
+        if (q->log->open(items) != QCONTENTHUB_OK || !q->log->write_meta(capacity, flags, max_bytes)) {
+            free_queue(q);
             return QCONTENTHUB_ERROR;
         }
-        pthread_mutex_init(&q->lock,NULL);
-        pthread_cond_init(&q->not_empty,NULL);
-        pthread_cond_init(&q->not_full,NULL);
+        // replayed items count against the budget but are never refused
+        uint64_t now = qcontenthub_usec();
+        while (!items.empty()) {
+            q->bytes += items.front().size();
+            q->item_q.push_back(QContentItem());
+            q->item_q.back().take(items.front());
+            q->item_q.back().set_stamp(now);
+            items.pop();
+        }
+        __sync_add_and_fetch(&m_budget.bytes, q->bytes);
+    }
 
-        q->stop = 0;
-        q->capacity = capacity;
-        (*ref)[name] = q;
-        return QCONTENTHUB_OK;
+    int ret = m_queues.add(name, q);
+    if (ret != QCONTENTHUB_OK) {
+        __sync_sub_and_fetch(&m_budget.bytes, q->bytes);
+        free_queue(q);
+    }
+    return ret;
+}
+
+void QContentHubServer::free_queue(queue_t *q)
+{
+    if (q->log != NULL) {
+        q->log->release();
+    }
+    delete q->ring;
+    pthread_mutex_destroy(&q->lock);
+    delete q;
+}
+
+void QContentHubServer::add_queue(msgpack::rpc::request &req, const std::string &name, int capacity, int flags)
+{
+    req.result(add_queue(name, capacity, flags));
+}
+
+// Charge size bytes to q and to the daemon-wide budget. An empty queue or
+// budget takes any item, so one larger than the limit does not wedge it.
+// The check and the charge are not atomic together, concurrent pushes to
+// a ring queue may overshoot a limit by an item each.
+static bool reserve_bytes(queue_t *q, int64_t size)
+{
+    int64_t bytes = __sync_add_and_fetch(&q->bytes, size);
+    if (q->max_bytes > 0 && bytes > q->max_bytes && bytes > size) {
+        __sync_sub_and_fetch(&q->bytes, size);
+        return false;
+    }
+    budget_t *budget = q->budget;
+    bytes = __sync_add_and_fetch(&budget->bytes, size);
+    if (budget->max_bytes > 0 && bytes > budget->max_bytes && bytes > size) {
+        __sync_sub_and_fetch(&budget->bytes, size);
+        __sync_sub_and_fetch(&q->bytes, size);
+        return false;
+    }
+    return true;
+}
+
+static void release_bytes(queue_t *q, int64_t size)
+{
+    __sync_sub_and_fetch(&q->budget->bytes, size);
+    __sync_sub_and_fetch(&q->bytes, size);
+}
+
+// The queue_* helpers hide the storage of a queue. The caller holds
+// q->lock for a std::queue backed queue, a ring backed queue may be used
+// without it.
+static bool queue_push(queue_t *q, QContentItem &obj)
+{
+    int64_t size = obj.size();
+    obj.set_stamp(qcontenthub_usec());
+    if (q->ring != NULL) {
+        if (!reserve_bytes(q, size)) {
+            return false;
+        }
+        if (!q->ring->push(obj, q->capacity)) {
+            release_bytes(q, size);
+            return false;
+        }
     } else {
-        return QCONTENTHUB_WARN;
+        // a failed log takes no records, the push paths answer error
+        if ((int)q->item_q.size() > q->capacity || (q->log != NULL && q->log->failed()) || !reserve_bytes(q, size)) {
+            return false;
+        }
+        if (q->log != NULL) {
+            q->log->append(obj.data(), obj.size());
+        }
+        q->item_q.push_back(QContentItem());
+        q->item_q.back().swap(obj);
     }
+    __atomic_fetch_add(&q->metrics.enqueued, 1, __ATOMIC_RELAXED);
+    return true;
 }
 
+static bool queue_pop(queue_t *q, QContentItem &obj)
+{
+    if (q->ring != NULL) {
+        if (!q->ring->pop(obj)) {
+            return false;
+        }
+    } else {
+        if (q->item_q.empty()) {
+            return false;
+        }
+        obj.swap(q->item_q.front());
+        q->item_q.pop_front();
+        if (q->log != NULL) {
+            q->log->consume(obj.size());
+        }
+    }
+    release_bytes(q, obj.size());
+    __atomic_fetch_add(&q->metrics.dequeued, 1, __ATOMIC_RELAXED);
+    q->metrics.residence.add(qcontenthub_usec() - obj.stamp());
+    return true;
+}
 
-void QContentHubServer::add_queue(msgpack::rpc::request &req, const std::string &name, int capacity)
+static size_t queue_size(queue_t *q)
 {
-    req.result(add_queue(name, capacity));
+    if (q->ring != NULL) {
+        return q->ring->size();
+    }
+    return q->item_q.size();
 }
 
-/*
-void QContentHubServer::del_queue(msgpack::rpc::request &req, const std::string &name)
+// queue_size for a caller that does not hold q->lock, the deque of a
+// locked queue changes under pushes and pops
+static size_t locked_queue_size(queue_t *q)
 {
-    int ret;
-    {
-        mp::sync<queue_map_t>::ref ref(q_map);
-        queue_map_it_t it = ref->find(name);
-        if (it == ref->end()) {
-            ret = QCONTENTHUB_WARN;
-        } else if (it->second->str_q.size() == 0) {
-            delete it->second;
-            ref->erase(it);
-            ret = QCONTENTHUB_OK;
-        } else {
-            ret = QCONTENTHUB_WARN;
+    if (q->ring != NULL) {
+        return queue_size(q);
+    }
+    pthread_mutex_lock(&q->lock);
+    size_t size = queue_size(q);
+    pthread_mutex_unlock(&q->lock);
+    return size;
+}
+
+// The lock-free path of a ring queue only takes q->lock when the
+// has_*_waiters flags say somebody is parked. A parker sets its flag and
+// then looks at the ring again, a lock-free push or pop changes the ring
+// and then looks at the flags, and with a full fence on both sides at
+// least one of them sees the other.
+static void publish_waiters(queue_t *q)
+{
+    q->has_pop_waiters = !q->pop_waiters.empty();
+    q->has_push_waiters = !q->push_waiters.empty();
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// move items to parked pops and parked pushes into the queue until neither
+// side can make progress, the caller holds q->lock and answers the
+// finished waiters with complete_waiters() once it is released
+static void fill_waiters(queue_t *q, pop_waiter_list_t &done_pops, push_waiter_list_t &done_pushes)
+{
+    publish_waiters(q);
+
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        while (!q->stop && !q->pop_waiters.empty()) {
+            pop_waiter_t &w = q->pop_waiters.front();
+            int max_items = w.max_items > 0 ? w.max_items : 1;
+            QContentItem item;
+            while ((int)w.items.size() < max_items && queue_pop(q, item)) {
+                w.items.push_back(QContentItem());
+                w.items.back().swap(item);
+            }
+            if (w.items.empty()) {
+                break;
+            }
+            done_pops.splice(done_pops.end(), q->pop_waiters, q->pop_waiters.begin());
+            progress = true;
+        }
+
+        while (!q->push_waiters.empty()) {
+            push_waiter_t &w = q->push_waiters.front();
+            size_t pushed = w.pushed;
+            while (w.pushed < w.objs.size() && queue_push(q, w.objs[w.pushed])) {
+                w.pushed++;
+            }
+            if (w.pushed > pushed) {
+                progress = true;
+            }
+            if (w.pushed < w.objs.size()) {
+                break;
+            }
+            done_pushes.splice(done_pushes.end(), q->push_waiters, q->push_waiters.begin());
+            progress = true;
         }
     }
 
-    req.result(ret);
+    publish_waiters(q);
 }
 
-void QContentHubServer::force_del_queue(msgpack::rpc::request &req, const std::string &name)
+// a persistent queue whose log failed answers pushes with error, the
+// caller holds q->lock
+static bool log_failed(queue_t *q)
 {
-    int ret;
-    {
-        mp::sync<queue_map_t>::ref ref(q_map);
-        queue_map_it_t it = ref->find(name);
-        if (it == ref->end()) {
-            ret = QCONTENTHUB_WARN;
+    return q->log != NULL && q->log->failed();
+}
+
+// a push into a persistent queue is answered once its record is on disk
+static void reply_push(queue_t *q, msgpack::rpc::request &req, int result)
+{
+    if (q->log != NULL) {
+        q->log->reply_after_commit(req, result);
+    } else {
+        req.result(result);
+    }
+}
+
+// Replies reference the payloads instead of copying them into the send
+// buffer, so the items move into a zone the reply holds until it is sent.
+static void reply_item(msgpack::rpc::request &req, QContentItem &item)
+{
+    msgpack::rpc::shared_zone life(new msgpack::zone());
+    QContentItem *keep = life->allocate<QContentItem>();
+    keep->swap(item);
+    req.result(msgpack::type::raw_ref(keep->data(), keep->size()), life);
+}
+
+static void reply_items(msgpack::rpc::request &req, std::vector<QContentItem> &items)
+{
+    msgpack::rpc::shared_zone life(new msgpack::zone());
+    std::vector<QContentItem> *keep = life->allocate<std::vector<QContentItem> >();
+    keep->swap(items);
+    std::vector<msgpack::type::raw_ref> refs(keep->size());
+    for (size_t i = 0; i < keep->size(); i++) {
+        refs[i] = msgpack::type::raw_ref((*keep)[i].data(), (*keep)[i].size());
+    }
+    req.result(refs, life);
+}
+
+static void complete_waiters(queue_t *q, pop_waiter_list_t &done_pops, push_waiter_list_t &done_pushes)
+{
+    uint64_t now = qcontenthub_usec();
+    for (pop_waiter_list_t::iterator it = done_pops.begin(); it != done_pops.end(); it++) {
+        q->metrics.pop_wait.add(now - it->parked);
+        if (it->max_items > 0) {
+            reply_items(it->req, it->items);
+        } else if (it->items.empty()) {
+            it->req.result(QCONTENTHUB_STRAGAIN);
         } else {
-            delete it->second;
-            ref->erase(it);
-            ret = QCONTENTHUB_OK;
+            reply_item(it->req, it->items[0]);
         }
     }
-    req.result(ret);
+
+    for (push_waiter_list_t::iterator it = done_pushes.begin(); it != done_pushes.end(); it++) {
+        q->metrics.push_wait.add(now - it->parked);
+        if (it->batch) {
+            reply_push(q, it->req, it->accepted + (int)it->pushed);
+        } else if (it->pushed == 0) {
+            it->req.result(QCONTENTHUB_STRAGAIN);
+        } else {
+            reply_push(q, it->req, QCONTENTHUB_OK);
+        }
+    }
+}
+
+// called after a lock-free push or pop found the other side parked
+static void wake_waiters(queue_t *q)
+{
+    pop_waiter_list_t done_pops;
+    push_waiter_list_t done_pushes;
+    pthread_mutex_lock(&q->lock);
+    fill_waiters(q, done_pops, done_pushes);
+    pthread_mutex_unlock(&q->lock);
+    complete_waiters(q, done_pops, done_pushes);
+}
+
+// Rewrites the meta file of a persistent queue after q->lock is released,
+// its fsync would stall every push and pop. Writers take turns and read
+// the limits inside their turn, so the last values set are on disk.
+static void save_meta(queue_t *q)
+{
+    static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+    if (q->log == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&meta_lock);
+    q->log->write_meta(q->capacity, q->flags, q->max_bytes);
+    pthread_mutex_unlock(&meta_lock);
 }
-*/
 
 void QContentHubServer::set_queue_capacity(msgpack::rpc::request &req, const std::string &name, int capacity)
 {
-    queue_map_t &qmap = q_map.unsafe_ref();
-    queue_map_it_t it = qmap.find(name);
-    if (it == qmap.end()) {
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
         req.result(QCONTENTHUB_WARN);
     } else {
-        queue_t *q = it->second;
+        int ret = QCONTENTHUB_OK;
+        pop_waiter_list_t done_pops;
+        push_waiter_list_t done_pushes;
         pthread_mutex_lock(&q->lock);
+        // a ring cannot grow beyond the slots allocated by add
+        if (q->ring != NULL && capacity >= (int)q->ring->slots()) {
+            capacity = q->ring->slots() - 1;
+            ret = QCONTENTHUB_WARN;
+        }
         q->capacity = capacity;
+        fill_waiters(q, done_pops, done_pushes);
         pthread_mutex_unlock(&q->lock);
+        complete_waiters(q, done_pops, done_pushes);
+        save_meta(q);
+        req.result(ret);
     }
-    req.result(QCONTENTHUB_OK);
 }
 
+void QContentHubServer::set_queue_max_bytes(msgpack::rpc::request &req, const std::string &name, int64_t max_bytes)
+{
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
+        req.result(QCONTENTHUB_WARN);
+    } else {
+        pop_waiter_list_t done_pops;
+        push_waiter_list_t done_pushes;
+        pthread_mutex_lock(&q->lock);
+        q->max_bytes = max_bytes;
+        fill_waiters(q, done_pops, done_pushes);
+        pthread_mutex_unlock(&q->lock);
+        complete_waiters(q, done_pops, done_pushes);
+        save_meta(q);
+        req.result(QCONTENTHUB_OK);
+    }
+}
 
 void QContentHubServer::start_queue(msgpack::rpc::request &req, const std::string &name)
 {
-    queue_map_t &qmap = q_map.unsafe_ref();
-    queue_map_it_t it = qmap.find(name);
-    if (it == qmap.end()) {
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
         req.result(QCONTENTHUB_WARN);
     } else {
-        queue_t *q = it->second;
         pthread_mutex_lock(&q->lock);
         q->stop = 0;
         pthread_mutex_unlock(&q->lock);
+        req.result(QCONTENTHUB_OK);
     }
 }
 
 void QContentHubServer::stop_queue(msgpack::rpc::request &req, const std::string &name)
 {
-    queue_map_t &qmap = q_map.unsafe_ref();
-    queue_map_it_t it = qmap.find(name);
-    if (it == qmap.end()) {
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
         req.result(QCONTENTHUB_WARN);
     } else {
-        queue_t *q = it->second;
+        pop_waiter_list_t done_pops;
+        push_waiter_list_t done_pushes;
         pthread_mutex_lock(&q->lock);
         q->stop = 1;
+        // a stopped queue answers pops with again, so do parked ones
+        done_pops.splice(done_pops.end(), q->pop_waiters);
+        publish_waiters(q);
         pthread_mutex_unlock(&q->lock);
+        complete_waiters(q, done_pops, done_pushes);
+        req.result(QCONTENTHUB_OK);
     }
 }
 
 void QContentHubServer::clear_queue(msgpack::rpc::request &req, const std::string &name)
 {
-    queue_map_t &qmap = q_map.unsafe_ref();
-    queue_map_it_t it = qmap.find(name);
-    if (it == qmap.end()) {
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
         req.result(QCONTENTHUB_WARN);
     } else {
-        queue_t *q = it->second;
+        pop_waiter_list_t done_pops;
+        push_waiter_list_t done_pushes;
+        QContentItem item;
         pthread_mutex_lock(&q->lock);
-        while (!q->str_q.empty()) {
-            q->str_q.pop();
+        while (queue_pop(q, item)) {
         }
+        fill_waiters(q, done_pops, done_pushes);
         pthread_mutex_unlock(&q->lock);
+        complete_waiters(q, done_pops, done_pushes);
+        req.result(QCONTENTHUB_OK);
     }
 }
 
-void QContentHubServer::push_queue(msgpack::rpc::request &req, const std::string &name, const std::string &obj)
+int QContentHubServer::del_queue(const std::string &name, bool force)
 {
-    queue_map_t &qmap = q_map.unsafe_ref();
+    pop_waiter_list_t done_pops;
+    push_waiter_list_t done_pushes;
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
+        return QCONTENTHUB_WARN;
+    }
 
-    queue_map_it_t it = qmap.find(name);
-    if (it == qmap.end()) {
-        int ret = add_queue(name, DEFAULT_QUEUE_CAPACITY);
-        if (ret == QCONTENTHUB_ERROR) {
-            req.result(ret);
-        } else {
-            push_queue(req, name, obj);
-        }
-    } else {
-        queue_t *q = it->second;
-        pthread_mutex_lock(&q->lock);
+    {
 
-        while ((int)q->str_q.size() > q->capacity) {
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec += 60;
-            int rc = pthread_cond_timedwait(&q->not_full, &q->lock, &ts);
-            if (rc == ETIMEDOUT) {
-                pthread_mutex_unlock(&q->lock);
-                req.result(QCONTENTHUB_STRAGAIN);
-                return;
-            } else if (rc != 0) {
-                pthread_mutex_unlock(&q->lock);
-                req.result(QCONTENTHUB_STRERROR);
-                return;
-            }
+        QContentItem item;
+        pthread_mutex_lock(&q->lock);
+        if ((!force && queue_size(q) > 0) || !m_queues.remove(name, q)) {
+            pthread_mutex_unlock(&q->lock);
+            return QCONTENTHUB_WARN;
         }
-        q->str_q.push(obj);
-        pthread_cond_signal(&q->not_empty);
+        // requests that found q before the removal see the flag under
+        // q->lock and go back to the registry, q itself is freed once
+        // they are gone
+        q->deleted = 1;
+        while (queue_pop(q, item)) {
+        }
+        done_pops.splice(done_pops.end(), q->pop_waiters);
+        done_pushes.splice(done_pushes.end(), q->push_waiters);
+        publish_waiters(q);
         pthread_mutex_unlock(&q->lock);
-        req.result(QCONTENTHUB_OK);
     }
+    if (q->log != NULL) {
+        q->log->remove();
+    }
+    complete_waiters(q, done_pops, done_pushes);
+    return QCONTENTHUB_OK;
 }
 
-void QContentHubServer::push_queue_nowait(msgpack::rpc::request &req, const std::string &name, const std::string &obj)
+void QContentHubServer::del_queue(msgpack::rpc::request &req, const std::string &name)
 {
-    queue_map_t &qmap = q_map.unsafe_ref();
+    req.result(del_queue(name, false));
+}
 
-    queue_map_it_t it = qmap.find(name);
-    if (it == qmap.end()) {
-        int ret = add_queue(name, DEFAULT_QUEUE_CAPACITY);
+void QContentHubServer::force_del_queue(msgpack::rpc::request &req, const std::string &name)
+{
+    req.result(del_queue(name, true));
+}
+
+void QContentHubServer::push_queue(msgpack::rpc::request &req, const std::string &name, QContentItem &obj)
+{
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
+        int ret = add_queue(name, DEFAULT_QUEUE_CAPACITY, m_default_flags);
         if (ret == QCONTENTHUB_ERROR) {
             req.result(ret);
         } else {
             push_queue(req, name, obj);
         }
     } else {
-        queue_t *q = it->second;
+        if (q->ring != NULL && !q->deleted && !q->has_push_waiters && queue_push(q, obj)) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (q->has_pop_waiters) {
+                wake_waiters(q);
+            }
+            req.result(QCONTENTHUB_OK);
+            return;
+        }
+
+        pop_waiter_list_t done_pops;
+        push_waiter_list_t done_pushes;
         pthread_mutex_lock(&q->lock);
-        if ((int)q->str_q.size() > q->capacity) {
+        if (q->deleted) {
+            // del unlinked q after we found it, look the name up again
             pthread_mutex_unlock(&q->lock);
-            req.result(QCONTENTHUB_AGAIN);
-        } else {
-            q->str_q.push(obj);
-            pthread_cond_signal(&q->not_empty);
+            push_queue(req, name, obj);
+            return;
+        }
+        if (log_failed(q)) {
             pthread_mutex_unlock(&q->lock);
-            req.result(QCONTENTHUB_OK);
+            req.result(QCONTENTHUB_ERROR);
+            return;
         }
+
+        if (!q->push_waiters.empty() || !queue_push(q, obj)) {
+            // park the request instead of blocking a worker thread
+            q->push_waiters.push_back(push_waiter_t(req, get_current_msec() + QCONTENTHUB_WAIT_TIMEOUT, false));
+            __atomic_fetch_add(&q->metrics.push_blocked, 1, __ATOMIC_RELAXED);
+            q->push_waiters.back().objs.push_back(QContentItem());
+            q->push_waiters.back().objs.back().swap(obj);
+            fill_waiters(q, done_pops, done_pushes);
+            pthread_mutex_unlock(&q->lock);
+            complete_waiters(q, done_pops, done_pushes);
+            return;
+        }
+        fill_waiters(q, done_pops, done_pushes);
+        pthread_mutex_unlock(&q->lock);
+        complete_waiters(q, done_pops, done_pushes);
+        reply_push(q, req, QCONTENTHUB_OK);
     }
 }
 
+int QContentHubServer::push_nowait(const std::string &name, QContentItem &obj, queue_t **pushed_to)
+{
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
+        int ret = add_queue(name, DEFAULT_QUEUE_CAPACITY, m_default_flags);
+        if (ret == QCONTENTHUB_ERROR) {
+            return ret;
+        }
+        return push_nowait(name, obj, pushed_to);
+    }
+
+    if (pushed_to != NULL) {
+        *pushed_to = q;
+    }
+    if (q->ring != NULL && !q->deleted) {
+        if (q->has_push_waiters || !queue_push(q, obj)) {
+            return QCONTENTHUB_AGAIN;
+        }
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (q->has_pop_waiters) {
+            wake_waiters(q);
+        }
+        return QCONTENTHUB_OK;
+    }
+
+    pop_waiter_list_t done_pops;
+    push_waiter_list_t done_pushes;
+    pthread_mutex_lock(&q->lock);
+    if (q->deleted) {
+        pthread_mutex_unlock(&q->lock);
+        return push_nowait(name, obj, pushed_to);
+    }
+    if (log_failed(q)) {
+        pthread_mutex_unlock(&q->lock);
+        return QCONTENTHUB_ERROR;
+    }
+    if (!queue_push(q, obj)) {
+        pthread_mutex_unlock(&q->lock);
+        return QCONTENTHUB_AGAIN;
+    }
+    fill_waiters(q, done_pops, done_pushes);
+    pthread_mutex_unlock(&q->lock);
+    complete_waiters(q, done_pops, done_pushes);
+    return QCONTENTHUB_OK;
+}
+
+int QContentHubServer::push_queue_nowait(const std::string &name, QContentItem &obj)
+{
+    return push_nowait(name, obj, NULL);
+}
+
+void QContentHubServer::push_queue_nowait(msgpack::rpc::request &req, const std::string &name, QContentItem &obj)
+{
+    // keeps the queue pushed to allocated until the reply is queued
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = NULL;
+    int ret = push_nowait(name, obj, &q);
+    if (ret == QCONTENTHUB_OK) {
+        reply_push(q, req, ret);
+    } else {
+        req.result(ret);
+    }
+}
+
+int QContentHubServer::push_queue_batch(const std::string &name, std::vector<QContentItem> &objs)
+{
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
+        int ret = add_queue(name, DEFAULT_QUEUE_CAPACITY, m_default_flags);
+        if (ret == QCONTENTHUB_ERROR) {
+            return ret;
+        }
+        return push_queue_batch(name, objs);
+    }
+
+    int pushed = 0;
+    int objs_size = objs.size();
+    pop_waiter_list_t done_pops;
+    push_waiter_list_t done_pushes;
+    pthread_mutex_lock(&q->lock);
+    if (q->deleted) {
+        pthread_mutex_unlock(&q->lock);
+        return push_queue_batch(name, objs);
+    }
+    if (log_failed(q)) {
+        pthread_mutex_unlock(&q->lock);
+        return QCONTENTHUB_ERROR;
+    }
+    // queue behind parked pushes to keep their order
+    if (q->push_waiters.empty()) {
+        while (pushed < objs_size && queue_push(q, objs[pushed])) {
+            pushed++;
+        }
+    }
+    fill_waiters(q, done_pops, done_pushes);
+    pthread_mutex_unlock(&q->lock);
+    complete_waiters(q, done_pops, done_pushes);
+    return pushed;
+}
+
 
 void QContentHubServer::pop_queue(msgpack::rpc::request &req, const std::string &name)
 {
-    queue_map_t &qmap = q_map.unsafe_ref();
-    queue_map_it_t it = qmap.find(name);
-    if (it == qmap.end()) {
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
         req.result(QCONTENTHUB_STRAGAIN);
     } else {
-        queue_t *q = it->second;
-        if (q->stop) {
+        if (q->stop || q->deleted) {
             req.result(QCONTENTHUB_STRAGAIN);
             return;
         }
 
-        pthread_mutex_lock(&(q->lock));
-        while (q->str_q.size() == 0) {
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec += 60;
-            int rc = pthread_cond_timedwait(&q->not_empty, &q->lock, &ts);
-            if (rc == ETIMEDOUT) {
-                pthread_mutex_unlock(&(q->lock));
-                req.result(QCONTENTHUB_STRAGAIN);
-                return;
-            } else if (rc != 0) {
-                pthread_mutex_unlock(&(q->lock));
-                req.result(QCONTENTHUB_STRERROR);
-                return;
+        QContentItem content;
+        if (q->ring != NULL && queue_pop(q, content)) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (q->has_push_waiters) {
+                wake_waiters(q);
             }
+            reply_item(req, content);
+            return;
+        }
+
+        pop_waiter_list_t done_pops;
+        push_waiter_list_t done_pushes;
+        pthread_mutex_lock(&(q->lock));
+        if (q->deleted) {
+            pthread_mutex_unlock(&(q->lock));
+            req.result(QCONTENTHUB_STRAGAIN);
+            return;
+        }
+        if (!queue_pop(q, content)) {
+            // park the request instead of blocking a worker thread
+            q->pop_waiters.push_back(pop_waiter_t(req, get_current_msec() + QCONTENTHUB_WAIT_TIMEOUT, 0));
+            __atomic_fetch_add(&q->metrics.pop_blocked, 1, __ATOMIC_RELAXED);
+            fill_waiters(q, done_pops, done_pushes);
+            pthread_mutex_unlock(&(q->lock));
+            complete_waiters(q, done_pops, done_pushes);
+            return;
+        }
+        fill_waiters(q, done_pops, done_pushes);
+        pthread_mutex_unlock(&(q->lock));
+        complete_waiters(q, done_pops, done_pushes);
+        reply_item(req, content);
+    }
+}
+
+int QContentHubServer::pop_queue_nowait(const std::string &name, QContentItem &obj)
+{
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
+        return QCONTENTHUB_ERROR;
+    }
+    if (q->stop || q->deleted) {
+        return QCONTENTHUB_AGAIN;
+    }
+
+    if (q->ring != NULL) {
+        if (!queue_pop(q, obj)) {
+            return QCONTENTHUB_AGAIN;
         }
-        //assert(q->str_q.size() > 0);
-        std::string content = q->str_q.front();
-        q->str_q.pop();
-        pthread_cond_signal(&q->not_full);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (q->has_push_waiters) {
+            wake_waiters(q);
+        }
+        return QCONTENTHUB_OK;
+    }
+
+    pop_waiter_list_t done_pops;
+    push_waiter_list_t done_pushes;
+    pthread_mutex_lock(&(q->lock));
+    if (!queue_pop(q, obj)) {
         pthread_mutex_unlock(&(q->lock));
-        req.result(content);
+        return QCONTENTHUB_AGAIN;
     }
+    fill_waiters(q, done_pops, done_pushes);
+    pthread_mutex_unlock(&(q->lock));
+    complete_waiters(q, done_pops, done_pushes);
+    return QCONTENTHUB_OK;
 }
 
 void QContentHubServer::pop_queue_nowait(msgpack::rpc::request &req, const std::string &name)
 {
-    std::string ret;
-    queue_map_t &qmap = q_map.unsafe_ref();
-    queue_map_it_t it = qmap.find(name);
-    if (it == qmap.end()) {
-        req.result(QCONTENTHUB_STRERROR);
+    QContentItem item;
+    int ret = pop_queue_nowait(name, item);
+    if (ret == QCONTENTHUB_OK) {
+        reply_item(req, item);
     } else {
-        queue_t *q = it->second;
-        if (q->stop) {
-            req.result(QCONTENTHUB_STRAGAIN);
+        req.result(ret == QCONTENTHUB_ERROR ? QCONTENTHUB_STRERROR : QCONTENTHUB_STRAGAIN);
+    }
+}
+
+int QContentHubServer::pop_queue_batch(const std::string &name, int max_items, std::vector<QContentItem> &items)
+{
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
+        return QCONTENTHUB_ERROR;
+    }
+    if (q->stop || q->deleted || max_items <= 0) {
+        return 0;
+    }
+
+    pop_waiter_list_t done_pops;
+    push_waiter_list_t done_pushes;
+    QContentItem item;
+    int popped = 0;
+    pthread_mutex_lock(&(q->lock));
+    while (popped < max_items && queue_pop(q, item)) {
+        items.push_back(QContentItem());
+        items.back().swap(item);
+        popped++;
+    }
+    fill_waiters(q, done_pops, done_pushes);
+    pthread_mutex_unlock(&(q->lock));
+    complete_waiters(q, done_pops, done_pushes);
+    return popped;
+}
+
+void QContentHubServer::push_queue_batch(msgpack::rpc::request &req, const std::string &name, std::vector<QContentItem> &objs)
+{
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
+        int ret = add_queue(name, DEFAULT_QUEUE_CAPACITY, m_default_flags);
+        if (ret == QCONTENTHUB_ERROR) {
+            req.result(ret);
+        } else {
+            push_queue_batch(req, name, objs);
+        }
+    } else {
+        int pushed = 0;
+        int objs_size = objs.size();
+        pop_waiter_list_t done_pops;
+        push_waiter_list_t done_pushes;
+
+        pthread_mutex_lock(&q->lock);
+        if (q->deleted) {
+            pthread_mutex_unlock(&q->lock);
+            push_queue_batch(req, name, objs);
             return;
         }
-        pthread_mutex_lock(&(q->lock));
-        if (q->str_q.size() == 0) {
-            ret = QCONTENTHUB_STRAGAIN;
-        } else {
-            ret = q->str_q.front();
-            q->str_q.pop();
-            pthread_cond_signal(&q->not_full);
+        if (log_failed(q)) {
+            pthread_mutex_unlock(&q->lock);
+            req.result(QCONTENTHUB_ERROR);
+            return;
+        }
+        // queue behind earlier parked pushes to keep their order
+        if (q->push_waiters.empty()) {
+            while (pushed < objs_size && queue_push(q, objs[pushed])) {
+                pushed++;
+            }
+        }
+        if (pushed < objs_size) {
+            q->push_waiters.push_back(push_waiter_t(req, get_current_msec() + QCONTENTHUB_WAIT_TIMEOUT, true));
+            __atomic_fetch_add(&q->metrics.push_blocked, 1, __ATOMIC_RELAXED);
+            push_waiter_t &w = q->push_waiters.back();
+            w.accepted = pushed;
+            w.objs.resize(objs_size - pushed);
+            for (int i = pushed; i < objs_size; i++) {
+                w.objs[i - pushed].swap(objs[i]);
+            }
+        }
+        fill_waiters(q, done_pops, done_pushes);
+        pthread_mutex_unlock(&q->lock);
+        complete_waiters(q, done_pops, done_pushes);
+
+        // number of leading items accepted, the caller retries the rest
+        if (pushed == objs_size) {
+            reply_push(q, req, pushed);
         }
+    }
+}
+
+void QContentHubServer::pop_queue_batch(msgpack::rpc::request &req, const std::string &name, int max_items, int max_wait)
+{
+    std::vector<QContentItem> ret;
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL || max_items <= 0) {
+        reply_items(req, ret);
+        return;
+    }
+
+    if (q->stop || q->deleted) {
+        reply_items(req, ret);
+        return;
+    }
+
+    pop_waiter_list_t done_pops;
+    push_waiter_list_t done_pushes;
+    QContentItem item;
+    pthread_mutex_lock(&(q->lock));
+    // return a partial batch when the queue runs dry
+    while ((int)ret.size() < max_items && queue_pop(q, item)) {
+        ret.push_back(QContentItem());
+        ret.back().swap(item);
+    }
+    if (ret.empty() && max_wait > 0 && !q->deleted) {
+        q->pop_waiters.push_back(pop_waiter_t(req, get_current_msec() + max_wait, max_items));
+        __atomic_fetch_add(&q->metrics.pop_blocked, 1, __ATOMIC_RELAXED);
+        fill_waiters(q, done_pops, done_pushes);
         pthread_mutex_unlock(&(q->lock));
-        req.result(ret);
+        complete_waiters(q, done_pops, done_pushes);
+        return;
     }
+    fill_waiters(q, done_pops, done_pushes);
+    pthread_mutex_unlock(&(q->lock));
+    complete_waiters(q, done_pops, done_pushes);
+    reply_items(req, ret);
 }
 
 void QContentHubServer::stats(msgpack::rpc::request &req)
@@ -280,20 +874,69 @@ void QContentHubServer::stats(msgpack::rpc::request &req)
     sprintf(buf, "%d", current);
     ret.append(buf);
     ret.append("\n");
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    ret.append("STAT rusage_user ");
+    sprintf(buf, "%ld.%06ld", (long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec);
+    ret.append(buf);
+    ret.append("\n");
+    ret.append("STAT rusage_system ");
+    sprintf(buf, "%ld.%06ld", (long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec);
+    ret.append(buf);
+    ret.append("\n");
+    ret.append("STAT bytes ");
+    sprintf(buf, "%lld", (long long)m_budget.bytes);
+    ret.append(buf);
+    ret.append("\n");
+    ret.append("STAT max_bytes ");
+    sprintf(buf, "%lld", (long long)m_budget.max_bytes);
+    ret.append(buf);
+    ret.append("\n");
+    ret.append("STAT shm_clients ");
+    sprintf(buf, "%d", m_shm_clients);
+    ret.append(buf);
+    ret.append("\n");
 
-    queue_map_t &qmap = q_map.unsafe_ref();
-    for (queue_map_it_t it = qmap.begin(); it != qmap.end(); it++) {
+    QueueRegistry::guard guard(m_queues);
+    const QueueRegistry::map_t &qmap = guard.map();
+    for (QueueRegistry::map_t::const_iterator it = qmap.begin(); it != qmap.end(); it++) {
         ret.append("STAT name ");
         ret.append(it->first);
         ret.append("\n");
         ret.append("STAT size ");
-        sprintf(buf, "%ld", it->second->str_q.size());
+        sprintf(buf, "%ld", locked_queue_size(it->second));
+        ret.append(buf);
+        ret.append("\n");
+        ret.append("STAT bytes ");
+        sprintf(buf, "%lld", (long long)it->second->bytes);
         ret.append(buf);
         ret.append("\n");
     }
     req.result(ret);
 }
 
+// counters, gauges and latencies of q, only the size needs the queue lock
+static void collect_queue_metrics(queue_t *q, metric_set_t &m)
+{
+    const queue_metrics_t &qm = q->metrics;
+    m.counters["enqueued"] = qm.enqueued;
+    m.counters["dequeued"] = qm.dequeued;
+    m.counters["push_blocked"] = qm.push_blocked;
+    m.counters["push_timeouts"] = qm.push_timeouts;
+    m.counters["pop_blocked"] = qm.pop_blocked;
+    m.counters["pop_timeouts"] = qm.pop_timeouts;
+
+    m.gauges["size"] = locked_queue_size(q);
+    m.gauges["capacity"] = q->capacity;
+    m.gauges["bytes"] = q->bytes;
+    m.gauges["max_bytes"] = q->max_bytes;
+    m.gauges["stopped"] = q->stop;
+
+    m.add_latency("push_wait", qm.push_wait);
+    m.add_latency("pop_wait", qm.pop_wait);
+    m.add_latency("residence", qm.residence);
+}
+
 void QContentHubServer::stat_queue(msgpack::rpc::request &req, const std::string &name)
 {
     char buf[64];
@@ -308,48 +951,123 @@ void QContentHubServer::stat_queue(msgpack::rpc::request &req, const std::string
     ret.append(buf);
     ret.append("\n");
 
-    queue_map_t &qmap = q_map.unsafe_ref();
-    queue_map_it_t it = qmap.find(name);
-    if (it == qmap.end()) {
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q == NULL) {
         req.result(ret);
     } else {
         ret.append("STAT name ");
         ret.append(name);
         ret.append("\n");
-        ret.append("STAT size ");
-        sprintf(buf, "%ld", it->second->str_q.size());
-        ret.append(buf);
-        ret.append("\n");
+
+        metric_set_t m;
+        collect_queue_metrics(q, m);
+        m.append_stat(ret);
         req.result(ret);
     }
 }
 
+void QContentHubServer::queue_metrics(msgpack::rpc::request &req, const std::string &name)
+{
+    metric_set_t m;
+    QueueRegistry::guard guard(m_queues);
+    queue_t *q = guard.find(name);
+    if (q != NULL) {
+        collect_queue_metrics(q, m);
+    }
+    req.result(m);
+}
+
+void QContentHubServer::metrics(msgpack::rpc::request &req, bool text)
+{
+    metrics_snapshot_t snapshot("qcontenthub", "queue");
+    metric_set_t &server = snapshot.server;
+    int current = get_current_time();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    server.counters["rusage_user_us"] = (uint64_t)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec;
+    server.counters["rusage_system_us"] = (uint64_t)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec;
+    server.gauges["uptime"] = current - m_start_time;
+    server.gauges["time"] = current;
+    server.gauges["bytes"] = m_budget.bytes;
+    server.gauges["max_bytes"] = m_budget.max_bytes;
+    server.gauges["shm_clients"] = m_shm_clients;
+
+    {
+        // the registry map is an immutable snapshot already, the guard
+        // only keeps its queues from being freed meanwhile
+        QueueRegistry::guard guard(m_queues);
+        const QueueRegistry::map_t &qmap = guard.map();
+        server.gauges["queues"] = qmap.size();
+        for (QueueRegistry::map_t::const_iterator it = qmap.begin(); it != qmap.end(); it++) {
+            collect_queue_metrics(it->second, snapshot.children[it->first]);
+        }
+    }
+
+    if (text) {
+        req.result(snapshot.text());
+    } else {
+        req.result(snapshot);
+    }
+}
+
+// takes over the zone req was unpacked into, so that pushed payloads can
+// stay in the receive buffer
+static msgpack::rpc::shared_zone take_zone(msgpack::rpc::request &req)
+{
+    return msgpack::rpc::shared_zone(req.zone().release());
+}
+
 void QContentHubServer::dispatch(msgpack::rpc::request req) {
     try {
         std::string method;
         req.method().convert(&method);
 
         if(method == "push") {
-            msgpack::type::tuple<std::string, std::string> params;
+            msgpack::type::tuple<std::string, msgpack::object> params;
             req.params().convert(&params);
-            push_queue(req, params.get<0>(), params.get<1>());
+            QContentItem obj;
+            obj.assign(params.get<1>(), take_zone(req));
+            push_queue(req, params.get<0>(), obj);
         } else if(method == "pop") {
             msgpack::type::tuple<std::string> params;
             req.params().convert(&params);
             pop_queue(req, params.get<0>());
         } else if(method == "push_nowait") {
-            msgpack::type::tuple<std::string, std::string> params;
+            msgpack::type::tuple<std::string, msgpack::object> params;
             req.params().convert(&params);
-            push_queue_nowait(req, params.get<0>(), params.get<1>());
+            QContentItem obj;
+            obj.assign(params.get<1>(), take_zone(req));
+            push_queue_nowait(req, params.get<0>(), obj);
         } else if(method == "pop_nowait") {
             msgpack::type::tuple<std::string> params;
             req.params().convert(&params);
             pop_queue_nowait(req, params.get<0>());
-        } else if(method == "add") {
-            msgpack::type::tuple<std::string, int> params;
+        } else if(method == "push_batch") {
+            msgpack::type::tuple<std::string, std::vector<msgpack::object> > params;
             req.params().convert(&params);
-            add_queue(req, params.get<0>(), params.get<1>());
-        /*
+            const std::vector<msgpack::object> &raws = params.get<1>();
+            msgpack::rpc::shared_zone life = take_zone(req);
+            std::vector<QContentItem> objs(raws.size());
+            for (size_t i = 0; i < raws.size(); i++) {
+                objs[i].assign(raws[i], life);
+            }
+            push_queue_batch(req, params.get<0>(), objs);
+        } else if(method == "pop_batch") {
+            msgpack::type::tuple<std::string, int, int> params;
+            req.params().convert(&params);
+            pop_queue_batch(req, params.get<0>(), params.get<1>(), params.get<2>());
+        } else if(method == "add") {
+            msgpack::object params_obj = req.params();
+            if (params_obj.type == msgpack::type::ARRAY && params_obj.via.array.size > 2) {
+                msgpack::type::tuple<std::string, int, int> params;
+                params_obj.convert(&params);
+                add_queue(req, params.get<0>(), params.get<1>(), params.get<2>());
+            } else {
+                msgpack::type::tuple<std::string, int> params;
+                params_obj.convert(&params);
+                add_queue(req, params.get<0>(), params.get<1>(), m_default_flags);
+            }
         } else if(method == "del") {
             msgpack::type::tuple<std::string> params;
             req.params().convert(&params);
@@ -358,11 +1076,14 @@ void QContentHubServer::dispatch(msgpack::rpc::request req) {
             msgpack::type::tuple<std::string> params;
             req.params().convert(&params);
             force_del_queue(req, params.get<0>());
-        */
         } else if(method == "set_capacity") {
             msgpack::type::tuple<std::string, int> params;
             req.params().convert(&params);
             set_queue_capacity(req, params.get<0>(), params.get<1>());
+        } else if(method == "set_max_bytes") {
+            msgpack::type::tuple<std::string, int64_t> params;
+            req.params().convert(&params);
+            set_queue_max_bytes(req, params.get<0>(), params.get<1>());
         } else if(method == "start") {
             msgpack::type::tuple<std::string> params;
             req.params().convert(&params);
@@ -375,6 +1096,24 @@ void QContentHubServer::dispatch(msgpack::rpc::request req) {
             msgpack::type::tuple<std::string> params;
             req.params().convert(&params);
             clear_queue(req, params.get<0>());
+        } else if(method == "queue_metrics") {
+            msgpack::type::tuple<std::string> params;
+            req.params().convert(&params);
+            queue_metrics(req, params.get<0>());
+        } else if(method == "metrics") {
+            // an optional "text" argument asks for the text exposition
+            msgpack::object params_obj = req.params();
+            std::string format;
+            if (params_obj.type == msgpack::type::ARRAY && params_obj.via.array.size > 0) {
+                msgpack::type::tuple<std::string> params;
+                params_obj.convert(&params);
+                format = params.get<0>();
+            }
+            metrics(req, format == "text");
+        } else if(method == "shm_connect") {
+            msgpack::type::tuple<int> params;
+            req.params().convert(&params);
+            shm_connect(req, params.get<0>());
         } else if(method == "stats") {
             stats(req);
         } else if(method == "stat_queue") {
@@ -399,9 +1138,265 @@ void QContentHubServer::listen(uint16_t port)
     this->instance.listen("0.0.0.0", port);
 }
 
+void QContentHubServer::set_max_bytes(int64_t max_bytes)
+{
+    m_budget.max_bytes = max_bytes;
+}
+
+void QContentHubServer::set_shm(bool enabled, int max_clients, int max_ring)
+{
+    m_shm_enabled = enabled;
+    m_shm_max_clients = max_clients;
+    m_shm_max_ring = max_ring;
+}
+
+struct shm_session_t {
+    QContentHubServer *svr;
+    QContentShm *shm;
+    std::string name;
+};
+
+int QContentHubServer::shm_connect(int ring_size, std::string &name)
+{
+    if (!m_shm_enabled) {
+        return QCONTENTHUB_ERROR;
+    }
+    // every channel is a segment and a thread, the client falls back to
+    // msgpack-rpc when they run out
+    if (__sync_add_and_fetch(&m_shm_clients, 1) > m_shm_max_clients) {
+        __sync_fetch_and_sub(&m_shm_clients, 1);
+        return QCONTENTHUB_AGAIN;
+    }
+    if (ring_size <= 0) {
+        ring_size = QCONTENTHUB_SHM_RING_SIZE;
+    }
+    ring_size = std::min(ring_size, m_shm_max_ring);
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "/qcontenthub-%d-%u", (int)getpid(), __sync_fetch_and_add(&m_shm_seq, 1));
+    name = buf;
+    QContentShm *shm = new QContentShm();
+    if (!shm->create(name, ring_size)) {
+        delete shm;
+        __sync_fetch_and_sub(&m_shm_clients, 1);
+        return QCONTENTHUB_ERROR;
+    }
+    shm_session_t *session = new shm_session_t();
+    session->svr = this;
+    session->shm = shm;
+    session->name = name;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, &QContentHubServer::shm_main, session) != 0) {
+        perror("shm_connect");
+        shm_unlink(name.c_str());
+        delete shm;
+        delete session;
+        __sync_fetch_and_sub(&m_shm_clients, 1);
+        return QCONTENTHUB_ERROR;
+    }
+    pthread_detach(tid);
+    return QCONTENTHUB_OK;
+}
+
+void QContentHubServer::shm_connect(msgpack::rpc::request &req, int ring_size)
+{
+    std::string name;
+    int ret = shm_connect(ring_size, name);
+    req.result(msgpack::type::tuple<int, std::string>(ret, name));
+}
+
+void *QContentHubServer::shm_main(void *arg)
+{
+    shm_session_t *session = (shm_session_t *)arg;
+    QContentShm *shm = session->shm;
+
+    // the name goes once the client has mapped the segment, or gave up
+    for (int waited = 0; shm->channel()->client_pid == 0 && waited < QCONTENTHUB_SHM_ATTACH_TIMEOUT; waited++) {
+        usleep(1000);
+    }
+    shm_unlink(session->name.c_str());
+    if (shm->channel()->client_pid != 0) {
+        session->svr->serve_shm(shm);
+    }
+
+    __sync_fetch_and_sub(&session->svr->m_shm_clients, 1);
+    delete shm;
+    delete session;
+    return NULL;
+}
+
+// Answers the requests of a channel through the in-process calls, which
+// never park, so a persistent push is acknowledged before its group
+// commit as in process.
+void QContentHubServer::serve_shm(QContentShm *shm)
+{
+    std::string msg;
+    std::string name;
+    for (;;) {
+        int ret;
+        while ((ret = shm->requests.read(msg)) == QCONTENTHUB_AGAIN) {
+            if (!shm->requests.wait(1000) && !shm->peer_alive()) {
+                return;
+            }
+        }
+        // a client that broke its ring is closed like one with a bad
+        // name length
+        if (ret != QCONTENTHUB_OK) {
+            return;
+        }
+
+        uint32_t name_len = 0;
+        if (msg.size() >= 5) {
+            memcpy(&name_len, msg.data() + 1, 4);
+        }
+        if (msg.size() < 5 || msg[0] == QContentShm::OP_CLOSE || 5 + (size_t)name_len > msg.size()) {
+            return;
+        }
+        name.assign(msg, 5, name_len);
+
+        int32_t status;
+        QContentItem item;
+        if (msg[0] == QContentShm::OP_PUSH) {
+            msg.erase(0, 5 + name_len);
+            item.take(msg);
+            status = push_queue_nowait(name, item);
+        } else {
+            status = pop_queue_nowait(name, item);
+        }
+        if (!shm->replies.write((const char *)&status, 4, item.data(), status == QCONTENTHUB_OK ? item.size() : 0)) {
+            return;
+        }
+    }
+}
+
+void QContentHubServer::set_store_dir(const std::string &dir)
+{
+    m_store_dir = dir;
+    m_default_flags |= QCONTENTHUB_QUEUE_PERSIST;
+}
+
+int QContentHubServer::recover_queues()
+{
+    if (mkdir(m_store_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        perror(m_store_dir.c_str());
+        return QCONTENTHUB_ERROR;
+    }
+
+    DIR *d = opendir(m_store_dir.c_str());
+    if (d == NULL) {
+        perror(m_store_dir.c_str());
+        return QCONTENTHUB_ERROR;
+    }
+    std::vector<std::string> entries;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        entries.push_back(entry->d_name);
+    }
+    closedir(d);
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        std::string name;
+        int capacity, flags;
+        int64_t max_bytes;
+        if (!QContentLog::queue_name(entries[i], name)) {
+            continue;
+        }
+        if (!QContentLog::read_meta(m_store_dir + "/" + entries[i], capacity, flags, max_bytes)) {
+            fprintf(stderr, "%s/%s: no meta, skipped\n", m_store_dir.c_str(), entries[i].c_str());
+            continue;
+        }
+        if (add_queue(name, capacity, flags | QCONTENTHUB_QUEUE_PERSIST, max_bytes) != QCONTENTHUB_OK) {
+            return QCONTENTHUB_ERROR;
+        }
+    }
+    return QCONTENTHUB_OK;
+}
+
+// After a failed commit a persistent queue keeps only what reached the
+// disk: the items of the lost records leave the tail of the queue before
+// their pushes are answered error, so a client that pushes again does not
+// leave a copy behind. Lost items popped already cannot be taken back.
+static void fail_log(queue_t *q)
+{
+    push_waiter_list_t failed_pushes;
+    pthread_mutex_lock(&q->lock);
+    uint64_t lost = q->log->drop_lost();
+    while (lost > 0 && !q->item_q.empty()) {
+        QContentItem &obj = q->item_q.back();
+        lost -= std::min(lost, QContentLog::record_size(obj.size()));
+        release_bytes(q, obj.size());
+        q->item_q.pop_back();
+    }
+    failed_pushes.splice(failed_pushes.end(), q->push_waiters);
+    publish_waiters(q);
+    pthread_mutex_unlock(&q->lock);
+
+    q->log->fail_pending();
+    for (push_waiter_list_t::iterator it = failed_pushes.begin(); it != failed_pushes.end(); it++) {
+        it->req.result(QCONTENTHUB_ERROR);
+    }
+}
+
+bool QContentHubServer::commit_logs()
+{
+    // the logs are pinned so the fsyncs run without a registry guard,
+    // which would hold back the freeing of deleted queues
+    std::vector<std::pair<std::string, QContentLog *> > logs;
+    {
+        QueueRegistry::guard guard(m_queues);
+        const QueueRegistry::map_t &qmap = guard.map();
+        for (QueueRegistry::map_t::const_iterator it = qmap.begin(); it != qmap.end(); it++) {
+            if (it->second->log != NULL) {
+                it->second->log->retain();
+                logs.push_back(std::make_pair(it->first, it->second->log));
+            }
+        }
+    }
+
+    bool busy = false;
+    for (size_t i = 0; i < logs.size(); i++) {
+        QContentLog *log = logs[i].second;
+        int ret = log->commit();
+        if (ret == QCONTENTHUB_ERROR) {
+            // a deleted queue already answered its pushes
+            QueueRegistry::guard guard(m_queues);
+            queue_t *q = guard.find(logs[i].first);
+            if (q != NULL && q->log == log) {
+                fail_log(q);
+            }
+        }
+        if (ret != QCONTENTHUB_AGAIN) {
+            busy = true;
+        }
+        log->release();
+    }
+    return busy;
+}
+
+void *QContentHubServer::flush_main(void *arg)
+{
+    QContentHubServer *svr = (QContentHubServer *)arg;
+    for (;;) {
+        // every round commits what piled up during the previous fsyncs,
+        // an idle flusher sleeps until the next append
+        if (!svr->commit_logs()) {
+            svr->m_flush_signal.wait(QCONTENTHUB_CHECKPOINT_INTERVAL);
+        }
+    }
+    return NULL;
+}
+
 void QContentHubServer::start(int multiple)
 {
     m_start_time = get_current_time();
+    if (!m_store_dir.empty()) {
+        if (recover_queues() != QCONTENTHUB_OK) {
+            exit(EXIT_FAILURE);
+        }
+        pthread_t tid;
+        pthread_create(&tid, NULL, &QContentHubServer::flush_main, this);
+        pthread_detach(tid);
+    }
     this->instance.run(multiple);
 }
 
@@ -412,3 +1407,48 @@ int QContentHubServer::get_current_time()
     return tv.tv_sec;
 }
 
+uint64_t QContentHubServer::get_current_msec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+bool QContentHubServer::expire_waiters()
+{
+    uint64_t now = get_current_msec();
+    {
+        QueueRegistry::guard guard(m_queues);
+        const QueueRegistry::map_t &qmap = guard.map();
+        for (QueueRegistry::map_t::const_iterator it = qmap.begin(); it != qmap.end(); it++) {
+            queue_t *q = it->second;
+            pop_waiter_list_t done_pops;
+            push_waiter_list_t done_pushes;
+            pthread_mutex_lock(&q->lock);
+            pop_waiter_list_t::iterator pop_it = q->pop_waiters.begin();
+            while (pop_it != q->pop_waiters.end()) {
+                pop_waiter_list_t::iterator cur = pop_it++;
+                if (cur->deadline <= now) {
+                    done_pops.splice(done_pops.end(), q->pop_waiters, cur);
+                    __atomic_fetch_add(&q->metrics.pop_timeouts, 1, __ATOMIC_RELAXED);
+                }
+            }
+            push_waiter_list_t::iterator push_it = q->push_waiters.begin();
+            while (push_it != q->push_waiters.end()) {
+                push_waiter_list_t::iterator cur = push_it++;
+                if (cur->deadline <= now) {
+                    done_pushes.splice(done_pushes.end(), q->push_waiters, cur);
+                    __atomic_fetch_add(&q->metrics.push_timeouts, 1, __ATOMIC_RELAXED);
+                }
+            }
+            // pops from other queues may have freed room in the budget
+            fill_waiters(q, done_pops, done_pushes);
+            pthread_mutex_unlock(&q->lock);
+            complete_waiters(q, done_pops, done_pushes);
+        }
+    }
+
+    // free snapshots and queues retired by add and del
+    m_queues.reclaim();
+    return true;
+}
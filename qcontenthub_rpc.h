@@ -1,57 +1,220 @@
 #ifndef QCONTENTHUB_RPC_H
 #define QCONTENTHUB_RPC_H
 
+#include <msgpack/rpc/loop.h>
 #include <msgpack/rpc/server.h>
 #include <mp/sync.h>
 
 #include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <list>
 #include <map>
 #include <queue>
+#include <vector>
 
 #include "qcontenthub.h"
+#include "qcontenthub_item.h"
+#include "qcontenthub_metrics.h"
+#include "qcontenthub_ring.h"
+#include "qcontenthub_registry.h"
+#include "qcontenthub_log.h"
+#include "qcontenthub_shm.h"
+
+// a pop request parked until an item arrives or its deadline passes
+struct pop_waiter_t {
+    pop_waiter_t(const msgpack::rpc::request &r, uint64_t d, int n): req(r), deadline(d), parked(qcontenthub_usec()), max_items(n) {}
+
+    msgpack::rpc::request req;
+    // millisecs
+    uint64_t deadline;
+    // monotonic microsecs
+    uint64_t parked;
+    // 0 for a single pop
+    int max_items;
+    std::vector<QContentItem> items;
+};
+
+// a push request parked until the queue has room or its deadline passes
+struct push_waiter_t {
+    push_waiter_t(const msgpack::rpc::request &r, uint64_t d, bool b): req(r), deadline(d), parked(qcontenthub_usec()), batch(b), accepted(0), pushed(0) {}
+
+    msgpack::rpc::request req;
+    // millisecs
+    uint64_t deadline;
+    // monotonic microsecs
+    uint64_t parked;
+    bool batch;
+    // items of the batch accepted before parking
+    int accepted;
+    size_t pushed;
+    std::vector<QContentItem> objs;
+};
+
+class QContentShm;
+
+typedef std::list<pop_waiter_t> pop_waiter_list_t;
+typedef std::list<push_waiter_t> push_waiter_list_t;
+
+// counters are bumped with relaxed atomic adds, also on the lock-free
+// ring path
+struct queue_metrics_t {
+    queue_metrics_t(): enqueued(0), dequeued(0), push_blocked(0), push_timeouts(0), pop_blocked(0), pop_timeouts(0) {}
+
+    volatile uint64_t enqueued;
+    volatile uint64_t dequeued;
+    // pushes parked on a full queue and those that gave up
+    volatile uint64_t push_blocked;
+    volatile uint64_t push_timeouts;
+    // pops parked on an empty queue and those that gave up
+    volatile uint64_t pop_blocked;
+    volatile uint64_t pop_timeouts;
+    // microsecs from parking to the answer
+    QContentHistogram push_wait;
+    QContentHistogram pop_wait;
+    // microsecs from push to pop of an item
+    QContentHistogram residence;
+};
+
+// payload bytes held by all hub queues, against --max-memory
+struct budget_t {
+    volatile int64_t bytes;
+    // 0 for no limit
+    int64_t max_bytes;
+};
 
 struct queue_t {
     volatile int capacity;
+    // payload bytes in the queue and their limit, 0 for no limit
+    volatile int64_t bytes;
+    volatile int64_t max_bytes;
+    budget_t *budget;
     volatile int stop;
+    // set under lock once del has unlinked the queue
+    volatile int deleted;
+    int flags;
     pthread_mutex_t lock;
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
-    std::queue<std::string> str_q;
+    std::deque<QContentItem> item_q;
+    // replaces item_q for QCONTENTHUB_QUEUE_RING queues, pushes and pops
+    // then skip the lock unless somebody is parked
+    QContentRing<QContentItem> *ring;
+    // segment log of a QCONTENTHUB_QUEUE_PERSIST queue
+    QContentLog *log;
+    pop_waiter_list_t pop_waiters;
+    push_waiter_list_t push_waiters;
+    // mirror !pop_waiters.empty() and !push_waiters.empty() for readers
+    // that do not hold the lock
+    volatile int has_pop_waiters;
+    volatile int has_push_waiters;
+    queue_metrics_t metrics;
 };
 
-typedef std::map<std::string, queue_t *> queue_map_t;
-typedef std::map<std::string, queue_t *>::iterator queue_map_it_t;
-
+// The hub queues. libqcontenthub embeds it through the in-process calls
+// below, qcontenthubd serves it over msgpack-rpc.
 class QContentHubServer : public msgpack::rpc::server::base {
 
 public:
-    void add_queue(msgpack::rpc::request &req, const std::string &name, int capacity);
+    QContentHubServer(msgpack::rpc::loop lo = msgpack::rpc::loop()) : msgpack::rpc::server::base(lo), m_queues(&QContentHubServer::free_queue), m_default_flags(0), m_start_time(0), m_shm_enabled(false), m_shm_max_clients(QCONTENTHUB_SHM_MAX_CLIENTS), m_shm_max_ring(QCONTENTHUB_SHM_RING_LIMIT), m_shm_seq(0), m_shm_clients(0) {
+        m_budget.bytes = 0;
+        m_budget.max_bytes = 0;
+    }
+    void add_queue(msgpack::rpc::request &req, const std::string &name, int capacity, int flags);
 
-    //void del_queue(msgpack::rpc::request &req, const std::string &name);
-    //void force_del_queue(msgpack::rpc::request &req, const std::string &name);
+    void del_queue(msgpack::rpc::request &req, const std::string &name);
+    void force_del_queue(msgpack::rpc::request &req, const std::string &name);
     void start_queue(msgpack::rpc::request &req, const std::string &name);
     void stop_queue(msgpack::rpc::request &req, const std::string &name);
     void clear_queue(msgpack::rpc::request &req, const std::string &name);
     void set_queue_capacity(msgpack::rpc::request &req, const std::string &name, int capacity);
-    void push_queue(msgpack::rpc::request &req, const std::string &name, const std::string &obj);
-    void push_queue_nowait(msgpack::rpc::request &req, const std::string &name, const std::string &obj);
+    void set_queue_max_bytes(msgpack::rpc::request &req, const std::string &name, int64_t max_bytes);
+    // pushes take the payloads out of obj and objs
+    void push_queue(msgpack::rpc::request &req, const std::string &name, QContentItem &obj);
+    void push_queue_nowait(msgpack::rpc::request &req, const std::string &name, QContentItem &obj);
     void pop_queue(msgpack::rpc::request &req, const std::string &name);
     void pop_queue_nowait(msgpack::rpc::request &req, const std::string &name);
+    void push_queue_batch(msgpack::rpc::request &req, const std::string &name, std::vector<QContentItem> &objs);
+    // max_wait: millisecs to wait for the first item
+    void pop_queue_batch(msgpack::rpc::request &req, const std::string &name, int max_items, int max_wait);
+
+    // In-process calls, thread safe and usable next to the RPCs. They
+    // never park: a full or empty queue answers QCONTENTHUB_AGAIN. A push
+    // to a persistent queue returns before the next group commit makes
+    // it durable.
+    int add_queue(const std::string &name, int capacity, int flags, int64_t max_bytes = 0);
+    int del_queue(const std::string &name, bool force);
+    // creates a missing queue like the push RPC, takes the payload of obj
+    int push_queue_nowait(const std::string &name, QContentItem &obj);
+    // QCONTENTHUB_ERROR for an unknown queue
+    int pop_queue_nowait(const std::string &name, QContentItem &obj);
+    // the number of leading items accepted, or QCONTENTHUB_ERROR
+    int push_queue_batch(const std::string &name, std::vector<QContentItem> &objs);
+    // appends up to max_items items to items, returns their number or
+    // QCONTENTHUB_ERROR for an unknown queue
+    int pop_queue_batch(const std::string &name, int max_items, std::vector<QContentItem> &items);
+
+    // announces a shared memory channel to a client on the same host,
+    // answered with the status and the segment name; a thread serves the
+    // channel until the client closes it or exits
+    void shm_connect(msgpack::rpc::request &req, int ring_size);
+    int shm_connect(int ring_size, std::string &name);
+
     void stats(msgpack::rpc::request &req);
     void stat_queue(msgpack::rpc::request &req, const std::string &name);
+    // counters, gauges and latency percentiles of a queue as a map
+    void queue_metrics(msgpack::rpc::request &req, const std::string &name);
+    // typed metrics of the server and of every queue, or their text
+    // exposition
+    void metrics(msgpack::rpc::request &req, bool text);
     void listen(uint16_t port);
+    // keep queues in segment logs below dir, call before start
+    void set_store_dir(const std::string &dir);
+    // bytes budget of all queues together, 0 for no limit
+    void set_max_bytes(int64_t max_bytes);
+    // answer shm_connect, off by default; at most max_clients channels at
+    // once, with rings of at most max_ring bytes
+    void set_shm(bool enabled, int max_clients = QCONTENTHUB_SHM_MAX_CLIENTS, int max_ring = QCONTENTHUB_SHM_RING_LIMIT);
     void start(int multiple);
 public:
     void dispatch(msgpack::rpc::request req);
 
+    // answer parked requests whose deadline has passed, driven by a loop
+    // timer; also frees deleted queues, so an embedder without a loop
+    // calls it now and then
+    bool expire_waiters();
+
 private:
-    int add_queue(const std::string &name, int capacity);
+    // *pushed_to is the queue pushed to, valid while the caller holds a
+    // registry guard
+    int push_nowait(const std::string &name, QContentItem &obj, queue_t **pushed_to);
+    static void free_queue(queue_t *q);
+
+    // rebuild the persistent queues from the store directory
+    int recover_queues();
+    // group commit of every persistent queue, run by the flusher thread
+    bool commit_logs();
+    static void *flush_main(void *arg);
+    static void *shm_main(void *arg);
+    void serve_shm(QContentShm *shm);
 
     // secs
     int get_current_time();
+    // millisecs
+    uint64_t get_current_msec();
 
-	mp::sync<queue_map_t> q_map;
+    QueueRegistry m_queues;
+    budget_t m_budget;
+    std::string m_store_dir;
+    // wakes the flusher thread
+    QContentFlushSignal m_flush_signal;
+    // flags of queues created by a push to an unknown name
+    int m_default_flags;
     int m_start_time;
+    bool m_shm_enabled;
+    int m_shm_max_clients;
+    int m_shm_max_ring;
+    volatile uint32_t m_shm_seq;
+    // channels being served
+    volatile int m_shm_clients;
 };
 
 #endif
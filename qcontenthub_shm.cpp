@@ -0,0 +1,399 @@
+#include "qcontenthub_shm.h"
+#include "qcontenthub.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <algorithm>
+
+#define SHM_MAGIC 0x51434853
+// length of a wrap marker, and the bit of a fragment followed by more
+#define SHM_WRAP 0xffffffffu
+#define SHM_MORE 0x80000000u
+// rounds of sched_yield before sleeping on a futex
+#define SHM_SPIN 64
+
+static size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+static void futex_wait(volatile uint32_t *word, uint32_t val, int timeout_ms)
+{
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(volatile uint32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// copies len bytes from offset off of the concatenation of a and b
+static void copy_parts(char *dst, const char *a, size_t a_size, const char *b, size_t off, size_t len)
+{
+    if (off < a_size) {
+        size_t n = std::min(len, a_size - off);
+        memcpy(dst, a + off, n);
+        dst += n;
+        len -= n;
+        off = a_size;
+    }
+    if (len > 0) {
+        memcpy(dst, b + off - a_size, len);
+    }
+}
+
+void QContentShmRing::init(QContentShm *owner, char *base, uint32_t capacity)
+{
+    m_owner = owner;
+    m_ring = (shm_ring_t *)base;
+    m_data = base + sizeof(shm_ring_t);
+    m_capacity = capacity;
+    m_partial.clear();
+}
+
+void QContentShmRing::publish(uint64_t tail)
+{
+    __sync_synchronize();
+    m_ring->tail = tail;
+    __sync_fetch_and_add(&m_ring->data_seq, 1);
+    if (m_ring->data_waiting) {
+        futex_wake(&m_ring->data_seq);
+    }
+}
+
+void QContentShmRing::consume(uint64_t head)
+{
+    __sync_synchronize();
+    m_ring->head = head;
+    __sync_fetch_and_add(&m_ring->space_seq, 1);
+    if (m_ring->space_waiting) {
+        futex_wake(&m_ring->space_seq);
+    }
+}
+
+// A sleeper raises its flag, reads the futex word and then looks at the
+// ring again; the other side moves its index, bumps the word and then
+// looks at the flag. With full barriers in between, either the sleeper
+// sees the move or the futex word changed under it and it does not sleep.
+bool QContentShmRing::wait(int timeout_ms)
+{
+    for (int i = 0; i < SHM_SPIN; i++) {
+        if (m_ring->tail != m_ring->head) {
+            return true;
+        }
+        sched_yield();
+    }
+    m_ring->data_waiting = 1;
+    __sync_synchronize();
+    uint32_t seq = m_ring->data_seq;
+    __sync_synchronize();
+    if (m_ring->tail == m_ring->head) {
+        futex_wait(&m_ring->data_seq, seq, timeout_ms);
+    }
+    m_ring->data_waiting = 0;
+    return m_ring->tail != m_ring->head;
+}
+
+bool QContentShmRing::wait_space(uint64_t room, int timeout_ms)
+{
+    for (int i = 0; i < SHM_SPIN; i++) {
+        if (m_capacity - (m_ring->tail - m_ring->head) >= room) {
+            return true;
+        }
+        sched_yield();
+    }
+    m_ring->space_waiting = 1;
+    __sync_synchronize();
+    uint32_t seq = m_ring->space_seq;
+    __sync_synchronize();
+    if (m_capacity - (m_ring->tail - m_ring->head) < room) {
+        futex_wait(&m_ring->space_seq, seq, timeout_ms);
+    }
+    m_ring->space_waiting = 0;
+    return m_capacity - (m_ring->tail - m_ring->head) >= room;
+}
+
+bool QContentShmRing::write(const char *a, size_t a_size, const char *b, size_t b_size)
+{
+    // a quarter of the ring per fragment keeps both sides moving
+    size_t max_fragment = m_capacity / 4 - 8;
+    size_t total = a_size + b_size;
+    size_t done = 0;
+    do {
+        size_t len = std::min(total - done, max_fragment);
+        size_t need = align8(4 + len);
+        uint64_t tail = m_ring->tail;
+        size_t pos = tail & (m_capacity - 1);
+        size_t skip = m_capacity - pos < need ? m_capacity - pos : 0;
+        while (!wait_space(skip + need, 100)) {
+            if (!m_owner->peer_alive()) {
+                return false;
+            }
+        }
+        if (skip > 0) {
+            *(uint32_t *)(m_data + pos) = SHM_WRAP;
+            pos = 0;
+        }
+        uint32_t header = len | (done + len < total ? SHM_MORE : 0);
+        memcpy(m_data + pos, &header, 4);
+        copy_parts(m_data + pos + 4, a, a_size, b, done, len);
+        publish(tail + skip + need);
+        done += len;
+    } while (done < total);
+    return true;
+}
+
+int QContentShmRing::read(std::string &msg)
+{
+    for (;;) {
+        uint64_t head = m_ring->head;
+        uint64_t tail = m_ring->tail;
+        if (head == tail) {
+            return QCONTENTHUB_AGAIN;
+        }
+        // the other side writes the indices and lengths, so none of them
+        // is trusted to stay within the ring
+        if (tail - head > m_capacity) {
+            return QCONTENTHUB_ERROR;
+        }
+        __sync_synchronize();
+        size_t pos = head & (m_capacity - 1);
+        if (pos + 4 > m_capacity) {
+            return QCONTENTHUB_ERROR;
+        }
+        uint32_t header;
+        memcpy(&header, m_data + pos, 4);
+        if (header == SHM_WRAP) {
+            consume(head + m_capacity - pos);
+            continue;
+        }
+        size_t len = header & ~SHM_MORE;
+        if (len > m_capacity / 4 || pos + 4 + len > m_capacity || align8(4 + len) > tail - head) {
+            return QCONTENTHUB_ERROR;
+        }
+        m_partial.append(m_data + pos + 4, len);
+        consume(head + align8(4 + len));
+        if (!(header & SHM_MORE)) {
+            msg.swap(m_partial);
+            m_partial.clear();
+            return QCONTENTHUB_OK;
+        }
+    }
+}
+
+QContentShm::~QContentShm()
+{
+    if (m_base != NULL) {
+        close();
+        munmap(m_base, m_size);
+    }
+}
+
+static uint32_t ring_capacity(uint32_t ring_size)
+{
+    uint32_t capacity = QCONTENTHUB_SHM_RING_MIN;
+    while (capacity < ring_size && capacity < QCONTENTHUB_SHM_RING_MAX) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+bool QContentShm::create(const std::string &name, uint32_t ring_size)
+{
+    uint32_t capacity = ring_capacity(ring_size);
+    size_t size = sizeof(shm_channel_t) + 2 * QContentShmRing::bytes(capacity);
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror(name.c_str());
+        return false;
+    }
+    if (ftruncate(fd, size) != 0) {
+        perror(name.c_str());
+        ::close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        perror(name.c_str());
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    // ftruncate zeroed the rings
+    m_base = (char *)base;
+    m_size = size;
+    m_server = true;
+    shm_channel_t *ch = channel();
+    ch->ring_size = capacity;
+    ch->server_pid = getpid();
+    __sync_synchronize();
+    ch->magic = SHM_MAGIC;
+    map_rings();
+    return true;
+}
+
+bool QContentShm::attach(const std::string &name)
+{
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(shm_channel_t)) {
+        base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+
+    shm_channel_t *ch = (shm_channel_t *)base;
+    if (ch->magic != SHM_MAGIC || sizeof(shm_channel_t) + 2 * QContentShmRing::bytes(ch->ring_size) > (size_t)st.st_size) {
+        munmap(base, st.st_size);
+        return false;
+    }
+    m_base = (char *)base;
+    m_size = st.st_size;
+    m_server = false;
+    map_rings();
+    __sync_synchronize();
+    ch->client_pid = getpid();
+    return true;
+}
+
+void QContentShm::map_rings()
+{
+    uint32_t capacity = channel()->ring_size;
+    char *base = m_base + sizeof(shm_channel_t);
+    requests.init(this, base, capacity);
+    replies.init(this, base + QContentShmRing::bytes(capacity), capacity);
+}
+
+void QContentShm::close()
+{
+    channel()->closed = 1;
+    // wake the other side wherever it sleeps, so it sees closed
+    shm_ring_t *rings[2] = {
+        (shm_ring_t *)(m_base + sizeof(shm_channel_t)),
+        (shm_ring_t *)(m_base + sizeof(shm_channel_t) + QContentShmRing::bytes(channel()->ring_size))
+    };
+    for (int i = 0; i < 2; i++) {
+        __sync_fetch_and_add(&rings[i]->data_seq, 1);
+        futex_wake(&rings[i]->data_seq);
+        __sync_fetch_and_add(&rings[i]->space_seq, 1);
+        futex_wake(&rings[i]->space_seq);
+    }
+}
+
+bool QContentShm::peer_alive() const
+{
+    const shm_channel_t *ch = channel();
+    pid_t pid = m_server ? ch->client_pid : ch->server_pid;
+    if (ch->closed || pid == 0) {
+        return false;
+    }
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+QContentHubShmClient::QContentHubShmClient(const std::string &host, uint16_t port, bool try_shm, uint32_t ring_size): m_client(host, port), m_shm(NULL)
+{
+    if (!try_shm) {
+        return;
+    }
+    // a hub without --shm or on another host leaves us on msgpack-rpc
+    try {
+        msgpack::type::tuple<int, std::string> ret = m_client.call("shm_connect", (int)ring_size).get<msgpack::type::tuple<int, std::string> >();
+        if (ret.get<0>() == QCONTENTHUB_OK) {
+            m_shm = new QContentShm();
+            if (!m_shm->attach(ret.get<1>())) {
+                drop_shm();
+            }
+        }
+    } catch (std::exception &e) {
+        drop_shm();
+    }
+}
+
+QContentHubShmClient::~QContentHubShmClient()
+{
+    if (m_shm != NULL) {
+        char op = QContentShm::OP_CLOSE;
+        uint32_t name_len = 0;
+        std::string head(&op, 1);
+        head.append((const char *)&name_len, 4);
+        m_shm->requests.write(head.data(), head.size(), NULL, 0);
+    }
+    drop_shm();
+}
+
+void QContentHubShmClient::drop_shm()
+{
+    delete m_shm;
+    m_shm = NULL;
+}
+
+int QContentHubShmClient::call(int op, const std::string &queue, const std::string &data, std::string &reply)
+{
+    std::string head(1, (char)op);
+    uint32_t name_len = queue.size();
+    head.append((const char *)&name_len, 4);
+    head.append(queue);
+    if (!m_shm->requests.write(head.data(), head.size(), data.data(), data.size())) {
+        drop_shm();
+        return QCONTENTHUB_ERROR;
+    }
+    int ret;
+    while ((ret = m_shm->replies.read(reply)) == QCONTENTHUB_AGAIN) {
+        if (!m_shm->replies.wait(100) && !m_shm->peer_alive()) {
+            break;
+        }
+    }
+    if (ret != QCONTENTHUB_OK) {
+        drop_shm();
+        return QCONTENTHUB_ERROR;
+    }
+    int32_t status = QCONTENTHUB_ERROR;
+    if (reply.size() >= 4) {
+        memcpy(&status, reply.data(), 4);
+        reply.erase(0, 4);
+    }
+    return status;
+}
+
+int QContentHubShmClient::push(const std::string &queue, const std::string &data)
+{
+    if (m_shm != NULL) {
+        std::string reply;
+        return call(QContentShm::OP_PUSH, queue, data, reply);
+    }
+    return m_client.call("push_nowait", queue, msgpack::type::raw_ref(data.data(), data.size())).get<int>();
+}
+
+int QContentHubShmClient::pop(const std::string &queue, std::string &data)
+{
+    if (m_shm != NULL) {
+        return call(QContentShm::OP_POP, queue, std::string(), data);
+    }
+    data = m_client.call("pop_nowait", queue).get<std::string>();
+    if (data == QCONTENTHUB_STRAGAIN) {
+        return QCONTENTHUB_AGAIN;
+    } else if (data == QCONTENTHUB_STRERROR) {
+        return QCONTENTHUB_ERROR;
+    }
+    return QCONTENTHUB_OK;
+}
@@ -0,0 +1,164 @@
+#ifndef QCONTENTHUB_SHM_H
+#define QCONTENTHUB_SHM_H
+
+#include <msgpack/rpc/client.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// bytes of each ring of a shared memory channel, rounded up to a power of
+// two within the limits
+#define QCONTENTHUB_SHM_RING_SIZE (1024 * 1024)
+#define QCONTENTHUB_SHM_RING_MIN (64 * 1024)
+#define QCONTENTHUB_SHM_RING_MAX (64 * 1024 * 1024)
+
+// channels the hub serves at once, and the largest ring it creates
+// whatever a client asks for
+#define QCONTENTHUB_SHM_MAX_CLIENTS 64
+#define QCONTENTHUB_SHM_RING_LIMIT (4 * 1024 * 1024)
+
+// millisecs the server waits for a client to map a channel it announced
+#define QCONTENTHUB_SHM_ATTACH_TIMEOUT 5000
+
+// start of a channel segment
+struct shm_channel_t {
+    uint32_t magic;
+    uint32_t ring_size;
+    volatile int32_t server_pid;
+    // 0 until the client has mapped the segment
+    volatile int32_t client_pid;
+    volatile int32_t closed;
+    char pad[44];
+};
+
+// indices of one ring, each side writes its own cache line
+struct shm_ring_t {
+    // bytes consumed, moved by the consumer
+    volatile uint64_t head;
+    // bumped after head moves, a futex word for a producer out of room
+    volatile uint32_t space_seq;
+    volatile uint32_t space_waiting;
+    char pad0[48];
+    // bytes published, moved by the producer
+    volatile uint64_t tail;
+    // bumped after tail moves, a futex word for a consumer out of messages
+    volatile uint32_t data_seq;
+    volatile uint32_t data_waiting;
+    char pad1[48];
+};
+
+class QContentShm;
+
+// Single producer, single consumer ring of messages in shared memory.
+//
+// A message is one or more fragments of a 32 bit length and the bytes,
+// 8 byte aligned. The top bit of the length says more fragments follow,
+// so a message larger than the ring streams through it while the
+// consumer reads. A fragment that would cross the end of the ring is
+// preceded by a wrap marker and starts at 0 instead.
+//
+// A side that runs dry spins a little, then sleeps on the futex word the
+// other side bumps after every move, and only then is it woken with a
+// syscall.
+class QContentShmRing {
+public:
+    QContentShmRing(): m_ring(NULL), m_data(NULL), m_capacity(0), m_owner(NULL) {}
+
+    // base holds a shm_ring_t and capacity bytes
+    void init(QContentShm *owner, char *base, uint32_t capacity);
+    static size_t bytes(uint32_t capacity) { return sizeof(shm_ring_t) + capacity; }
+
+    // writes a message of a then b, waiting for room; false once the
+    // other side is gone
+    bool write(const char *a, size_t a_size, const char *b, size_t b_size);
+    // QCONTENTHUB_OK with a whole message, QCONTENTHUB_AGAIN until one
+    // has arrived, QCONTENTHUB_ERROR once the other side broke the ring
+    int read(std::string &msg);
+    // true once something can be read, false after timeout_ms
+    bool wait(int timeout_ms);
+
+private:
+    bool wait_space(uint64_t room, int timeout_ms);
+    void publish(uint64_t tail);
+    void consume(uint64_t head);
+
+    shm_ring_t *m_ring;
+    char *m_data;
+    uint32_t m_capacity;
+    QContentShm *m_owner;
+    // fragments of a message not complete yet
+    std::string m_partial;
+};
+
+// Shared memory channel between the hub and one client on the same host:
+// a segment in /dev/shm with a request ring and a reply ring. A request is
+// an op byte, a 32 bit queue name length, the name and the payload; a
+// reply is a 32 bit status and the payload.
+class QContentShm {
+public:
+    enum {
+        OP_PUSH = 1,
+        OP_POP,
+        OP_CLOSE
+    };
+
+    QContentShm(): m_base(NULL), m_size(0), m_server(false) {}
+    ~QContentShm();
+
+    // the server creates the segment name with rings of ring_size bytes
+    bool create(const std::string &name, uint32_t ring_size);
+    // the client maps the segment the server announced
+    bool attach(const std::string &name);
+    shm_channel_t *channel() const { return (shm_channel_t *)m_base; }
+
+    // tells the other side the channel is done
+    void close();
+    // false once the other side closed the channel or its process is gone
+    bool peer_alive() const;
+
+    QContentShmRing requests;
+    QContentShmRing replies;
+
+private:
+    QContentShm(const QContentShm &);
+    QContentShm &operator=(const QContentShm &);
+
+    void map_rings();
+
+    char *m_base;
+    size_t m_size;
+    bool m_server;
+};
+
+// Client of the hub queues that pushes and pops through a shared memory
+// channel when the hub runs on the same host with --shm, and through
+// push_nowait and pop_nowait over msgpack-rpc otherwise or once the
+// channel breaks. Like a msgpack::rpc::client it is used by one thread
+// at a time.
+class QContentHubShmClient {
+public:
+    QContentHubShmClient(const std::string &host, uint16_t port, bool try_shm = true, uint32_t ring_size = QCONTENTHUB_SHM_RING_SIZE);
+    ~QContentHubShmClient();
+
+    bool using_shm() const { return m_shm != NULL; }
+
+    // QCONTENTHUB_OK, QCONTENTHUB_AGAIN when the queue is full or
+    // QCONTENTHUB_ERROR
+    int push(const std::string &queue, const std::string &data);
+    // QCONTENTHUB_OK, QCONTENTHUB_AGAIN when the queue is empty or
+    // stopped, QCONTENTHUB_ERROR for an unknown queue
+    int pop(const std::string &queue, std::string &data);
+
+private:
+    QContentHubShmClient(const QContentHubShmClient &);
+    QContentHubShmClient &operator=(const QContentHubShmClient &);
+
+    int call(int op, const std::string &queue, const std::string &data, std::string &reply);
+    void drop_shm();
+
+    msgpack::rpc::client m_client;
+    QContentShm *m_shm;
+};
+
+#endif
@@ -0,0 +1,18 @@
+TEMPLATE = app
+
+TARGET=qcontenthubd
+
+SOURCES += main.cpp
+HEADERS += qcontenthub_rpc.h qurlqueue_rpc.h qcontenthub.h
+
+CONFIG += release
+QT -= gui core
+
+LIBS = -L. -lqcontenthub -lmsgpack-rpc -lrt
+PRE_TARGETDEPS += libqcontenthub.a
+
+INSTALLDIR=/opt/qcontent/3rdparty/
+
+target.path  = $$INSTALLDIR/bin
+
+INSTALLS += target
@@ -0,0 +1,92 @@
+#include "qurlqueue_filter.h"
+
+#include <math.h>
+
+static uint64_t fmix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t fnv1a(uint64_t h, const std::string &s)
+{
+    for (size_t i = 0; i < s.size(); i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+QUrlFilter::QUrlFilter(size_t bytes, double fp_rate): m_current(0), m_size(0), m_rotations(0)
+{
+    if (fp_rate <= 0 || fp_rate >= 1) {
+        fp_rate = 0.001;
+    }
+    m_words = bytes / 2 / sizeof(uint64_t);
+    if (m_words == 0) {
+        m_words = 1;
+    }
+    m_bits[0].assign(m_words, 0);
+    m_bits[1].assign(m_words, 0);
+
+    // optimal bloom filter: k = log2(1/p), n = m * ln2^2 / ln(1/p)
+    double bits = (double)m_words * 64;
+    m_hashes = (int)ceil(-log(fp_rate) / log(2.0));
+    m_capacity = (size_t)(bits * log(2.0) * log(2.0) / -log(fp_rate));
+    if (m_capacity == 0) {
+        m_capacity = 1;
+    }
+}
+
+bool QUrlFilter::test(int gen, uint64_t h1, uint64_t h2) const
+{
+    const std::vector<uint64_t> &bits = m_bits[gen];
+    uint64_t nbits = m_words * 64;
+    for (int i = 0; i < m_hashes; i++) {
+        uint64_t bit = (h1 + i * h2) % nbits;
+        if (!(bits[bit / 64] & (1ULL << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool QUrlFilter::check_and_add(const std::string &site, const std::string &record)
+{
+    // two hashes of site and record, the k probes are h1 + i * h2
+    uint64_t h = fnv1a(14695981039346656037ULL, site);
+    h = fnv1a(h ^ 0xff, record);
+    uint64_t h1 = fmix64(h);
+    uint64_t h2 = fmix64(h1 ^ 0x9e3779b97f4a7c15ULL) | 1;
+
+    if (test(m_current, h1, h2)) {
+        return true;
+    }
+    // a url only the older generation has is copied forward, so it lives
+    // through the next rotation
+    bool seen = test(1 - m_current, h1, h2);
+
+    if (m_size >= m_capacity) {
+        rotate();
+    }
+    std::vector<uint64_t> &bits = m_bits[m_current];
+    uint64_t nbits = m_words * 64;
+    for (int i = 0; i < m_hashes; i++) {
+        uint64_t bit = (h1 + i * h2) % nbits;
+        bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+    m_size++;
+    return seen;
+}
+
+void QUrlFilter::rotate()
+{
+    m_current = 1 - m_current;
+    m_bits[m_current].assign(m_words, 0);
+    m_size = 0;
+    m_rotations++;
+}
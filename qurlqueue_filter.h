@@ -0,0 +1,47 @@
+#ifndef QURLQUEUE_FILTER_H
+#define QURLQUEUE_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Rotating bloom filter of pushed urls, not thread safe.
+//
+// It keeps two generations of the same size. A url counts as seen when
+// either generation has it and is added to the current one. rotate()
+// drops the older generation and starts an empty one, which happens on a
+// timer and whenever the current generation reaches its capacity, so a
+// url is forgotten one to two rotations after it was last pushed and the
+// false positive rate never climbs past the configured one.
+class QUrlFilter {
+public:
+    // bytes is the memory of both generations, fp_rate the false positive
+    // rate of a generation holding capacity() urls
+    QUrlFilter(size_t bytes, double fp_rate);
+
+    // true if site and record were probably added before, otherwise adds
+    // them and returns false
+    bool check_and_add(const std::string &site, const std::string &record);
+    void rotate();
+
+    size_t bytes() const { return 2 * m_words * sizeof(uint64_t); }
+    size_t capacity() const { return m_capacity; }
+    size_t size() const { return m_size; }
+    int hashes() const { return m_hashes; }
+    uint64_t rotations() const { return m_rotations; }
+
+private:
+    bool test(int gen, uint64_t h1, uint64_t h2) const;
+
+    std::vector<uint64_t> m_bits[2];
+    int m_current;
+    size_t m_words;
+    int m_hashes;
+    size_t m_capacity;
+    // urls added to the current generation
+    size_t m_size;
+    uint64_t m_rotations;
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef QURLQUEUE_HEAP_H
+#define QURLQUEUE_HEAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Indexed 4-ary min-heap on next_crawl_time. Every entry keeps its slot in
+// heap_index, -1 while it is out of the heap, so an entry is in the heap
+// at most once and is moved or removed in place rather than left behind
+// for pop to skip. T needs uint64_t next_crawl_time and int heap_index.
+template <typename T>
+class QUrlHeap {
+public:
+    bool empty() const { return m_heap.empty(); }
+    size_t size() const { return m_heap.size(); }
+    T *top() const { return m_heap[0]; }
+
+    static bool contains(const T *t) { return t->heap_index >= 0; }
+
+    void push(T *t) {
+        t->heap_index = m_heap.size();
+        m_heap.push_back(t);
+        sift_up(t->heap_index);
+    }
+
+    // restores the order after t->next_crawl_time changed
+    void update(T *t) {
+        sift_up(t->heap_index);
+        sift_down(t->heap_index);
+    }
+
+    void erase(T *t) {
+        size_t i = t->heap_index;
+        T *last = m_heap.back();
+        m_heap.pop_back();
+        t->heap_index = -1;
+        if (last != t) {
+            m_heap[i] = last;
+            last->heap_index = i;
+            update(last);
+        }
+    }
+
+    void clear() {
+        for (size_t i = 0; i < m_heap.size(); i++) {
+            m_heap[i]->heap_index = -1;
+        }
+        m_heap.clear();
+    }
+
+private:
+    void place(size_t i, T *t) {
+        m_heap[i] = t;
+        t->heap_index = i;
+    }
+
+    void sift_up(size_t i) {
+        T *t = m_heap[i];
+        while (i > 0) {
+            size_t parent = (i - 1) / 4;
+            if (m_heap[parent]->next_crawl_time <= t->next_crawl_time) {
+                break;
+            }
+            place(i, m_heap[parent]);
+            i = parent;
+        }
+        place(i, t);
+    }
+
+    void sift_down(size_t i) {
+        T *t = m_heap[i];
+        size_t n = m_heap.size();
+        for (;;) {
+            size_t first = 4 * i + 1;
+            if (first >= n) {
+                break;
+            }
+            size_t end = first + 4 < n ? first + 4 : n;
+            size_t min = first;
+            for (size_t c = first + 1; c < end; c++) {
+                if (m_heap[c]->next_crawl_time < m_heap[min]->next_crawl_time) {
+                    min = c;
+                }
+            }
+            if (m_heap[min]->next_crawl_time >= t->next_crawl_time) {
+                break;
+            }
+            place(i, m_heap[min]);
+            i = min;
+        }
+        place(i, t);
+    }
+
+    std::vector<T *> m_heap;
+};
+
+#endif
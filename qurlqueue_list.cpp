@@ -0,0 +1,438 @@
+#include "qurlqueue_list.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+
+// front and back sequence numbers start far from both ends of the range
+#define FIRST_SEQ ((uint64_t)1 << 62)
+
+static size_t put_varint(char *p, size_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)v;
+    return n;
+}
+
+static size_t get_varint(const char *p, size_t &v)
+{
+    size_t n = 0;
+    int shift = 0;
+    v = 0;
+    for (;;) {
+        unsigned char b = p[n++];
+        v |= (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return n;
+        }
+        shift += 7;
+    }
+}
+
+QUrlList::QUrlList(): m_head(0), m_has_prefix(false), m_size(0), m_bytes(0), m_next_seq(FIRST_SEQ)
+{
+}
+
+QUrlList::~QUrlList()
+{
+    clear();
+}
+
+QUrlList::chunk_t *QUrlList::new_chunk(size_t capacity)
+{
+    capacity = std::max(capacity, (size_t)QURLQUEUE_CHUNK_MIN);
+    size_t size = offsetof(chunk_t, data) + capacity;
+    chunk_t *c = (chunk_t *)malloc(size);
+    if (c == NULL) {
+        throw std::bad_alloc();
+    }
+    c->count = 0;
+    c->capacity = capacity;
+    m_bytes += size;
+    return c;
+}
+
+QUrlList::chunk_t *QUrlList::grow_chunk(chunk_t *c, size_t capacity)
+{
+    chunk_t *grown = (chunk_t *)realloc(c, offsetof(chunk_t, data) + capacity);
+    if (grown == NULL) {
+        throw std::bad_alloc();
+    }
+    m_bytes += capacity - grown->capacity;
+    grown->capacity = capacity;
+    return grown;
+}
+
+void QUrlList::free_chunk(chunk_t *c)
+{
+    m_bytes -= offsetof(chunk_t, data) + c->capacity;
+    free(c);
+}
+
+// size of the record of url, filling in its varint header
+size_t QUrlList::encode(const std::string &url, char *header, size_t &header_size, size_t &shared) const
+{
+    size_t max = std::min(url.size(), m_prefix.size());
+    shared = 0;
+    while (shared < max && url[shared] == m_prefix[shared]) {
+        shared++;
+    }
+    header_size = put_varint(header, shared);
+    header_size += put_varint(header + header_size, url.size() - shared);
+    return header_size + url.size() - shared;
+}
+
+void QUrlList::write(char *p, const std::string &url, const char *header, size_t header_size, size_t shared) const
+{
+    memcpy(p, header, header_size);
+    memcpy(p + header_size, url.data() + shared, url.size() - shared);
+}
+
+size_t QUrlList::decode(const char *p, std::string &url) const
+{
+    size_t shared, rest;
+    size_t n = get_varint(p, shared);
+    n += get_varint(p + n, rest);
+    url.assign(m_prefix, 0, shared);
+    url.append(p + n, rest);
+    return n + rest;
+}
+
+void QUrlList::push_back(const std::string &url)
+{
+    if (!m_has_prefix) {
+        // scheme and host, up to the first slash after "://"
+        size_t pos = url.find("://");
+        pos = pos == std::string::npos ? 0 : url.find('/', pos + 3);
+        m_prefix.assign(url, 0, pos == std::string::npos ? url.size() : pos);
+        m_has_prefix = true;
+    }
+
+    char header[20];
+    size_t header_size, shared;
+    size_t len = encode(url, header, header_size, shared);
+
+    chunk_t *c = chunks() == 0 ? NULL : back();
+    if (c != NULL && c->capacity - c->end < len && c->capacity < QURLQUEUE_CHUNK_MAX) {
+        size_t capacity = std::min((size_t)c->capacity * 2, (size_t)QURLQUEUE_CHUNK_MAX);
+        c = grow_chunk(c, std::max(capacity, (size_t)c->end + len));
+        m_chunks.back() = c;
+    }
+    if (c == NULL || c->capacity - c->end < len) {
+        c = new_chunk(c == NULL ? len : std::max(len, (size_t)QURLQUEUE_CHUNK_MAX));
+        c->first_seq = m_next_seq;
+        c->begin = 0;
+        c->end = 0;
+        m_chunks.push_back(c);
+    }
+    write(c->data + c->end, url, header, header_size, shared);
+    c->end += len;
+    c->count++;
+    m_next_seq++;
+    m_size++;
+}
+
+void QUrlList::push_front(const std::string &url)
+{
+    if (!m_has_prefix) {
+        push_back(url);
+        return;
+    }
+
+    char header[20];
+    size_t header_size, shared;
+    size_t len = encode(url, header, header_size, shared);
+
+    chunk_t *c = chunks() == 0 ? NULL : front();
+    if (c == NULL || c->begin < len) {
+        uint64_t first_seq = c == NULL ? m_next_seq : c->first_seq;
+        c = new_chunk(c == NULL ? len : std::max(len, (size_t)c->capacity));
+        c->first_seq = first_seq;
+        c->begin = c->capacity;
+        c->end = c->capacity;
+        if (m_head > 0) {
+            m_chunks[--m_head] = c;
+        } else {
+            m_chunks.insert(m_chunks.begin(), c);
+        }
+    }
+    c->begin -= len;
+    write(c->data + c->begin, url, header, header_size, shared);
+    c->first_seq--;
+    c->count++;
+    m_size++;
+}
+
+bool QUrlList::pop_front(std::string &url)
+{
+    if (chunks() == 0) {
+        return false;
+    }
+    chunk_t *c = front();
+    c->begin += decode(c->data + c->begin, url);
+    c->first_seq++;
+    c->count--;
+    m_size--;
+    if (c->count == 0) {
+        free_chunk(c);
+        m_head++;
+        if (m_head == m_chunks.size()) {
+            std::vector<chunk_t *>().swap(m_chunks);
+            m_head = 0;
+        } else if (m_head * 2 >= m_chunks.size()) {
+            m_chunks.erase(m_chunks.begin(), m_chunks.begin() + m_head);
+            m_head = 0;
+        }
+    }
+    return true;
+}
+
+void QUrlList::clear()
+{
+    for (size_t i = m_head; i < m_chunks.size(); i++) {
+        free_chunk(m_chunks[i]);
+    }
+    std::vector<chunk_t *>().swap(m_chunks);
+    m_head = 0;
+    m_size = 0;
+}
+
+void QUrlList::assign(const QUrlList &other)
+{
+    clear();
+    m_prefix = other.m_prefix;
+    m_has_prefix = other.m_has_prefix;
+    m_chunks.reserve(other.chunks());
+    for (size_t i = other.m_head; i < other.m_chunks.size(); i++) {
+        // only the records, a copy is never pushed to
+        const chunk_t *src = other.m_chunks[i];
+        uint32_t used = src->end - src->begin;
+        chunk_t *c = new_chunk(used);
+        c->first_seq = src->first_seq;
+        c->count = src->count;
+        c->begin = 0;
+        c->end = used;
+        memcpy(c->data, src->data + src->begin, used);
+        m_chunks.push_back(c);
+    }
+    m_size = other.m_size;
+    m_next_seq = other.m_next_seq;
+}
+
+uint64_t QUrlList::front_seq() const
+{
+    return chunks() == 0 ? m_next_seq : front()->first_seq;
+}
+
+bool QUrlList::seek(uint64_t &cursor, iterator &it) const
+{
+    if (chunks() == 0 || cursor >= m_next_seq) {
+        return false;
+    }
+    if (cursor < front()->first_seq) {
+        cursor = front()->first_seq;
+    }
+
+    // the last chunk starting at or before cursor
+    size_t lo = m_head;
+    size_t hi = m_chunks.size() - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (m_chunks[mid]->first_seq <= cursor) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    const chunk_t *c = m_chunks[lo];
+    const char *p = c->data + c->begin;
+    for (uint64_t seq = c->first_seq; seq < cursor; seq++) {
+        size_t shared, rest;
+        p += get_varint(p, shared);
+        p += get_varint(p, rest);
+        p += rest;
+    }
+    it.m_list = this;
+    it.m_chunk = lo;
+    it.m_pos = p - c->data;
+    return true;
+}
+
+bool QUrlList::read(uint64_t &cursor, std::string &url) const
+{
+    iterator it;
+    if (!seek(cursor, it)) {
+        return false;
+    }
+    it.next(url);
+    cursor++;
+    return true;
+}
+
+size_t QUrlList::read(uint64_t &cursor, std::vector<std::string> &urls, size_t max) const
+{
+    iterator it;
+    if (max == 0 || !seek(cursor, it)) {
+        return 0;
+    }
+    size_t n = 0;
+    std::string url;
+    while (n < max && it.next(url)) {
+        urls.push_back(url);
+        n++;
+    }
+    cursor += n;
+    return n;
+}
+
+QUrlList::iterator QUrlList::begin() const
+{
+    iterator it;
+    it.m_list = this;
+    it.m_chunk = m_head;
+    it.m_pos = chunks() == 0 ? 0 : front()->begin;
+    return it;
+}
+
+bool QUrlList::iterator::next(std::string &url)
+{
+    while (m_chunk < m_list->m_chunks.size()) {
+        const chunk_t *c = m_list->m_chunks[m_chunk];
+        if (m_pos < c->end) {
+            m_pos += m_list->decode(c->data + m_pos, url);
+            return true;
+        }
+        m_chunk++;
+        if (m_chunk < m_list->m_chunks.size()) {
+            m_pos = m_list->m_chunks[m_chunk]->begin;
+        }
+    }
+    return false;
+}
+
+QUrlLanes::~QUrlLanes()
+{
+    delete[] m_high;
+}
+
+QUrlList &QUrlLanes::at(int lane)
+{
+    if (lane == 0) {
+        return m_low;
+    }
+    if (m_high == NULL) {
+        m_high = new QUrlList[QURLQUEUE_LANES - 1];
+    }
+    return m_high[lane - 1];
+}
+
+const QUrlList *QUrlLanes::list(int lane) const
+{
+    if (lane == 0) {
+        return &m_low;
+    }
+    return m_high == NULL ? NULL : &m_high[lane - 1];
+}
+
+void QUrlLanes::push_back(const std::string &url, int lane)
+{
+    at(lane).push_back(url);
+    m_mask |= 1 << lane;
+}
+
+void QUrlLanes::push_front(const std::string &url, int lane)
+{
+    at(lane).push_front(url);
+    m_mask |= 1 << lane;
+}
+
+bool QUrlLanes::pop_front(std::string &url)
+{
+    if (m_mask == 0) {
+        return false;
+    }
+    int lane = 31 - __builtin_clz(m_mask);
+    QUrlList &l = at(lane);
+    l.pop_front(url);
+    if (l.empty()) {
+        m_mask &= ~(1 << lane);
+    }
+    return true;
+}
+
+void QUrlLanes::clear()
+{
+    // the lists are cleared in place, a new one would restart its
+    // sequence numbers and move the cursors into it
+    m_low.clear();
+    for (int lane = 1; m_high != NULL && lane < QURLQUEUE_LANES; lane++) {
+        m_high[lane - 1].clear();
+    }
+    m_mask = 0;
+}
+
+void QUrlLanes::assign(const QUrlLanes &other)
+{
+    clear();
+    m_low.assign(other.m_low);
+    for (int lane = 1; other.m_high != NULL && lane < QURLQUEUE_LANES; lane++) {
+        at(lane).assign(other.m_high[lane - 1]);
+    }
+    m_mask = other.m_mask;
+}
+
+size_t QUrlLanes::size() const
+{
+    size_t n = m_low.size();
+    for (int lane = 1; m_high != NULL && lane < QURLQUEUE_LANES; lane++) {
+        n += m_high[lane - 1].size();
+    }
+    return n;
+}
+
+size_t QUrlLanes::size(int lane) const
+{
+    const QUrlList *l = list(lane);
+    return l == NULL ? 0 : l->size();
+}
+
+size_t QUrlLanes::bytes() const
+{
+    size_t n = m_low.bytes();
+    for (int lane = 1; m_high != NULL && lane < QURLQUEUE_LANES; lane++) {
+        n += m_high[lane - 1].bytes();
+    }
+    return n;
+}
+
+size_t QUrlLanes::read(int &lane, uint64_t &seq, std::vector<std::string> &urls, size_t max) const
+{
+    size_t n = 0;
+    while (n < max && lane >= 0) {
+        const QUrlList *l = list(lane);
+        size_t want = max - n;
+        size_t got = l == NULL ? 0 : l->read(seq, urls, want);
+        n += got;
+        if (got < want) {
+            lane--;
+            seq = 0;
+        }
+    }
+    return n;
+}
+
+bool QUrlLanes::read(int &lane, uint64_t &seq, std::string &url) const
+{
+    std::vector<std::string> urls;
+    if (read(lane, seq, urls, 1) == 0) {
+        return false;
+    }
+    url.swap(urls[0]);
+    return true;
+}
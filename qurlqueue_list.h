@@ -0,0 +1,160 @@
+#ifndef QURLQUEUE_LIST_H
+#define QURLQUEUE_LIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// smallest chunk a list allocates, and the size up to which the last
+// chunk grows in place; a larger url gets a chunk of its own size
+#define QURLQUEUE_CHUNK_MIN 64
+#define QURLQUEUE_CHUNK_MAX 4096
+
+// priority lanes of a site, the highest is popped first
+#define QURLQUEUE_LANES 8
+
+// Url queue of a site, not thread safe.
+//
+// Urls are packed into chunks. The last chunk is grown with realloc up to
+// QURLQUEUE_CHUNK_MAX before another one is started, so a small site has
+// one tightly sized chunk. A record is the length of the prefix the url
+// shares with the site prefix, the length of the rest and the rest, the
+// lengths as varints. The site prefix is scheme and host of the first url
+// pushed, so a record mostly holds the path. push_front fills a chunk
+// from its end, so both ends grow without moving records.
+//
+// Every record has a sequence number, rising from front to back with no
+// gaps. A cursor is the sequence number of the next record to read, so it
+// stays valid whatever is pushed, popped or cleared in the meantime.
+class QUrlList {
+public:
+    QUrlList();
+    ~QUrlList();
+
+    void push_back(const std::string &url);
+    void push_front(const std::string &url);
+    // false when the list is empty
+    bool pop_front(std::string &url);
+    void clear();
+    // makes this a copy of other, chunk by chunk with no decoding, for a
+    // snapshot taken under a lock and read after it is released
+    void assign(const QUrlList &other);
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    // memory of the chunks
+    size_t bytes() const { return m_bytes; }
+
+    // sequence number of the front record, or of the next push_back when
+    // the list is empty
+    uint64_t front_seq() const;
+    // reads the first record at or after cursor and moves cursor past it,
+    // false when there is none
+    bool read(uint64_t &cursor, std::string &url) const;
+    // appends up to max records from cursor on to urls and moves cursor
+    // past them, returns the count
+    size_t read(uint64_t &cursor, std::vector<std::string> &urls, size_t max) const;
+
+    // walks the records front to back, invalid once the list changes
+    class iterator {
+    public:
+        iterator(): m_list(NULL), m_chunk(0), m_pos(0) {}
+        bool next(std::string &url);
+    private:
+        friend class QUrlList;
+        const QUrlList *m_list;
+        size_t m_chunk;
+        uint32_t m_pos;
+    };
+    iterator begin() const;
+
+private:
+    // the chunk and offset of the first record at or after cursor, which
+    // is moved up to the front; false when there is none
+    bool seek(uint64_t &cursor, iterator &it) const;
+
+    QUrlList(const QUrlList &);
+    QUrlList &operator=(const QUrlList &);
+
+    struct chunk_t {
+        // sequence number of the record at begin
+        uint64_t first_seq;
+        uint32_t count;
+        uint32_t capacity;
+        // the records lie in data[begin, end)
+        uint32_t begin;
+        uint32_t end;
+        char data[1];
+    };
+
+    chunk_t *new_chunk(size_t capacity);
+    chunk_t *grow_chunk(chunk_t *c, size_t capacity);
+    void free_chunk(chunk_t *c);
+    size_t encode(const std::string &url, char *header, size_t &header_size, size_t &shared) const;
+    size_t decode(const char *p, std::string &url) const;
+    void write(char *p, const std::string &url, const char *header, size_t header_size, size_t shared) const;
+
+    chunk_t *front() const { return m_chunks[m_head]; }
+    chunk_t *back() const { return m_chunks.back(); }
+    size_t chunks() const { return m_chunks.size() - m_head; }
+
+    // the chunks from m_head on, the slots before it are reused by
+    // push_front or dropped once they make up half of the vector
+    std::vector<chunk_t *> m_chunks;
+    size_t m_head;
+    std::string m_prefix;
+    bool m_has_prefix;
+    size_t m_size;
+    size_t m_bytes;
+    // sequence number of the next push_back
+    uint64_t m_next_seq;
+};
+
+// Url queues of a site by priority, one QUrlList per lane. Lane 0 takes
+// the urls pushed without a priority and is kept inline; the higher lanes
+// are allocated with the first url pushed to any of them, so a site that
+// never sees a priority pays one pointer. A bitmap of the non-empty lanes
+// finds the lane to pop from in O(1).
+class QUrlLanes {
+public:
+    QUrlLanes(): m_mask(0), m_high(NULL) {}
+    ~QUrlLanes();
+
+    void push_back(const std::string &url, int lane = 0);
+    void push_front(const std::string &url, int lane = 0);
+    // pops from the highest non-empty lane, false when all are empty
+    bool pop_front(std::string &url);
+    void clear();
+    // copies every lane with QUrlList::assign()
+    void assign(const QUrlLanes &other);
+
+    size_t size() const;
+    bool empty() const { return m_mask == 0; }
+    size_t bytes() const;
+    // urls in lane
+    size_t size(int lane) const;
+
+    // A cursor walks the lanes from the highest down, lane being the lane
+    // it is in and seq the sequence number there; start it at lane
+    // QURLQUEUE_LANES - 1 and seq 0. The lane drops below 0 at the end.
+    size_t read(int &lane, uint64_t &seq, std::vector<std::string> &urls, size_t max) const;
+    bool read(int &lane, uint64_t &seq, std::string &url) const;
+
+    // the urls of lane, NULL for an empty higher lane never allocated
+    const QUrlList *list(int lane) const;
+
+private:
+    QUrlLanes(const QUrlLanes &);
+    QUrlLanes &operator=(const QUrlLanes &);
+
+    QUrlList &at(int lane);
+
+    // bit i is set while lane i has urls
+    uint8_t m_mask;
+    // lanes 1 to QURLQUEUE_LANES - 1
+    QUrlList *m_high;
+    QUrlList m_low;
+};
+
+#endif
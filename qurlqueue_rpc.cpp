@@ -1,18 +1,102 @@
 #include "qurlqueue_rpc.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 namespace qurlqueue {
 
-int QUrlQueueServer::m_default_interval = 1000;
+volatile int QUrlQueueServer::m_default_interval = 1000;
 volatile uint64_t QUrlQueueServer::m_current_time = 0;
 
+QUrlQueueServer::QUrlQueueServer(msgpack::rpc::loop lo, int shards) : msgpack::rpc::server::base(lo), m_adapt_min(0), m_adapt_max(0), m_pop_cursor(0), m_stop_all(false), m_has_waiters(false), m_pop_waits(0), m_pop_wait_timeouts(0), m_start_time(0), m_snapshot_secs(0), m_store_gen(0), m_snapshot_at(0), m_load_next(0), m_load_shards(0), m_load_failed(false), m_dedup_rotate_secs(0), m_dedup_rotated_at(0), m_dump_all_dumping(false), m_dump_file_running(false)
+{
+    if (shards < 1) {
+        shards = 1;
+    }
+    for (int i = 0; i < shards; i++) {
+        m_shards.push_back(new UrlShard());
+    }
+    pthread_mutex_init(&m_dump_lock, NULL);
+    pthread_mutex_init(&m_wait_lock, NULL);
+    pthread_rwlock_init(&m_group_lock, NULL);
+}
+
+QUrlQueueServer::~QUrlQueueServer()
+{
+    for (size_t i = 0; i < m_shards.size(); i++) {
+        UrlShard *shard = m_shards[i];
+        for (site_map_it_t it = shard->site_map.begin(); it != shard->site_map.end(); it++) {
+            delete it->second;
+        }
+        delete shard;
+    }
+    for (group_map_it_t it = m_groups.begin(); it != m_groups.end(); it++) {
+        delete it->second;
+    }
+    pthread_mutex_destroy(&m_dump_lock);
+    pthread_mutex_destroy(&m_wait_lock);
+    pthread_rwlock_destroy(&m_group_lock);
+}
+
 bool QUrlQueueServer::set_current_time()
 {
     m_current_time = get_current_time();
     return true;
 }
 
+bool QUrlQueueServer::tick()
+{
+    set_current_time();
+    if (!m_has_waiters) {
+        return true;
+    }
+
+    // a push or the clock making a site due lowers a shard's next_ready,
+    // so the shards are polled rather than the pushes waking anybody
+    uint64_t now = m_current_time;
+    uint64_t next = (uint64_t)-1;
+    for (size_t i = 0; i < m_shards.size(); i++) {
+        next = std::min(next, (uint64_t)m_shards[i]->next_ready);
+    }
+
+    url_waiter_list_t done;
+    pthread_mutex_lock(&m_wait_lock);
+    while (next <= now && !m_waiters.empty()) {
+        url_waiter_t &w = m_waiters.front();
+        pop_url(w.url);
+        if (w.url == QCONTENTHUB_STRAGAIN) {
+            break;
+        }
+        done.splice(done.end(), m_waiters, m_waiters.begin());
+    }
+    // a stopped queue answers pops with again, so do parked ones
+    url_waiter_list_t::iterator it = m_waiters.begin();
+    while (it != m_waiters.end()) {
+        url_waiter_list_t::iterator cur = it++;
+        if (m_stop_all || cur->deadline <= now) {
+            cur->url = QCONTENTHUB_STRAGAIN;
+            if (cur->deadline <= now) {
+                m_pop_wait_timeouts++;
+            }
+            done.splice(done.end(), m_waiters, cur);
+        }
+    }
+    m_has_waiters = !m_waiters.empty();
+    pthread_mutex_unlock(&m_wait_lock);
+
+    uint64_t usec = qcontenthub_usec();
+    for (it = done.begin(); it != done.end(); it++) {
+        m_pop_wait.add(usec - it->parked);
+        it->req.result(it->url);
+    }
+    return true;
+}
+
 uint64_t QUrlQueueServer::get_current_time()
 {
     struct timeval tv;
@@ -20,87 +104,310 @@ uint64_t QUrlQueueServer::get_current_time()
     return tv.tv_sec * 1000 + (int)tv.tv_usec / 1000;
 }
 
+size_t QUrlQueueServer::shard_index(const std::string &site)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < site.size(); i++) {
+        h ^= (unsigned char)site[i];
+        h *= 16777619u;
+    }
+    return h % m_shards.size();
+}
 
-int QUrlQueueServer::push_url(const std::string &site, const std::string &record, bool push_front)
+UrlShard *QUrlQueueServer::shard_of(const std::string &site)
 {
-    if (m_stop_all) {
-        return QCONTENTHUB_AGAIN;
+    return m_shards[shard_index(site)];
+}
+
+// called with shard->lock held
+int QUrlQueueServer::site_interval(UrlShard *shard, const std::string &site)
+{
+    interval_map_it_t it = shard->interval_map.find(site);
+    if (it == shard->interval_map.end()) {
+        return m_default_interval;
+    }
+    return it->second;
+}
+
+// called with shard->lock held
+int QUrlQueueServer::effective_interval(UrlShard *shard, Site *s)
+{
+    if (m_adapt_max > 0 && s->interval > 0) {
+        return s->interval;
     }
+    return site_interval(shard, s->name);
+}
+
+// The site state changes shared by the RPCs and the store replay, called
+// with shard->lock held.
 
-    mp::sync<site_map_t>::ref ref(m_site_map);
-    site_map_it_t it = ref->find(site);
-    if (it == ref->end()) {
-        Site * s = new Site();
-        s->url_queue.push_back(record);
-        s->name = site;
-        s->enqueue_items = 1;
-        ref->insert(std::pair<std::string, Site *>(site, s));
-        s->ref_cnt++;
-        ordered_sites.push(s);
+Site *QUrlQueueServer::get_site(UrlShard *shard, const std::string &site)
+{
+    site_map_it_t it = shard->site_map.find(site);
+    if (it != shard->site_map.end()) {
+        return it->second;
+    }
+    Site *s = new Site();
+    s->name = site;
+    s->group = group_of(site);
+    shard->site_map.insert(std::pair<std::string, Site *>(site, s));
+    return s;
+}
+
+static void add_url(UrlShard *shard, Site *s, const std::string &record, bool push_front, int lane)
+{
+    if (push_front) {
+        s->url_queue.push_front(record, lane);
     } else {
-        Site * s = it->second;
-        if (s->url_queue.size() == 0) {
-            s->ref_cnt++;
-            ordered_sites.push(s);
-        }
-        if (push_front) {
-            s->url_queue.push_front(record);
-        } else {
-            s->url_queue.push_back(record);
-        }
+        s->url_queue.push_back(record, lane);
+    }
+    if (!s->stop && !site_heap_t::contains(s)) {
+        shard->ordered_sites.push(s);
+    }
+    s->enqueue_items++;
+    shard->enqueue_items++;
+}
+
+static void clear_urls(UrlShard *shard, Site *s)
+{
+    s->url_queue.clear();
+    if (site_heap_t::contains(s)) {
+        shard->ordered_sites.erase(s);
+    }
+}
 
-        s->enqueue_items++;
+static void set_site_stop(UrlShard *shard, Site *s, bool stop)
+{
+    s->stop = stop;
+    if (stop && site_heap_t::contains(s)) {
+        shard->ordered_sites.erase(s);
+    } else if (!stop && !s->url_queue.empty() && !site_heap_t::contains(s)) {
+        shard->ordered_sites.push(s);
     }
-    m_enqueue_items++;
+}
 
+// filters, queues and logs a url of site, called with shard->lock held;
+// s caches the site over a run of its urls and starts out NULL
+int QUrlQueueServer::enqueue_url(UrlShard *shard, Site *&s, const std::string &site, const std::string &record, bool push_front, int priority)
+{
+    if (priority < 0 || priority >= QURLQUEUE_LANES) {
+        return QCONTENTHUB_ERROR;
+    }
+    // push_list puts a url back on purpose, so only push is filtered
+    if (shard->filter != NULL && !push_front) {
+        shard->dedup_checks++;
+        if (shard->filter->check_and_add(site, record)) {
+            shard->dedup_rejects++;
+            if (s == NULL) {
+                site_map_it_t it = shard->site_map.find(site);
+                s = it == shard->site_map.end() ? NULL : it->second;
+            }
+            if (s != NULL) {
+                s->dedup_rejects++;
+            }
+            return QCONTENTHUB_WARN;
+        }
+    }
+    if (s == NULL) {
+        s = get_site(shard, site);
+    }
+    add_url(shard, s, record, push_front, priority);
+    if (shard->store != NULL && priority == 0) {
+        shard->store->append(push_front ? QUrlStore::OP_PUSH_FRONT : QUrlStore::OP_PUSH, site, record.data(), record.size());
+    } else if (shard->store != NULL) {
+        std::string arg(1, (char)priority);
+        arg.append(record);
+        shard->store->append(push_front ? QUrlStore::OP_PUSH_FRONT_LANE : QUrlStore::OP_PUSH_LANE, site, arg.data(), arg.size());
+    }
     return QCONTENTHUB_OK;
 }
 
-void QUrlQueueServer::push_url(msgpack::rpc::request &req, const std::string &site, const std::string &record)
+int QUrlQueueServer::push_url(const std::string &site, const std::string &record, bool push_front, int priority)
+{
+    if (m_stop_all) {
+        return QCONTENTHUB_AGAIN;
+    }
+
+    UrlShard *shard = shard_of(site);
+    Site *s = NULL;
+    pthread_mutex_lock(&shard->lock);
+    int ret = enqueue_url(shard, s, site, record, push_front, priority);
+    shard->update_next_ready();
+    pthread_mutex_unlock(&shard->lock);
+
+    return ret;
+}
+
+void QUrlQueueServer::push_url(msgpack::rpc::request &req, const std::string &site, const std::string &record, int priority)
 {	
-    int ret = push_url(site, record);
+    int ret = push_url(site, record, false, priority);
     req.result(ret);
 }
 
-void QUrlQueueServer::push_list(msgpack::rpc::request &req, const std::string &site, const std::string &record)
+void QUrlQueueServer::push_list(msgpack::rpc::request &req, const std::string &site, const std::string &record, int priority)
 {	
-    int ret = push_url(site, record, true);
+    int ret = push_url(site, record, true, priority);
     req.result(ret);
 }
 
-void QUrlQueueServer::pop_url(std::string &content)
+// a pair of push_urls, ordered by shard, site and position
+struct push_order_t {
+    size_t shard;
+    size_t index;
+    const std::string *site;
+
+    bool operator<(const push_order_t &other) const {
+        if (shard != other.shard) {
+            return shard < other.shard;
+        }
+        int cmp = site->compare(*other.site);
+        if (cmp != 0) {
+            return cmp < 0;
+        }
+        return index < other.index;
+    }
+};
+
+void QUrlQueueServer::push_urls(const site_url_list_t &urls, std::vector<int> &status, bool push_front, const std::vector<int> *priorities)
 {
-    mp::sync<site_map_t>::ref ref(m_site_map);
+    status.assign(urls.size(), QCONTENTHUB_AGAIN);
+    if (m_stop_all) {
+        return;
+    }
+
+    std::vector<push_order_t> order(urls.size());
+    for (size_t i = 0; i < urls.size(); i++) {
+        order[i].shard = shard_index(urls[i].first);
+        order[i].index = i;
+        order[i].site = &urls[i].first;
+    }
+    std::sort(order.begin(), order.end());
+
+    size_t begin = 0;
+    while (begin < order.size()) {
+        size_t end = begin;
+        while (end < order.size() && order[end].shard == order[begin].shard) {
+            end++;
+        }
+        UrlShard *shard = m_shards[order[begin].shard];
+        Site *s = NULL;
+        const std::string *site = NULL;
+        pthread_mutex_lock(&shard->lock);
+        for (size_t i = begin; i < end; i++) {
+            // push_front takes the urls of a site last to first, which
+            // leaves them at the front in the order given
+            const push_order_t &o = order[push_front ? begin + end - 1 - i : i];
+            if (site == NULL || *site != *o.site) {
+                site = o.site;
+                s = NULL;
+            }
+            int priority = priorities == NULL ? 0 : (*priorities)[o.index];
+            status[o.index] = enqueue_url(shard, s, *o.site, urls[o.index].second, push_front, priority);
+        }
+        shard->update_next_ready();
+        pthread_mutex_unlock(&shard->lock);
+        begin = end;
+    }
+}
+
+void QUrlQueueServer::push_urls(msgpack::rpc::request &req, const site_url_list_t &urls, const std::vector<int> *priorities)
+{
+    std::vector<int> status;
+    push_urls(urls, status, false, priorities);
+    req.result(status);
+}
+
+void QUrlQueueServer::push_list_bulk(msgpack::rpc::request &req, const site_url_list_t &urls, const std::vector<int> *priorities)
+{
+    std::vector<int> status;
+    push_urls(urls, status, true, priorities);
+    req.result(status);
+}
+
+// pops the front url of s, which is due, and schedules its next crawl;
+// the caller moves s in the heap, called with shard->lock held
+void QUrlQueueServer::pop_site(UrlShard *shard, Site *s, uint64_t now, std::string &content)
+{
+    s->url_queue.pop_front(content);
+    s->dequeue_items++;
+    shard->dequeue_items++;
+    s->next_crawl_time = now + effective_interval(shard, s);
+    if (shard->store != NULL) {
+        shard->store->append(QUrlStore::OP_POP, s->name);
+    }
+}
 
+// true when the due site s has to wait for a slot of its group, which
+// becomes its next_crawl_time; called with the shard lock of s held
+bool QUrlQueueServer::wait_for_group(Site *s, uint64_t now)
+{
+    SiteGroup *group = s->group;
+    if (group == NULL) {
+        return false;
+    }
+    if (s->has_slot) {
+        s->has_slot = false;
+        return false;
+    }
+    int interval = group->interval;
+    uint64_t slot = group->reserve(now, interval >= 0 ? interval : m_default_interval);
+    if (slot <= now) {
+        return false;
+    }
+    s->next_crawl_time = slot;
+    s->has_slot = true;
+    return true;
+}
+
+// pops the url of the earliest site of shard if it is due, called with
+// shard->lock held
+bool QUrlQueueServer::pop_shard(UrlShard *shard, uint64_t now, std::string &content)
+{
+    site_heap_t &ordered_sites = shard->ordered_sites;
+    Site *s;
+    for (;;) {
+        if (ordered_sites.empty() || ordered_sites.top()->next_crawl_time > now) {
+            return false;
+        }
+        s = ordered_sites.top();
+        if (!wait_for_group(s, now)) {
+            break;
+        }
+        ordered_sites.update(s);
+    }
+
+    pop_site(shard, s, now, content);
+    if (s->url_queue.empty()) {
+        ordered_sites.erase(s);
+    } else {
+        ordered_sites.update(s);
+    }
+    return true;
+}
+
+void QUrlQueueServer::pop_url(std::string &content)
+{
     if (m_stop_all) {
         content = QCONTENTHUB_STRAGAIN;
         return;
     }
 
-    while (!ordered_sites.empty()) {
-        Site * s = ordered_sites.top();
-        if (s->stop || s->url_queue.size() == 0) {
-            s->ref_cnt--;
-            ordered_sites.pop();
-           // do nothing
-        } else if (s->next_crawl_time > m_current_time) {
-            content = QCONTENTHUB_STRAGAIN;
-            return;
-        } else {
-            ordered_sites.pop();
-            int interval;
-            interval_map_it_t it = m_interval_map.find(s->name);
-            if (it == m_interval_map.end()) {
-                interval = m_default_interval;
-            } else {
-                interval = it->second;
-            }
-            s->next_crawl_time = m_current_time + interval;
-            ordered_sites.push(s);
-            content = s->url_queue.front();
-            s->dequeue_items++;
-            m_dequeue_items++;
-            s->url_queue.pop_front();
+    // every pop starts from another shard, so concurrent pops mostly take
+    // different locks, and shards with nothing due are skipped unlocked
+    size_t n = m_shards.size();
+    size_t start = __sync_fetch_and_add(&m_pop_cursor, 1);
+    uint64_t now = m_current_time;
+    for (size_t i = 0; i < n; i++) {
+        UrlShard *shard = m_shards[(start + i) % n];
+        if (shard->next_ready > now) {
+            continue;
+        }
+        pthread_mutex_lock(&shard->lock);
+        bool found = pop_shard(shard, now, content);
+        shard->update_next_ready();
+        pthread_mutex_unlock(&shard->lock);
+        if (found) {
             return;
         }
     }
@@ -115,6 +422,113 @@ void QUrlQueueServer::pop_url(msgpack::rpc::request &req)
     req.result(ret);
 }
 
+void QUrlQueueServer::pop_wait(msgpack::rpc::request &req, int timeout_ms)
+{
+    std::string ret;
+    pop_url(ret);
+    if (ret != QCONTENTHUB_STRAGAIN || m_stop_all || timeout_ms <= 0) {
+        req.result(ret);
+        return;
+    }
+
+    timeout_ms = std::min(timeout_ms, QCONTENTHUB_WAIT_TIMEOUT);
+    pthread_mutex_lock(&m_wait_lock);
+    m_waiters.push_back(url_waiter_t(req, m_current_time + timeout_ms));
+    m_pop_waits++;
+    m_has_waiters = true;
+    pthread_mutex_unlock(&m_wait_lock);
+}
+
+int64_t QUrlQueueServer::pop_urls(int max_urls, std::vector<std::string> &urls)
+{
+    if (m_stop_all || max_urls <= 0) {
+        return -1;
+    }
+
+    size_t n = m_shards.size();
+    size_t start = __sync_fetch_and_add(&m_pop_cursor, 1);
+    uint64_t now = m_current_time;
+    std::vector<Site *> popped;
+    for (size_t i = 0; i < n && (int)urls.size() < max_urls; i++) {
+        UrlShard *shard = m_shards[(start + i) % n];
+        if (shard->next_ready > now) {
+            continue;
+        }
+        pthread_mutex_lock(&shard->lock);
+        // the due sites leave the heap until the shard is walked, so a
+        // site due again at once still gives one url per call
+        site_heap_t &ordered_sites = shard->ordered_sites;
+        while ((int)urls.size() < max_urls && !ordered_sites.empty() && ordered_sites.top()->next_crawl_time <= now) {
+            Site *s = ordered_sites.top();
+            if (wait_for_group(s, now)) {
+                ordered_sites.update(s);
+                continue;
+            }
+            ordered_sites.erase(s);
+            urls.push_back(std::string());
+            pop_site(shard, s, now, urls.back());
+            if (!s->url_queue.empty()) {
+                popped.push_back(s);
+            }
+        }
+        for (size_t j = 0; j < popped.size(); j++) {
+            ordered_sites.push(popped[j]);
+        }
+        popped.clear();
+        shard->update_next_ready();
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    if ((int)urls.size() == max_urls) {
+        return 0;
+    }
+    uint64_t next = (uint64_t)-1;
+    for (size_t i = 0; i < n; i++) {
+        next = std::min(next, (uint64_t)m_shards[i]->next_ready);
+    }
+    if (next == (uint64_t)-1) {
+        return -1;
+    }
+    return next > now ? next - now : 0;
+}
+
+void QUrlQueueServer::pop_urls(msgpack::rpc::request &req, int max_urls)
+{
+    msgpack::type::tuple<std::vector<std::string>, int64_t> ret;
+    ret.get<1>() = pop_urls(max_urls, ret.get<0>());
+    req.result(ret);
+}
+
+void QUrlQueueServer::set_dedup(size_t bytes, double fp_rate, int rotate_secs)
+{
+    for (size_t i = 0; i < m_shards.size(); i++) {
+        UrlShard *shard = m_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        delete shard->filter;
+        shard->filter = bytes > 0 ? new QUrlFilter(bytes / m_shards.size(), fp_rate) : NULL;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    m_dedup_rotate_secs = rotate_secs;
+    m_dedup_rotated_at = m_current_time;
+}
+
+bool QUrlQueueServer::rotate_filters()
+{
+    if (m_dedup_rotate_secs <= 0 || m_current_time < m_dedup_rotated_at + m_dedup_rotate_secs * 1000ULL) {
+        return true;
+    }
+    m_dedup_rotated_at = m_current_time;
+    for (size_t i = 0; i < m_shards.size(); i++) {
+        UrlShard *shard = m_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        if (shard->filter != NULL) {
+            shard->filter->rotate();
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return true;
+}
+
 void QUrlQueueServer::start_all(msgpack::rpc::request &req)
 {
     m_stop_all = false;
@@ -129,134 +543,563 @@ void QUrlQueueServer::stop_all(msgpack::rpc::request &req)
 
 void QUrlQueueServer::clear_all(msgpack::rpc::request &req)
 {
-    {
-        mp::sync<site_map_t>::ref ref(m_site_map);
-        for (site_map_it_t it = ref->begin(); it != ref->end(); it++) {
-            it->second->url_queue.clear();
+    for (size_t i = 0; i < m_shards.size(); i++) {
+        UrlShard *shard = m_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (site_map_it_t it = shard->site_map.begin(); it != shard->site_map.end(); it++) {
+            Site *s = it->second;
+            // logged per site, the files may be replayed into other shards
+            if (shard->store != NULL && !s->url_queue.empty()) {
+                shard->store->append(QUrlStore::OP_CLEAR_SITE, s->name);
+            }
+            s->url_queue.clear();
         }
+        shard->ordered_sites.clear();
+        shard->update_next_ready();
+        pthread_mutex_unlock(&shard->lock);
     }
 
     req.result(QCONTENTHUB_OK);
 }
 
-void QUrlQueueServer::start_dump_all(msgpack::rpc::request &req)
+size_t QUrlQueueServer::dump_urls(dump_cursor_t &cursor, size_t max, dump_chunk_t &chunk)
+{
+    size_t n = 0;
+    while (n < max && cursor.shard < m_shards.size()) {
+        UrlShard *shard = m_shards[cursor.shard];
+        size_t held = 0;
+        pthread_mutex_lock(&shard->lock);
+        site_map_it_t it = shard->site_map.lower_bound(cursor.site);
+        while (n < max && held < QURLQUEUE_DUMP_CHUNK && it != shard->site_map.end()) {
+            Site *s = it->second;
+            if (!cursor.in_site || it->first != cursor.site) {
+                cursor.site = it->first;
+                cursor.in_site = true;
+                cursor.lane = QURLQUEUE_LANES - 1;
+                cursor.seq = 0;
+            }
+            size_t want = std::min(max - n, QURLQUEUE_DUMP_CHUNK - held);
+            if (chunk.empty() || chunk.back().first != it->first) {
+                chunk.push_back(std::pair<std::string, std::vector<std::string> >(it->first, std::vector<std::string>()));
+            }
+            size_t got = s->url_queue.read(cursor.lane, cursor.seq, chunk.back().second, want);
+            if (chunk.back().second.empty()) {
+                chunk.pop_back();
+            }
+            n += got;
+            held += got;
+            if (got < want) {
+                // the site is done, start at the next one
+                it++;
+                cursor.in_site = false;
+                if (it != shard->site_map.end()) {
+                    cursor.site = it->first;
+                }
+            }
+        }
+        bool shard_done = it == shard->site_map.end();
+        pthread_mutex_unlock(&shard->lock);
+        if (shard_done) {
+            cursor.shard++;
+            cursor.site.clear();
+            cursor.in_site = false;
+        }
+    }
+    return n;
+}
+
+void QUrlQueueServer::start_dump_all(msgpack::rpc::request &req)
+{
+    pthread_mutex_lock(&m_dump_lock);
+    int ret;
+    if (m_dump_all_dumping) {
+        ret = QCONTENTHUB_ERROR;
+    } else {
+        m_dump_all_dumping = true;
+        m_dump_all_cursor = dump_cursor_t();
+        ret = QCONTENTHUB_OK;
+    }
+    pthread_mutex_unlock(&m_dump_lock);
+    req.result(ret);
+}
+
+void QUrlQueueServer::dump_all(msgpack::rpc::request &req)
+{
+    std::string content;
+    dump_chunk_t chunk;
+    pthread_mutex_lock(&m_dump_lock);
+    if (!m_dump_all_dumping) {
+        content = QCONTENTHUB_STRERROR;
+    } else if (dump_urls(m_dump_all_cursor, 1, chunk) > 0) {
+        content.swap(chunk[0].second[0]);
+    } else {
+        content = QCONTENTHUB_STREND;
+        m_dump_all_dumping = false;
+    }
+    pthread_mutex_unlock(&m_dump_lock);
+    req.result(content);
+}
+
+void QUrlQueueServer::dump_all_chunk(msgpack::rpc::request &req, int max_urls)
+{
+    dump_chunk_t chunk;
+    pthread_mutex_lock(&m_dump_lock);
+    if (m_dump_all_dumping && max_urls > 0 && dump_urls(m_dump_all_cursor, max_urls, chunk) == 0) {
+        m_dump_all_dumping = false;
+    }
+    pthread_mutex_unlock(&m_dump_lock);
+    req.result(chunk);
+}
+
+static void append_u32(std::string &buf, uint32_t v)
+{
+    buf.append((const char *)&v, sizeof(v));
+}
+
+int64_t QUrlQueueServer::dump_file(const std::string &path)
+{
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (fp == NULL) {
+        perror(tmp.c_str());
+        return QCONTENTHUB_ERROR;
+    }
+
+    // copied a chunk at a time under the shard locks, written outside
+    dump_cursor_t cursor;
+    dump_chunk_t chunk;
+    std::string buf;
+    int64_t count = 0;
+    bool ok = true;
+    while (ok && cursor.shard < m_shards.size()) {
+        chunk.clear();
+        buf.clear();
+        count += dump_urls(cursor, QURLQUEUE_DUMP_CHUNK, chunk);
+        for (size_t i = 0; i < chunk.size(); i++) {
+            const std::vector<std::string> &urls = chunk[i].second;
+            append_u32(buf, chunk[i].first.size());
+            buf.append(chunk[i].first);
+            append_u32(buf, urls.size());
+            for (size_t j = 0; j < urls.size(); j++) {
+                append_u32(buf, urls[j].size());
+                buf.append(urls[j]);
+            }
+        }
+        ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+    }
+    if (!ok || fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        perror(tmp.c_str());
+        fclose(fp);
+        unlink(tmp.c_str());
+        return QCONTENTHUB_ERROR;
+    }
+    fclose(fp);
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        perror(path.c_str());
+        return QCONTENTHUB_ERROR;
+    }
+    return count;
+}
+
+struct dump_file_t {
+    dump_file_t(QUrlQueueServer *s, const msgpack::rpc::request &r, const std::string &p): svr(s), req(r), path(p) {}
+
+    QUrlQueueServer *svr;
+    msgpack::rpc::request req;
+    std::string path;
+};
+
+void *QUrlQueueServer::dump_file_main(void *arg)
+{
+    dump_file_t *d = (dump_file_t *)arg;
+    int64_t ret = d->svr->dump_file(d->path);
+    d->req.result(ret);
+    d->svr->m_dump_file_running = false;
+    delete d;
+    return NULL;
+}
+
+void QUrlQueueServer::dump_file(msgpack::rpc::request &req, const std::string &name)
+{
+    // a client names a file, it never picks where the daemon writes
+    if (m_dump_dir.empty() || name.empty() || name == "." || name.find('/') != std::string::npos || name.find("..") != std::string::npos || name.find('\0') != std::string::npos) {
+        req.result((int64_t)QCONTENTHUB_ERROR);
+        return;
+    }
+    if (!__sync_bool_compare_and_swap(&m_dump_file_running, false, true)) {
+        req.result((int64_t)QCONTENTHUB_ERROR);
+        return;
+    }
+    // a dump of a large frontier takes a while, so it does not hold up a
+    // worker of the loop
+    pthread_t tid;
+    dump_file_t *d = new dump_file_t(this, req, m_dump_dir + "/" + name);
+    if (pthread_create(&tid, NULL, &QUrlQueueServer::dump_file_main, d) != 0) {
+        delete d;
+        m_dump_file_running = false;
+        req.result((int64_t)QCONTENTHUB_ERROR);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+void QUrlQueueServer::start_dump_site(msgpack::rpc::request &req, const std::string &site)
+{
+    UrlShard *shard = shard_of(site);
+    pthread_mutex_lock(&shard->lock);
+    site_map_it_t it = shard->site_map.find(site);
+    if (it != shard->site_map.end()) {
+        Site *s = it->second;
+        s->site_dumping = true;
+        s->site_dump_lane = QURLQUEUE_LANES - 1;
+        s->site_dump_seq = 0;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    req.result(QCONTENTHUB_OK);
+}
+
+void QUrlQueueServer::dump_site(msgpack::rpc::request &req, const std::string &site)
+{
+    std::string content;
+    UrlShard *shard = shard_of(site);
+    pthread_mutex_lock(&shard->lock);
+    site_map_it_t it = shard->site_map.find(site);
+    if (it == shard->site_map.end()) {
+        content = QCONTENTHUB_STREND;
+    } else {
+        Site *s = it->second;
+        if (!s->url_queue.read(s->site_dump_lane, s->site_dump_seq, content)) {
+            s->site_dumping = false;
+            content = QCONTENTHUB_STREND;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    req.result(content);
+}
+
+void QUrlQueueServer::dump_site_chunk(msgpack::rpc::request &req, const std::string &site, int max_urls)
+{
+    std::vector<std::string> urls;
+    UrlShard *shard = shard_of(site);
+    pthread_mutex_lock(&shard->lock);
+    site_map_it_t it = shard->site_map.find(site);
+    if (it != shard->site_map.end() && max_urls > 0) {
+        Site *s = it->second;
+        size_t max = std::min((size_t)max_urls, (size_t)QURLQUEUE_DUMP_CHUNK);
+        if (s->url_queue.read(s->site_dump_lane, s->site_dump_seq, urls, max) == 0) {
+            s->site_dumping = false;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    req.result(urls);
+}
+
+void QUrlQueueServer::clear_site(msgpack::rpc::request &req, const std::string &site)
+{
+    UrlShard *shard = shard_of(site);
+    pthread_mutex_lock(&shard->lock);
+    site_map_it_t it = shard->site_map.find(site);
+    if (it != shard->site_map.end()) {
+        clear_urls(shard, it->second);
+        if (shard->store != NULL) {
+            shard->store->append(QUrlStore::OP_CLEAR_SITE, site);
+        }
+        shard->update_next_ready();
+    }
+    pthread_mutex_unlock(&shard->lock);
+    req.result(QCONTENTHUB_OK);
+}
+
+void QUrlQueueServer::set_default_interval(msgpack::rpc::request &req, int interval)
+{
+    set_default_interval(interval);
+    if (!m_store_dir.empty()) {
+        QUrlStore::write_meta(m_store_dir, m_shards.size(), interval);
+    }
+    req.result(QCONTENTHUB_OK);
+}
+
+void QUrlQueueServer::set_default_interval(int interval)
+{
+    m_default_interval = interval;
+}
+
+void QUrlQueueServer::set_site_interval(msgpack::rpc::request &req, const std::string &site, int interval)
+{
+    UrlShard *shard = shard_of(site);
+    pthread_mutex_lock(&shard->lock);
+    shard->interval_map[site] = interval;
+    // adapting starts over from the new interval
+    site_map_it_t it = shard->site_map.find(site);
+    if (it != shard->site_map.end()) {
+        it->second->interval = 0;
+    }
+    if (shard->store != NULL) {
+        int32_t arg = interval;
+        shard->store->append(QUrlStore::OP_SITE_INTERVAL, site, (const char *)&arg, sizeof(arg));
+    }
+    pthread_mutex_unlock(&shard->lock);
+    req.result(QCONTENTHUB_OK);
+}
+
+void QUrlQueueServer::set_adaptive_interval(msgpack::rpc::request &req, int min_ms, int max_ms)
+{
+    set_adaptive_interval(min_ms, max_ms);
+    req.result(QCONTENTHUB_OK);
+}
+
+void QUrlQueueServer::set_adaptive_interval(int min_ms, int max_ms)
+{
+    m_adapt_min = std::max(min_ms, 0);
+    m_adapt_max = std::max(max_ms, 0);
+}
+
+int QUrlQueueServer::report_fetch(const std::string &site, int latency_ms, int status)
+{
+    UrlShard *shard = shard_of(site);
+    pthread_mutex_lock(&shard->lock);
+    site_map_it_t it = shard->site_map.find(site);
+    if (it == shard->site_map.end()) {
+        pthread_mutex_unlock(&shard->lock);
+        return QCONTENTHUB_ERROR;
+    }
+
+    Site *s = it->second;
+    bool failed = status < 0 || status == 429 || status >= 500;
+    bool slow = s->latency_ms > 0 && latency_ms > 2 * s->latency_ms;
+    s->fetch_reports++;
+    if (failed) {
+        s->fetch_errors++;
+    }
+    latency_ms = std::max(latency_ms, 0);
+    s->latency_ms = s->fetch_reports == 1 ? latency_ms : s->latency_ms + (latency_ms - s->latency_ms) / 8;
+
+    int max = m_adapt_max;
+    if (max > 0) {
+        // an interval set for the site is a floor the controller keeps to
+        interval_map_it_t interval_it = shard->interval_map.find(site);
+        int min = interval_it == shard->interval_map.end() ? (int)m_adapt_min : interval_it->second;
+        max = std::max(max, min);
+        int interval = s->interval > 0 ? s->interval : site_interval(shard, site);
+        if (failed || slow) {
+            interval = std::min(interval, max / 2) * 2;
+        } else {
+            interval -= std::max(interval / QURLQUEUE_ADAPT_SHRINK, 1);
+        }
+        s->interval = std::max(std::min(interval, max), std::max(min, 1));
+
+        // a struggling site waits the new interval from now on
+        uint64_t next = m_current_time + s->interval;
+        if (failed && site_heap_t::contains(s) && s->next_crawl_time < next) {
+            s->next_crawl_time = next;
+            s->has_slot = false;
+            shard->ordered_sites.update(s);
+            shard->update_next_ready();
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return QCONTENTHUB_OK;
+}
+
+void QUrlQueueServer::report_fetch(msgpack::rpc::request &req, const std::string &site, int latency_ms, int status)
+{
+    int ret = report_fetch(site, latency_ms, status);
+    req.result(ret);
+}
+
+// called with m_group_lock held for writing
+SiteGroup *QUrlQueueServer::find_group(const std::string &name)
+{
+    group_map_it_t it = m_groups.find(name);
+    if (it != m_groups.end()) {
+        return it->second;
+    }
+    SiteGroup *group = new SiteGroup();
+    group->name = name;
+    m_groups.insert(std::pair<std::string, SiteGroup *>(name, group));
+    return group;
+}
+
+SiteGroup *QUrlQueueServer::group_of(const std::string &site)
+{
+    // every rule and site entry has its group in m_groups
+    std::string name;
+    pthread_rwlock_rdlock(&m_group_lock);
+    std::map<std::string, std::string>::iterator it = m_site_groups.find(site);
+    if (it != m_site_groups.end()) {
+        name = it->second;
+    } else if (!m_group_rules.empty()) {
+        // the longest matching suffix, the site name itself first
+        size_t pos = 0;
+        while (name.empty() && pos != std::string::npos) {
+            std::set<std::string>::iterator rule = m_group_rules.find(site.substr(pos));
+            if (rule != m_group_rules.end()) {
+                name = *rule;
+            }
+            pos = site.find('.', pos);
+            if (pos != std::string::npos) {
+                pos++;
+            }
+        }
+    }
+    SiteGroup *group = NULL;
+    if (!name.empty()) {
+        group_map_it_t group_it = m_groups.find(name);
+        group = group_it == m_groups.end() ? NULL : group_it->second;
+    }
+    pthread_rwlock_unlock(&m_group_lock);
+    return group;
+}
+
+// places every site in its group again after a change of the rules
+void QUrlQueueServer::regroup_sites()
+{
+    for (size_t i = 0; i < m_shards.size(); i++) {
+        UrlShard *shard = m_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (site_map_it_t it = shard->site_map.begin(); it != shard->site_map.end(); it++) {
+            Site *s = it->second;
+            SiteGroup *group = group_of(it->first);
+            if (group != s->group) {
+                s->group = group;
+                s->has_slot = false;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+bool QUrlQueueServer::save_groups()
 {
-    if (m_dump_all_dumping) {
-        req.result(QCONTENTHUB_ERROR);
-    } else {
-        m_dump_all_dumping = true;
-        m_dump_all_it = m_site_map.unsafe_ref().begin();
-        req.result(QCONTENTHUB_OK);
+    if (m_store_dir.empty()) {
+        return true;
+    }
+    std::string path = m_store_dir + "/groups";
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (fp == NULL) {
+        perror(tmp.c_str());
+        return false;
+    }
+    pthread_rwlock_rdlock(&m_group_lock);
+    for (std::set<std::string>::iterator it = m_group_rules.begin(); it != m_group_rules.end(); it++) {
+        fprintf(fp, "rule %s\n", it->c_str());
+    }
+    for (std::map<std::string, std::string>::iterator it = m_site_groups.begin(); it != m_site_groups.end(); it++) {
+        fprintf(fp, "site %s %s\n", it->first.c_str(), it->second.c_str());
+    }
+    for (group_map_it_t it = m_groups.begin(); it != m_groups.end(); it++) {
+        if (it->second->interval >= 0) {
+            fprintf(fp, "interval %s %d\n", it->first.c_str(), it->second->interval);
+        }
     }
+    pthread_rwlock_unlock(&m_group_lock);
+    fflush(fp);
+    fsync(fileno(fp));
+    fclose(fp);
+    return rename(tmp.c_str(), path.c_str()) == 0;
 }
 
-void QUrlQueueServer::dump_all(msgpack::rpc::request &req)
+bool QUrlQueueServer::load_groups(const std::string &path)
 {
-    std::string content;
-    if (!m_dump_all_dumping) {
-        content = QCONTENTHUB_STRERROR;
-    } else {
-        mp::sync<site_map_t>::ref ref(m_site_map);
-        while (m_dump_all_it != ref->end()) {
-            Site *s = m_dump_all_it->second;
-            if (s->url_queue.size() == 0) {
-                s->dump_all_site_dumping = false;
-                m_dump_all_it++;
-                continue;
-            } else {
-                if (s->dump_all_site_dumping) {
-                    if (s->dump_all_site_dump_it == s->url_queue.end()) {
-                        s->dump_all_site_dumping = false;
-                        m_dump_all_it++;
-                        continue;
-                    } else {
-                        content = *(s->dump_all_site_dump_it);
-                        s->dump_all_site_dump_it++;
-                        break;
-                    }
-                } else {
-                    s->dump_all_site_dumping = true;
-                    s->dump_all_site_dump_it = s->url_queue.begin();
-                    content = *(s->dump_all_site_dump_it);
-                    s->dump_all_site_dump_it++;
-                    break;
-                }
-            }
-        }
-        if (m_dump_all_it == ref->end()) {
-            content = QCONTENTHUB_STREND;
-            m_dump_all_dumping = false;
+    FILE *fp = fopen(path.c_str(), "r");
+    if (fp == NULL) {
+        return false;
+    }
+    char line[1024];
+    char a[512];
+    char b[512];
+    int interval;
+    pthread_rwlock_wrlock(&m_group_lock);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "rule %511s", a) == 1) {
+            m_group_rules.insert(a);
+            find_group(a);
+        } else if (sscanf(line, "interval %511s %d", a, &interval) == 2) {
+            find_group(a)->interval = interval;
+        } else if (sscanf(line, "site %511s %511s", a, b) == 2) {
+            m_site_groups[a] = b;
+            find_group(b);
+        } else if (sscanf(line, "site %511s", a) == 1) {
+            m_site_groups[a] = "";
         }
     }
-    req.result(content);
+    pthread_rwlock_unlock(&m_group_lock);
+    fclose(fp);
+    regroup_sites();
+    return true;
 }
 
-void QUrlQueueServer::start_dump_site(msgpack::rpc::request &req, const std::string &site)
+int QUrlQueueServer::set_site_group(const std::string &site, const std::string &group)
 {
-    {
-        mp::sync<site_map_t>::ref ref(m_site_map);
-        site_map_it_t it = ref->find(site);
-        if (it != ref->end()) {
-            Site *s = it->second;
-            s->site_dumping = true;
-            s->site_dump_it = s->url_queue.begin();
-        }
+    pthread_rwlock_wrlock(&m_group_lock);
+    m_site_groups[site] = group;
+    if (!group.empty()) {
+        find_group(group);
     }
+    pthread_rwlock_unlock(&m_group_lock);
 
-    req.result(QCONTENTHUB_OK);
+    UrlShard *shard = shard_of(site);
+    pthread_mutex_lock(&shard->lock);
+    site_map_it_t it = shard->site_map.find(site);
+    if (it != shard->site_map.end()) {
+        it->second->group = group_of(site);
+        it->second->has_slot = false;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return save_groups() ? QCONTENTHUB_OK : QCONTENTHUB_ERROR;
 }
 
-void QUrlQueueServer::dump_site(msgpack::rpc::request &req, const std::string &site)
+void QUrlQueueServer::set_site_group(msgpack::rpc::request &req, const std::string &site, const std::string &group)
 {
-    std::string content;
-    {
-        mp::sync<site_map_t>::ref ref(m_site_map);
-        site_map_it_t it = ref->find(site);
-        if (it == ref->end()) {
-            content = QCONTENTHUB_STREND;
-        } else {
-            Site *s = it->second;
-            if (s->site_dump_it == s->url_queue.end()) {
-                s->site_dumping = false;
-                content = QCONTENTHUB_STREND;
-            } else {
-                content = *(s->site_dump_it);
-                s->site_dump_it++;
-            }
-        }
+    int ret = set_site_group(site, group);
+    req.result(ret);
+}
+
+int QUrlQueueServer::set_group_rule(const std::string &suffix, bool on)
+{
+    if (suffix.empty()) {
+        return QCONTENTHUB_ERROR;
+    }
+    pthread_rwlock_wrlock(&m_group_lock);
+    if (on) {
+        m_group_rules.insert(suffix);
+        find_group(suffix);
+    } else {
+        m_group_rules.erase(suffix);
     }
+    pthread_rwlock_unlock(&m_group_lock);
+    regroup_sites();
+    return save_groups() ? QCONTENTHUB_OK : QCONTENTHUB_ERROR;
+}
 
-    req.result(content);
+void QUrlQueueServer::add_group_rule(msgpack::rpc::request &req, const std::string &suffix)
+{
+    int ret = set_group_rule(suffix, true);
+    req.result(ret);
 }
 
-void QUrlQueueServer::clear_site(msgpack::rpc::request &req, const std::string &site)
+void QUrlQueueServer::del_group_rule(msgpack::rpc::request &req, const std::string &suffix)
 {
-    {
-        mp::sync<site_map_t>::ref ref(m_site_map);
-        site_map_it_t it = ref->find(site);
-        if (it != ref->end()) {
-            it->second->url_queue.clear();
-        }
-    }
-    req.result(QCONTENTHUB_OK);
+    int ret = set_group_rule(suffix, false);
+    req.result(ret);
 }
 
-void QUrlQueueServer::set_default_interval(msgpack::rpc::request &req, int interval)
+int QUrlQueueServer::set_group_interval(const std::string &group, int interval)
 {
-    {
-        mp::sync<site_map_t>::ref ref(m_site_map);
-        m_default_interval = interval;
-    }
-    req.result(QCONTENTHUB_OK);
+    pthread_rwlock_wrlock(&m_group_lock);
+    find_group(group)->interval = interval < 0 ? -1 : interval;
+    pthread_rwlock_unlock(&m_group_lock);
+    return save_groups() ? QCONTENTHUB_OK : QCONTENTHUB_ERROR;
 }
 
-void QUrlQueueServer::set_site_interval(msgpack::rpc::request &req, const std::string &site, int interval)
+void QUrlQueueServer::set_group_interval(msgpack::rpc::request &req, const std::string &group, int interval)
 {
-    {
-        mp::sync<site_map_t>::ref ref(m_site_map);
-        m_interval_map[site] = interval;
-    }
-    req.result(QCONTENTHUB_OK);
+    int ret = set_group_interval(group, interval);
+    req.result(ret);
 }
 
 void QUrlQueueServer::stats(msgpack::rpc::request &req)
@@ -265,11 +1108,35 @@ void QUrlQueueServer::stats(msgpack::rpc::request &req)
     std::string ret;
     uint64_t current = m_current_time / 1000;
 
+    size_t site_items = 0;
+    size_t ordered_site_items = 0;
+    uint64_t enqueue_items = 0;
+    uint64_t dequeue_items = 0;
+    uint64_t dedup_checks = 0;
+    uint64_t dedup_rejects = 0;
+    uint64_t dedup_rotations = 0;
+    size_t dedup_bytes = 0;
+    for (size_t i = 0; i < m_shards.size(); i++) {
+        UrlShard *shard = m_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        site_items += shard->site_map.size();
+        ordered_site_items += shard->ordered_sites.size();
+        enqueue_items += shard->enqueue_items;
+        dequeue_items += shard->dequeue_items;
+        dedup_checks += shard->dedup_checks;
+        dedup_rejects += shard->dedup_rejects;
+        if (shard->filter != NULL) {
+            dedup_rotations += shard->filter->rotations();
+            dedup_bytes += shard->filter->bytes();
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
     ret.append("STAT uptime ");
     sprintf(buf, "%ld", current - m_start_time);
     ret.append(buf);
 
-    ret.append("STAT time ");
+    ret.append("\nSTAT time ");
     sprintf(buf, "%ld", current);
     ret.append(buf);
 
@@ -277,20 +1144,56 @@ void QUrlQueueServer::stats(msgpack::rpc::request &req)
     sprintf(buf, "%d", m_default_interval);
     ret.append(buf);
 
+    ret.append("\nSTAT shards ");
+    sprintf(buf, "%ld", m_shards.size());
+    ret.append(buf);
+
+    pthread_rwlock_rdlock(&m_group_lock);
+    ret.append("\nSTAT groups ");
+    sprintf(buf, "%ld", m_groups.size());
+    ret.append(buf);
+
+    ret.append("\nSTAT group_rules ");
+    sprintf(buf, "%ld", m_group_rules.size());
+    ret.append(buf);
+    pthread_rwlock_unlock(&m_group_lock);
+
+    pthread_mutex_lock(&m_wait_lock);
+    ret.append("\nSTAT pop_waiters ");
+    sprintf(buf, "%ld", m_waiters.size());
+    ret.append(buf);
+    pthread_mutex_unlock(&m_wait_lock);
+
     ret.append("\nSTAT site_items ");
-    sprintf(buf, "%ld", m_site_map.unsafe_ref().size());
+    sprintf(buf, "%ld", site_items);
     ret.append(buf);
 
     ret.append("\nSTAT ordered_site_items ");
-    sprintf(buf, "%ld", ordered_sites.size());
+    sprintf(buf, "%ld", ordered_site_items);
     ret.append(buf);
 
     ret.append("\nSTAT enqueue_items ");
-    sprintf(buf, "%ld", m_enqueue_items);
+    sprintf(buf, "%ld", enqueue_items);
     ret.append(buf);
 
     ret.append("\nSTAT dequeue_items ");
-    sprintf(buf, "%ld", m_dequeue_items);
+    sprintf(buf, "%ld", dequeue_items);
+    ret.append(buf);
+
+    ret.append("\nSTAT dedup_bytes ");
+    sprintf(buf, "%ld", dedup_bytes);
+    ret.append(buf);
+
+    ret.append("\nSTAT dedup_checks ");
+    sprintf(buf, "%ld", dedup_checks);
+    ret.append(buf);
+
+    ret.append("\nSTAT dedup_rejects ");
+    sprintf(buf, "%ld", dedup_rejects);
+    ret.append(buf);
+
+    ret.append("\nSTAT dedup_rotations ");
+    sprintf(buf, "%ld", dedup_rotations);
     ret.append(buf);
 
     // TODO:
@@ -300,17 +1203,115 @@ void QUrlQueueServer::stats(msgpack::rpc::request &req)
     req.result(ret);
 }
 
+// what metrics() needs of a site, copied under its shard lock
+struct site_sample_t {
+    std::string name;
+    bool stop;
+    int interval;
+    int effective_interval;
+    int latency_ms;
+    uint64_t enqueue_items;
+    uint64_t dequeue_items;
+    uint64_t dedup_rejects;
+    uint64_t fetch_reports;
+    uint64_t fetch_errors;
+    size_t urls;
+    size_t url_bytes;
+};
+
+void QUrlQueueServer::metrics(msgpack::rpc::request &req, bool text)
+{
+    metrics_snapshot_t snapshot("qurlqueue", "site");
+    metric_set_t &server = snapshot.server;
+    std::vector<site_sample_t> samples;
+    uint64_t current = m_current_time / 1000;
+    uint64_t enqueue_items = 0;
+    uint64_t dequeue_items = 0;
+    uint64_t dedup_checks = 0;
+    uint64_t dedup_rejects = 0;
+    size_t ordered_site_items = 0;
+    for (size_t i = 0; i < m_shards.size(); i++) {
+        UrlShard *shard = m_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        enqueue_items += shard->enqueue_items;
+        dequeue_items += shard->dequeue_items;
+        dedup_checks += shard->dedup_checks;
+        dedup_rejects += shard->dedup_rejects;
+        ordered_site_items += shard->ordered_sites.size();
+
+        size_t j = samples.size();
+        samples.resize(j + shard->site_map.size());
+        for (site_map_it_t it = shard->site_map.begin(); it != shard->site_map.end(); it++, j++) {
+            Site *s = it->second;
+            site_sample_t &sample = samples[j];
+            sample.name = it->first;
+            sample.stop = s->stop;
+            sample.interval = site_interval(shard, it->first);
+            sample.effective_interval = effective_interval(shard, s);
+            sample.latency_ms = s->latency_ms;
+            sample.fetch_reports = s->fetch_reports;
+            sample.fetch_errors = s->fetch_errors;
+            sample.enqueue_items = s->enqueue_items;
+            sample.dequeue_items = s->dequeue_items;
+            sample.dedup_rejects = s->dedup_rejects;
+            sample.urls = s->url_queue.size();
+            sample.url_bytes = s->url_queue.bytes();
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    server.counters["enqueue_items"] = enqueue_items;
+    server.counters["dequeue_items"] = dequeue_items;
+    server.counters["dedup_checks"] = dedup_checks;
+    server.counters["dedup_rejects"] = dedup_rejects;
+    server.gauges["default_interval"] = m_default_interval;
+    server.gauges["shards"] = m_shards.size();
+    server.gauges["sites"] = samples.size();
+    server.gauges["ordered_sites"] = ordered_site_items;
+    server.gauges["uptime"] = current - m_start_time;
+    server.gauges["time"] = current;
+    server.gauges["stop_all"] = m_stop_all;
+    pthread_mutex_lock(&m_wait_lock);
+    server.counters["pop_waits"] = m_pop_waits;
+    server.counters["pop_wait_timeouts"] = m_pop_wait_timeouts;
+    server.gauges["pop_waiters"] = m_waiters.size();
+    pthread_mutex_unlock(&m_wait_lock);
+    server.add_latency("pop_wait", m_pop_wait);
+
+    for (size_t i = 0; i < samples.size(); i++) {
+        const site_sample_t &sample = samples[i];
+        metric_set_t &m = snapshot.children[sample.name];
+        m.counters["enqueue_items"] = sample.enqueue_items;
+        m.counters["dequeue_items"] = sample.dequeue_items;
+        m.counters["dedup_rejects"] = sample.dedup_rejects;
+        m.counters["fetch_reports"] = sample.fetch_reports;
+        m.counters["fetch_errors"] = sample.fetch_errors;
+        m.gauges["urls"] = sample.urls;
+        m.gauges["url_bytes"] = sample.url_bytes;
+        m.gauges["interval"] = sample.interval;
+        m.gauges["effective_interval"] = sample.effective_interval;
+        m.gauges["latency_ms"] = sample.latency_ms;
+        m.gauges["stopped"] = sample.stop;
+    }
+
+    if (text) {
+        req.result(snapshot.text());
+    } else {
+        req.result(snapshot);
+    }
+}
+
 void QUrlQueueServer::stat_site(msgpack::rpc::request &req, const std::string &site)
 {
     char buf[64];
     std::string ret;
-    mp::sync<site_map_t>::ref ref(m_site_map);
+    UrlShard *shard = shard_of(site);
+    pthread_mutex_lock(&shard->lock);
     ret.append("STAT site ");
     ret.append(site);
 
-    interval_map_it_t interval_it = m_interval_map.find(site);
+    interval_map_it_t interval_it = shard->interval_map.find(site);
     ret.append("\nSTAT interval ");
-    if (interval_it == m_interval_map.end()) {
+    if (interval_it == shard->interval_map.end()) {
         ret.append("default ");
         sprintf(buf, "%d", m_default_interval);
         ret.append(buf);
@@ -319,8 +1320,8 @@ void QUrlQueueServer::stat_site(msgpack::rpc::request &req, const std::string &s
         ret.append(buf);
     }
 
-    site_map_it_t it = ref->find(site);
-    if (it != ref->end()) {
+    site_map_it_t it = shard->site_map.find(site);
+    if (it != shard->site_map.end()) {
         ret.append("\nSTAT stop ");
         if (it->second->stop) {
             ret.append("1");
@@ -335,7 +1336,59 @@ void QUrlQueueServer::stat_site(msgpack::rpc::request &req, const std::string &s
         ret.append("\nSTAT dequeue_items ");
         sprintf(buf, "%ld", it->second->dequeue_items);
         ret.append(buf);
+
+        ret.append("\nSTAT dedup_rejects ");
+        sprintf(buf, "%ld", it->second->dedup_rejects);
+        ret.append(buf);
+
+        ret.append("\nSTAT urls ");
+        sprintf(buf, "%ld", it->second->url_queue.size());
+        ret.append(buf);
+
+        ret.append("\nSTAT url_bytes ");
+        sprintf(buf, "%ld", it->second->url_queue.bytes());
+        ret.append(buf);
+
+        for (int lane = QURLQUEUE_LANES - 1; lane >= 0; lane--) {
+            size_t urls = it->second->url_queue.size(lane);
+            if (urls > 0) {
+                sprintf(buf, "\nSTAT lane_%d %ld", lane, urls);
+                ret.append(buf);
+            }
+        }
+
+        ret.append("\nSTAT effective_interval ");
+        sprintf(buf, "%d", effective_interval(shard, it->second));
+        ret.append(buf);
+
+        ret.append("\nSTAT latency_ms ");
+        sprintf(buf, "%d", it->second->latency_ms);
+        ret.append(buf);
+
+        ret.append("\nSTAT fetch_reports ");
+        sprintf(buf, "%ld", it->second->fetch_reports);
+        ret.append(buf);
+
+        ret.append("\nSTAT fetch_errors ");
+        sprintf(buf, "%ld", it->second->fetch_errors);
+        ret.append(buf);
+
+        SiteGroup *group = it->second->group;
+        if (group != NULL) {
+            ret.append("\nSTAT group ");
+            ret.append(group->name);
+
+            ret.append("\nSTAT group_interval ");
+            if (group->interval < 0) {
+                ret.append("default ");
+                sprintf(buf, "%d", m_default_interval);
+            } else {
+                sprintf(buf, "%d", group->interval);
+            }
+            ret.append(buf);
+        }
     }
+    pthread_mutex_unlock(&shard->lock);
 
     ret.append("\nEND\r\n");
     req.result(ret);
@@ -343,29 +1396,34 @@ void QUrlQueueServer::stat_site(msgpack::rpc::request &req, const std::string &s
 
 void QUrlQueueServer::start_site(msgpack::rpc::request &req, const std::string &site)
 {
-    {
-        mp::sync<site_map_t>::ref ref(m_site_map);
-        site_map_it_t it = ref->find(site);
-        if (it != ref->end()) {
-            Site * s = it->second;
-            it->second->stop = false;
-            s->ref_cnt++;
-            ordered_sites.push(s);
+    UrlShard *shard = shard_of(site);
+    pthread_mutex_lock(&shard->lock);
+    site_map_it_t it = shard->site_map.find(site);
+    if (it != shard->site_map.end()) {
+        set_site_stop(shard, it->second, false);
+        if (shard->store != NULL) {
+            shard->store->append(QUrlStore::OP_START_SITE, site);
         }
+        shard->update_next_ready();
     }
+    pthread_mutex_unlock(&shard->lock);
 
     req.result(QCONTENTHUB_OK);
 }
 
 void QUrlQueueServer::stop_site(msgpack::rpc::request &req, const std::string &site)
 {
-    {
-        mp::sync<site_map_t>::ref ref(m_site_map);
-        site_map_it_t it = ref->find(site);
-        if (it != ref->end()) {
-            it->second->stop = true;
+    UrlShard *shard = shard_of(site);
+    pthread_mutex_lock(&shard->lock);
+    site_map_it_t it = shard->site_map.find(site);
+    if (it != shard->site_map.end()) {
+        set_site_stop(shard, it->second, true);
+        if (shard->store != NULL) {
+            shard->store->append(QUrlStore::OP_STOP_SITE, site);
         }
+        shard->update_next_ready();
     }
+    pthread_mutex_unlock(&shard->lock);
 
     req.result(QCONTENTHUB_OK);
 }
@@ -379,30 +1437,370 @@ void QUrlQueueServer::clear_empty_site(msgpack::rpc::request &req)
 
 int QUrlQueueServer::clear_empty_site()
 {
-    mp::sync<site_map_t>::ref ref(m_site_map);
-    std::vector<std::string> site_vec;
-    for (site_map_it_t it = ref->begin(); it != ref->end(); it++) {
-        Site *s = it->second;
-        if (s->next_crawl_time > 0 && s->next_crawl_time < m_current_time - 86400000  && s->url_queue.size() == 0 && s->ref_cnt == 0) {
-            site_vec.push_back(it->first);
+    int cleared = 0;
+    for (size_t i = 0; i < m_shards.size() && cleared <= 2000; i++) {
+        UrlShard *shard = m_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        site_map_it_t it = shard->site_map.begin();
+        while (it != shard->site_map.end() && cleared <= 2000) {
+            Site *s = it->second;
+            if (s->next_crawl_time > 0 && s->next_crawl_time < m_current_time - 86400000  && s->url_queue.size() == 0 && !site_heap_t::contains(s)) {
+                delete s;
+                shard->site_map.erase(it++);
+                cleared++;
+            } else {
+                it++;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return cleared;
+}
+
+
+void QUrlQueueServer::set_store_dir(const std::string &dir, int snapshot_secs)
+{
+    m_store_dir = dir;
+    m_snapshot_secs = snapshot_secs;
+}
+
+void QUrlQueueServer::set_dump_dir(const std::string &dir)
+{
+    m_dump_dir = dir;
+}
+
+static void append_u64(std::string &buf, uint64_t v)
+{
+    buf.append((const char *)&v, sizeof(v));
+}
+
+// OP_SITE argument: stop, enqueue_items, dequeue_items, dedup_rejects,
+// the url count and the urls, each after its 32 bit length
+static void encode_site(std::string &arg, const Site *s)
+{
+    arg.clear();
+    arg.push_back(s->stop ? 1 : 0);
+    append_u64(arg, s->enqueue_items);
+    append_u64(arg, s->dequeue_items);
+    append_u64(arg, s->dedup_rejects);
+    // lane 0 as before, then a lane byte, count and urls per higher lane
+    std::string url;
+    for (int lane = 0; lane < QURLQUEUE_LANES; lane++) {
+        const QUrlList *l = s->url_queue.list(lane);
+        if (lane > 0 && (l == NULL || l->empty())) {
+            continue;
+        }
+        if (lane > 0) {
+            arg.push_back((char)lane);
+        }
+        append_u32(arg, l->size());
+        QUrlList::iterator it = l->begin();
+        while (it.next(url)) {
+            append_u32(arg, url.size());
+            arg.append(url);
+        }
+    }
+}
+
+typedef std::vector<std::pair<std::string, Site *> > site_copy_list_t;
+
+// Copies the sites of a shard for a snapshot, called with shard->lock
+// held. A url list is copied chunk by chunk without decoding, so the
+// lock is held for little more than a memcpy of the urls; the encoding
+// and its crcs run after it is released.
+static void copy_shard(UrlShard *shard, site_copy_list_t &sites, interval_map_t &intervals)
+{
+    sites.reserve(shard->site_map.size());
+    for (site_map_it_t it = shard->site_map.begin(); it != shard->site_map.end(); it++) {
+        const Site *s = it->second;
+        Site *copy = new Site();
+        copy->stop = s->stop;
+        copy->enqueue_items = s->enqueue_items;
+        copy->dequeue_items = s->dequeue_items;
+        copy->dedup_rejects = s->dedup_rejects;
+        copy->url_queue.assign(s->url_queue);
+        sites.push_back(std::make_pair(it->first, copy));
+    }
+    intervals = shard->interval_map;
+}
+
+// snapshot of the sites copied by copy_shard, which it frees
+static void encode_shard(site_copy_list_t &sites, interval_map_t &intervals, std::string &data)
+{
+    std::string arg;
+    for (size_t i = 0; i < sites.size(); i++) {
+        encode_site(arg, sites[i].second);
+        QUrlStore::encode(data, QUrlStore::OP_SITE, sites[i].first, arg.data(), arg.size());
+        delete sites[i].second;
+    }
+    sites.clear();
+    for (interval_map_it_t it = intervals.begin(); it != intervals.end(); it++) {
+        int32_t interval = it->second;
+        QUrlStore::encode(data, QUrlStore::OP_SITE_INTERVAL, it->first, (const char *)&interval, sizeof(interval));
+    }
+}
+
+void QUrlQueueServer::replay(void *ctx, int op, const std::string &site, const char *arg, size_t arg_size)
+{
+    QUrlQueueServer *svr = (QUrlQueueServer *)ctx;
+    UrlShard *shard = svr->shard_of(site);
+    pthread_mutex_lock(&shard->lock);
+    site_map_it_t it = shard->site_map.find(site);
+    Site *s = it == shard->site_map.end() ? NULL : it->second;
+
+    switch (op) {
+        case QUrlStore::OP_SITE: {
+            const char *p = arg;
+            const char *end = arg + arg_size;
+            if (arg_size < 29) {
+                break;
+            }
+            if (s == NULL) {
+                s = svr->get_site(shard, site);
+            }
+            clear_urls(shard, s);
+            bool stop = *p++ != 0;
+            memcpy(&s->enqueue_items, p, 8);
+            memcpy(&s->dequeue_items, p + 8, 8);
+            memcpy(&s->dedup_rejects, p + 16, 8);
+            p += 24;
+            for (int lane = 0; p + 4 <= end && lane < QURLQUEUE_LANES; ) {
+                uint32_t n;
+                memcpy(&n, p, 4);
+                p += 4;
+                for (uint32_t i = 0; i < n && p + 4 <= end; i++) {
+                    uint32_t len;
+                    memcpy(&len, p, 4);
+                    if (p + 4 + len > end) {
+                        p = end;
+                        break;
+                    }
+                    s->url_queue.push_back(std::string(p + 4, len), lane);
+                    p += 4 + len;
+                }
+                if (p + 5 > end) {
+                    break;
+                }
+                lane = (unsigned char)*p++;
+            }
+            shard->enqueue_items += s->enqueue_items;
+            shard->dequeue_items += s->dequeue_items;
+            set_site_stop(shard, s, stop);
+            break;
+        }
+        case QUrlStore::OP_PUSH:
+        case QUrlStore::OP_PUSH_FRONT:
+            add_url(shard, svr->get_site(shard, site), std::string(arg, arg_size), op == QUrlStore::OP_PUSH_FRONT, 0);
+            break;
+        case QUrlStore::OP_PUSH_LANE:
+        case QUrlStore::OP_PUSH_FRONT_LANE:
+            if (arg_size > 0 && (unsigned char)arg[0] < QURLQUEUE_LANES) {
+                add_url(shard, svr->get_site(shard, site), std::string(arg + 1, arg_size - 1), op == QUrlStore::OP_PUSH_FRONT_LANE, (unsigned char)arg[0]);
+            }
+            break;
+        case QUrlStore::OP_POP: {
+            std::string url;
+            if (s != NULL && s->url_queue.pop_front(url)) {
+                s->dequeue_items++;
+                shard->dequeue_items++;
+                if (s->url_queue.empty() && site_heap_t::contains(s)) {
+                    shard->ordered_sites.erase(s);
+                }
+            }
+            break;
+        }
+        case QUrlStore::OP_CLEAR_SITE:
+            if (s != NULL) {
+                clear_urls(shard, s);
+            }
+            break;
+        case QUrlStore::OP_STOP_SITE:
+        case QUrlStore::OP_START_SITE:
+            if (s != NULL) {
+                set_site_stop(shard, s, op == QUrlStore::OP_STOP_SITE);
+            }
+            break;
+        case QUrlStore::OP_SITE_INTERVAL:
+            if (arg_size == sizeof(int32_t)) {
+                int32_t interval;
+                memcpy(&interval, arg, sizeof(interval));
+                shard->interval_map[site] = interval;
+            }
+            break;
+    }
+    shard->update_next_ready();
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void *QUrlQueueServer::load_main(void *arg)
+{
+    QUrlQueueServer *svr = (QUrlQueueServer *)arg;
+    uint64_t gen = 0;
+    for (;;) {
+        int shard = __sync_fetch_and_add(&svr->m_load_next, 1);
+        if (shard >= svr->m_load_shards) {
+            break;
+        }
+        if (QUrlStore::load(svr->m_store_dir, shard, &QUrlQueueServer::replay, svr, gen) != QCONTENTHUB_OK) {
+            svr->m_load_failed = true;
         }
-        if (site_vec.size() > 2000) {
+    }
+
+    uint64_t cur = svr->m_store_gen;
+    while (gen > cur && !__sync_bool_compare_and_swap(&svr->m_store_gen, cur, gen)) {
+        cur = svr->m_store_gen;
+    }
+    return NULL;
+}
+
+int QUrlQueueServer::recover()
+{
+    if (mkdir(m_store_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        perror(m_store_dir.c_str());
+        return QCONTENTHUB_ERROR;
+    }
+
+    int shards = 0;
+    int interval = m_default_interval;
+    if (QUrlStore::read_meta(m_store_dir, shards, interval)) {
+        m_default_interval = interval;
+    }
+
+    // sites join their groups as they are replayed
+    load_groups(m_store_dir + "/groups");
+
+    // the shard files hold disjoint sites, so they replay in parallel
+    uint64_t start = qcontenthub_usec();
+    m_store_gen = 0;
+    m_load_next = 0;
+    m_load_shards = QUrlStore::shards_in(m_store_dir);
+    m_load_failed = false;
+    int threads = std::min(m_load_shards, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    std::vector<pthread_t> tids;
+    for (int i = 0; i < threads; i++) {
+        pthread_t tid;
+        int err = pthread_create(&tid, NULL, &QUrlQueueServer::load_main, this);
+        if (err != 0) {
+            fprintf(stderr, "loader thread: %s\n", strerror(err));
             break;
         }
+        tids.push_back(tid);
+    }
+    // the loaders take shards until none is left, so whatever threads
+    // started load all of them; with none this thread loads them
+    if (tids.empty()) {
+        load_main(this);
+    }
+    for (size_t i = 0; i < tids.size(); i++) {
+        pthread_join(tids[i], NULL);
+    }
+    if (m_load_failed) {
+        return QCONTENTHUB_ERROR;
+    }
+    if (m_load_shards > 0) {
+        size_t urls = 0;
+        for (size_t i = 0; i < m_shards.size(); i++) {
+            for (site_map_it_t it = m_shards[i]->site_map.begin(); it != m_shards[i]->site_map.end(); it++) {
+                urls += it->second->url_queue.size();
+            }
+        }
+        fprintf(stderr, "loaded %lu urls from %s in %.3fs\n", urls, m_store_dir.c_str(), (qcontenthub_usec() - start) / 1000000.0);
+    }
+
+    m_store_gen++;
+    for (size_t i = 0; i < m_shards.size(); i++) {
+        UrlShard *shard = m_shards[i];
+        shard->store = new QUrlStore(m_store_dir, i);
+        if (!shard->store->open(m_store_gen)) {
+            return QCONTENTHUB_ERROR;
+        }
+    }
+
+    // the sites of a file no longer match a shard after a change of the
+    // shard count, so rewrite everything at once
+    if (m_load_shards > 0 && shards != (int)m_shards.size()) {
+        if (!snapshot()) {
+            return QCONTENTHUB_ERROR;
+        }
+        QUrlStore::remove_before(m_store_dir, m_store_gen);
     }
+    QUrlStore::write_meta(m_store_dir, m_shards.size(), m_default_interval);
+    m_snapshot_at = m_current_time;
+    return QCONTENTHUB_OK;
+}
+
+bool QUrlQueueServer::snapshot()
+{
+    bool ret = true;
+    uint64_t gen = __sync_add_and_fetch(&m_store_gen, 1);
+    for (size_t i = 0; i < m_shards.size(); i++) {
+        UrlShard *shard = m_shards[i];
+        std::string data;
+        site_copy_list_t sites;
+        interval_map_t intervals;
+        pthread_mutex_lock(&shard->lock);
+        copy_shard(shard, sites, intervals);
+        shard->store->roll(gen);
+        pthread_mutex_unlock(&shard->lock);
+        encode_shard(sites, intervals, data);
+
+        // a snapshot removes the older files, so their records must be
+        // on disk first; a shard that failed keeps its older snapshot
+        // and logs and tries again at the next snapshot
+        if (shard->store->flush() == QCONTENTHUB_ERROR || !shard->store->write_snapshot(gen, data)) {
+            ret = false;
+        }
+    }
+    m_snapshot_at = m_current_time;
+    return ret;
+}
 
-    int site_vec_size = site_vec.size();
-    for (int i = 0; i < site_vec_size; i++) {
-        site_map_it_t del_it = ref->find(site_vec[i]);
-        if (del_it != ref->end()) {
-            delete del_it->second;
-            ref->erase(del_it);
+bool QUrlQueueServer::flush_stores()
+{
+    bool busy = false;
+    for (size_t i = 0; i < m_shards.size(); i++) {
+        if (m_shards[i]->store->flush() != QCONTENTHUB_AGAIN) {
+            busy = true;
         }
     }
+    return busy;
+}
 
-    return site_vec_size;
+void *QUrlQueueServer::flush_main(void *arg)
+{
+    QUrlQueueServer *svr = (QUrlQueueServer *)arg;
+    for (;;) {
+        svr->flush_stores();
+        if (svr->m_snapshot_secs > 0 && m_current_time >= svr->m_snapshot_at + svr->m_snapshot_secs * 1000ULL) {
+            svr->snapshot();
+        }
+        usleep(QURLQUEUE_FLUSH_INTERVAL * 1000);
+    }
+    return NULL;
 }
 
+// items of push_urls and push_list_bulk, [site, url] or [site, url,
+// priority]; false when none carries a priority
+static bool convert_site_urls(const std::vector<msgpack::object> &items, site_url_list_t &urls, std::vector<int> &priorities)
+{
+    bool has_priority = false;
+    urls.resize(items.size());
+    priorities.assign(items.size(), 0);
+    for (size_t i = 0; i < items.size(); i++) {
+        if (items[i].type == msgpack::type::ARRAY && items[i].via.array.size > 2) {
+            msgpack::type::tuple<std::string, std::string, int> item;
+            items[i].convert(&item);
+            urls[i].first = item.get<0>();
+            urls[i].second = item.get<1>();
+            priorities[i] = item.get<2>();
+            has_priority = true;
+        } else {
+            items[i].convert(&urls[i]);
+        }
+    }
+    return has_priority;
+}
 
 void QUrlQueueServer::dispatch(msgpack::rpc::request req)
 {
@@ -410,22 +1808,73 @@ void QUrlQueueServer::dispatch(msgpack::rpc::request req)
         std::string method;
         req.method().convert(&method);
 
-        if(method == "push") {
-            msgpack::type::tuple<std::string, std::string> params;
+        if(method == "push" || method == "push_list") {
+            // an optional third argument is the priority lane
+            msgpack::object params_obj = req.params();
+            std::string site, record;
+            int priority = 0;
+            if (params_obj.type == msgpack::type::ARRAY && params_obj.via.array.size > 2) {
+                msgpack::type::tuple<std::string, std::string, int> params;
+                params_obj.convert(&params);
+                site = params.get<0>();
+                record = params.get<1>();
+                priority = params.get<2>();
+            } else {
+                msgpack::type::tuple<std::string, std::string> params;
+                params_obj.convert(&params);
+                site = params.get<0>();
+                record = params.get<1>();
+            }
+            if (method == "push") {
+                push_url(req, site, record, priority);
+            } else {
+                push_list(req, site, record, priority);
+            }
+        } else if(method == "push_urls" || method == "push_list_bulk") {
+            msgpack::type::tuple<std::vector<msgpack::object> > params;
             req.params().convert(&params);
-            push_url(req, params.get<0>(), params.get<1>());
+            site_url_list_t urls;
+            std::vector<int> priorities;
+            bool has_priority = convert_site_urls(params.get<0>(), urls, priorities);
+            if (method == "push_urls") {
+                push_urls(req, urls, has_priority ? &priorities : NULL);
+            } else {
+                push_list_bulk(req, urls, has_priority ? &priorities : NULL);
+            }
         } else if(method == "pop") {
             pop_url(req);
-        } else if(method == "push_list") {
-            msgpack::type::tuple<std::string, std::string> params;
+        } else if(method == "pop_wait") {
+            msgpack::type::tuple<int> params;
+            req.params().convert(&params);
+            pop_wait(req, params.get<0>());
+        } else if(method == "pop_urls") {
+            msgpack::type::tuple<int> params;
             req.params().convert(&params);
-            push_list(req, params.get<0>(), params.get<1>());
+            pop_urls(req, params.get<0>());
         } else if(method == "start_dump_all") {
             start_dump_all(req);
         } else if(method == "dump_all") {
             dump_all(req);
+        } else if(method == "dump_all_chunk") {
+            msgpack::type::tuple<int> params;
+            req.params().convert(&params);
+            dump_all_chunk(req, params.get<0>());
+        } else if(method == "dump_file") {
+            msgpack::type::tuple<std::string> params;
+            req.params().convert(&params);
+            dump_file(req, params.get<0>());
         } else if(method == "stats") {
             stats(req);
+        } else if(method == "metrics") {
+            // an optional "text" argument asks for the text exposition
+            msgpack::object params_obj = req.params();
+            std::string format;
+            if (params_obj.type == msgpack::type::ARRAY && params_obj.via.array.size > 0) {
+                msgpack::type::tuple<std::string> params;
+                params_obj.convert(&params);
+                format = params.get<0>();
+            }
+            metrics(req, format == "text");
         } else if(method == "set_default_interval") {
             msgpack::type::tuple<int> params;
             req.params().convert(&params);
@@ -434,6 +1883,30 @@ void QUrlQueueServer::dispatch(msgpack::rpc::request req)
             msgpack::type::tuple<std::string, int> params;
             req.params().convert(&params);
             set_site_interval(req, params.get<0>(), params.get<1>());
+        } else if(method == "set_adaptive_interval") {
+            msgpack::type::tuple<int, int> params;
+            req.params().convert(&params);
+            set_adaptive_interval(req, params.get<0>(), params.get<1>());
+        } else if(method == "report_fetch") {
+            msgpack::type::tuple<std::string, int, int> params;
+            req.params().convert(&params);
+            report_fetch(req, params.get<0>(), params.get<1>(), params.get<2>());
+        } else if(method == "set_site_group") {
+            msgpack::type::tuple<std::string, std::string> params;
+            req.params().convert(&params);
+            set_site_group(req, params.get<0>(), params.get<1>());
+        } else if(method == "add_group_rule") {
+            msgpack::type::tuple<std::string> params;
+            req.params().convert(&params);
+            add_group_rule(req, params.get<0>());
+        } else if(method == "del_group_rule") {
+            msgpack::type::tuple<std::string> params;
+            req.params().convert(&params);
+            del_group_rule(req, params.get<0>());
+        } else if(method == "set_group_interval") {
+            msgpack::type::tuple<std::string, int> params;
+            req.params().convert(&params);
+            set_group_interval(req, params.get<0>(), params.get<1>());
         } else if(method == "stat_site") {
             msgpack::type::tuple<std::string> params;
             req.params().convert(&params);
@@ -458,6 +1931,10 @@ void QUrlQueueServer::dispatch(msgpack::rpc::request req)
             msgpack::type::tuple<std::string> params;
             req.params().convert(&params);
             dump_site(req, params.get<0>());
+        } else if(method == "dump_site_chunk") {
+            msgpack::type::tuple<std::string, int> params;
+            req.params().convert(&params);
+            dump_site_chunk(req, params.get<0>(), params.get<1>());
         } else if(method == "clear_empty_site") {
             clear_empty_site(req);
         } else {
@@ -476,6 +1953,15 @@ void QUrlQueueServer::dispatch(msgpack::rpc::request req)
 void QUrlQueueServer::start(int multiple)
 {
     m_start_time = get_current_time() / 1000;
+    if (!m_store_dir.empty()) {
+        set_current_time();
+        if (recover() != QCONTENTHUB_OK) {
+            exit(EXIT_FAILURE);
+        }
+        pthread_t tid;
+        pthread_create(&tid, NULL, &QUrlQueueServer::flush_main, this);
+        pthread_detach(tid);
+    }
     this->instance.run(multiple);
 }
 
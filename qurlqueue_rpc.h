@@ -3,102 +3,374 @@
 
 #include <msgpack/rpc/loop.h>
 #include <msgpack/rpc/server.h>
-#include <mp/sync.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <list>
 #include <map>
-#include <queue>
+#include <set>
 #include <string>
+#include <vector>
 #include "qcontenthub.h"
+#include "qcontenthub_metrics.h"
+#include "qurlqueue_filter.h"
+#include "qurlqueue_heap.h"
+#include "qurlqueue_list.h"
+#include "qurlqueue_store.h"
+
+// number of site map shards
+#define QURLQUEUE_DEFAULT_SHARDS 64
+
+// millisecs between writes of the operation logs
+#define QURLQUEUE_FLUSH_INTERVAL 100
+
+// most urls a dump copies under one shard lock
+#define QURLQUEUE_DUMP_CHUNK 4096
+
+// an adaptive site interval shrinks by this fraction after a fetch that
+// went well and doubles after one that did not
+#define QURLQUEUE_ADAPT_SHRINK 32
 
 namespace qurlqueue {
 
 class Site;
-class SiteCmp;
+class SiteGroup;
 
 typedef std::map<std::string, Site *> site_map_t;
 typedef std::map<std::string, Site *>::iterator site_map_it_t;
 typedef std::map<std::string, int> interval_map_t;
 typedef std::map<std::string, int>::iterator interval_map_it_t;
+// [site, record] pairs of push_urls
+typedef std::vector<std::pair<std::string, std::string> > site_url_list_t;
+// [site, [record, ...]] runs of a chunked dump
+typedef std::vector<std::pair<std::string, std::vector<std::string> > > dump_chunk_t;
+typedef std::map<std::string, SiteGroup *> group_map_t;
+typedef std::map<std::string, SiteGroup *>::iterator group_map_it_t;
+
+// Sites crawled as one for politeness, such as the virtual hosts of a
+// server. The sites of a group may live in any shard, so the group only
+// hands out crawl slots, one per interval, with an atomic compare and
+// swap. A due site of a group takes the next free slot and waits for it
+// in its shard's heap, which makes the sites of a group take turns.
+class SiteGroup {
+public:
+    SiteGroup(): interval(-1), next_slot(0) {}
+
+    // the first free slot at or after now, which is taken
+    uint64_t reserve(uint64_t now, int gap) {
+        uint64_t cur = next_slot;
+        for (;;) {
+            uint64_t slot = cur > now ? cur : now;
+            uint64_t prev = __sync_val_compare_and_swap(&next_slot, cur, slot + gap);
+            if (prev == cur) {
+                return slot;
+            }
+            cur = prev;
+        }
+    }
+
+    std::string name;
+    // millisecs between crawls of the group, -1 for the default interval
+    volatile int interval;
+    volatile uint64_t next_slot;
+};
 
 class Site {
 public:
-    Site(): stop(false), ref_cnt(0), enqueue_items(0), dequeue_items(0), next_crawl_time(0), site_dumping(false), dump_all_site_dumping(false) {};
+    Site(): stop(false), heap_index(-1), enqueue_items(0), dequeue_items(0), dedup_rejects(0), next_crawl_time(0), group(NULL), has_slot(false), interval(0), latency_ms(0), fetch_reports(0), fetch_errors(0), site_dumping(false), site_dump_lane(-1), site_dump_seq(0) {};
 
     bool stop;
     std::string name;
-    int ref_cnt;
+    // slot in its shard's ordered_sites, -1 while stopped or empty
+    int heap_index;
     uint64_t enqueue_items;
     uint64_t dequeue_items;
+    uint64_t dedup_rejects;
     uint64_t next_crawl_time;
+    // politeness group, NULL for a site crawled on its own
+    SiteGroup *group;
+    // next_crawl_time is a slot taken from group
+    bool has_slot;
 
+    // interval adapted by report_fetch, 0 until the first report
+    int interval;
+    // moving average of the reported fetch latencies
+    int latency_ms;
+    uint64_t fetch_reports;
+    uint64_t fetch_errors;
+
+    // dump_site cursor, a lane and sequence number of url_queue
     bool site_dumping;
-    std::list<std::string>::iterator site_dump_it;
+    int site_dump_lane;
+    uint64_t site_dump_seq;
+    QUrlLanes url_queue;
+};
+
+typedef QUrlHeap<Site> site_heap_t;
+
+// Position of a dump of every shard. It keeps the site name rather than
+// an iterator and a url sequence number, so sites and urls may come and
+// go between the calls of a dump.
+struct dump_cursor_t {
+    dump_cursor_t(): shard(0), in_site(false), lane(-1), seq(0) {}
+
+    size_t shard;
+    // the site being read, or the one to start at while !in_site
+    std::string site;
+    bool in_site;
+    int lane;
+    uint64_t seq;
+};
 
-    bool dump_all_site_dumping;
-    std::list<std::string>::iterator dump_all_site_dump_it;
-    std::list<std::string> url_queue;
+// a pop_wait request parked until a site is due or its deadline passes
+struct url_waiter_t {
+    url_waiter_t(const msgpack::rpc::request &r, uint64_t d): req(r), deadline(d), parked(qcontenthub_usec()) {}
+
+    msgpack::rpc::request req;
+    // millisecs
+    uint64_t deadline;
+    // monotonic microsecs
+    uint64_t parked;
+    std::string url;
 };
 
-class SiteCmp {
+typedef std::list<url_waiter_t> url_waiter_list_t;
 
+// A slice of the sites, chosen by a hash of the site name. The sites,
+// their intervals and their heap entries are only touched under lock, so
+// pushes and pops of sites in different shards never meet.
+class UrlShard {
 public:
-    bool operator() (Site* &lhs, Site* &rhs) const
-    {
-        return lhs->next_crawl_time < rhs->next_crawl_time;
+    UrlShard(): filter(NULL), store(NULL), next_ready((uint64_t)-1), enqueue_items(0), dequeue_items(0), dedup_checks(0), dedup_rejects(0) {
+        pthread_mutex_init(&lock, NULL);
+    }
+    ~UrlShard() {
+        delete filter;
+        delete store;
+        pthread_mutex_destroy(&lock);
     }
 
+    // refreshes next_ready from the heap top, called with lock held
+    void update_next_ready() {
+        next_ready = ordered_sites.empty() ? (uint64_t)-1 : ordered_sites.top()->next_crawl_time;
+    }
+
+    pthread_mutex_t lock;
+    site_map_t site_map;
+    // the sites with urls that are not stopped
+    site_heap_t ordered_sites;
+    interval_map_t interval_map;
+    // urls pushed to the sites of the shard, NULL without dedup
+    QUrlFilter *filter;
+    // snapshot and log of the shard, NULL without --store
+    QUrlStore *store;
+    // next_crawl_time of the heap top, read without the lock so pop_url
+    // skips shards with nothing due
+    volatile uint64_t next_ready;
+    uint64_t enqueue_items;
+    uint64_t dequeue_items;
+    uint64_t dedup_checks;
+    uint64_t dedup_rejects;
+
+private:
+    UrlShard(const UrlShard &);
+    UrlShard &operator=(const UrlShard &);
 };
 
+// The url queue. The methods taking no request are the in-process API of
+// libqcontenthub and are thread safe. The scheduler reads a clock that
+// only tick() or set_current_time() moves, so an embedder without the
+// daemon's loop calls one of them every millisec or so.
 class QUrlQueueServer : public msgpack::rpc::server::base {
 
 public:
-    QUrlQueueServer(msgpack::rpc::loop lo = msgpack::rpc::loop()) : msgpack::rpc::server::base(lo), m_enqueue_items(0), m_dequeue_items(0), m_stop_all(false), m_dump_all_dumping(false) {}
-    void push_url(msgpack::rpc::request &req, const std::string &site, const std::string &record);
-    void push_list(msgpack::rpc::request &req, const std::string &site, const std::string &record);
-    int push_url(const std::string &site, const std::string &record, bool push_front = false);
+    QUrlQueueServer(msgpack::rpc::loop lo = msgpack::rpc::loop(), int shards = QURLQUEUE_DEFAULT_SHARDS);
+    ~QUrlQueueServer();
+    // priority picks the lane, 0 to QURLQUEUE_LANES - 1 with the highest
+    // popped first
+    void push_url(msgpack::rpc::request &req, const std::string &site, const std::string &record, int priority);
+    void push_list(msgpack::rpc::request &req, const std::string &site, const std::string &record, int priority);
+    int push_url(const std::string &site, const std::string &record, bool push_front = false, int priority = 0);
+    // pushes [site, record] pairs taking every shard lock once, status
+    // gets the push result of each pair; priorities, if given, holds the
+    // priority of every pair
+    void push_urls(msgpack::rpc::request &req, const site_url_list_t &urls, const std::vector<int> *priorities);
+    // push_urls through push_list, the urls of a site end up at its front
+    // in the order given
+    void push_list_bulk(msgpack::rpc::request &req, const site_url_list_t &urls, const std::vector<int> *priorities);
+    void push_urls(const site_url_list_t &urls, std::vector<int> &status, bool push_front = false, const std::vector<int> *priorities = NULL);
     void pop_url(msgpack::rpc::request &req);
     void pop_url(std::string &ret);
+    // up to max_urls urls of distinct due sites and the millisecs until the
+    // next site is due, 0 when more may be due now and -1 when no site has
+    // urls or all are stopped
+    void pop_urls(msgpack::rpc::request &req, int max_urls);
+    int64_t pop_urls(int max_urls, std::vector<std::string> &urls);
+    // pop_url that, with no site due, parks the request for up to
+    // timeout_ms until tick() finds one
+    void pop_wait(msgpack::rpc::request &req, int timeout_ms);
     void start_all(msgpack::rpc::request &req);
     void stop_all(msgpack::rpc::request &req);
     void stats(msgpack::rpc::request &req);
+    // typed metrics of the server and of every site, or their text
+    // exposition
+    void metrics(msgpack::rpc::request &req, bool text);
     void clear_all(msgpack::rpc::request &req);
     void start_dump_all(msgpack::rpc::request &req);
     void dump_all(msgpack::rpc::request &req);
+    // up to max_urls urls of the dump started by start_dump_all, empty at
+    // its end
+    void dump_all_chunk(msgpack::rpc::request &req, int max_urls);
+    // writes every url to the file name below the dump directory from a
+    // thread of its own, answering the count or QCONTENTHUB_ERROR; one at
+    // a time, and only a plain name without '/' or ".."
+    void dump_file(msgpack::rpc::request &req, const std::string &name);
+    // blocks of a 32 bit site length, the site, a 32 bit url count and the
+    // urls each after its 32 bit length; returns the count or -1
+    int64_t dump_file(const std::string &path);
 
     void set_default_interval(msgpack::rpc::request &req, int interval);
+    static void set_default_interval(int interval);
     void set_site_interval(msgpack::rpc::request &req, const std::string &site, int interval);
+    // adapts the interval of every site from report_fetch between min_ms,
+    // or its set_site_interval, and max_ms; off while max_ms is 0
+    void set_adaptive_interval(msgpack::rpc::request &req, int min_ms, int max_ms);
+    void set_adaptive_interval(int min_ms, int max_ms);
+    // feedback of a crawler on a fetch from site, status being the http
+    // status or negative for a failed connection; 429, 5xx, failures and
+    // latencies above twice the average double the interval, other fetches
+    // take 1/QURLQUEUE_ADAPT_SHRINK off
+    void report_fetch(msgpack::rpc::request &req, const std::string &site, int latency_ms, int status);
+    int report_fetch(const std::string &site, int latency_ms, int status);
+
+    // puts site in group, or on its own for an empty group
+    void set_site_group(msgpack::rpc::request &req, const std::string &site, const std::string &group);
+    int set_site_group(const std::string &site, const std::string &group);
+    // every site named suffix or ending in "." suffix joins the group
+    // named suffix, unless set_site_group put it elsewhere
+    void add_group_rule(msgpack::rpc::request &req, const std::string &suffix);
+    void del_group_rule(msgpack::rpc::request &req, const std::string &suffix);
+    int set_group_rule(const std::string &suffix, bool on);
+    // millisecs between crawls of any site of group, -1 for the default
+    void set_group_interval(msgpack::rpc::request &req, const std::string &group, int interval);
+    int set_group_interval(const std::string &group, int interval);
+    // reads lines of "rule <suffix>", "site <site> <group>" and
+    // "interval <group> <ms>"; the store directory keeps them in "groups"
+    bool load_groups(const std::string &path);
     void stat_site(msgpack::rpc::request &req, const std::string &site);
     void start_site(msgpack::rpc::request &req, const std::string &site);
     void stop_site(msgpack::rpc::request &req, const std::string &site);
     void clear_site(msgpack::rpc::request &req, const std::string &site);
     void start_dump_site(msgpack::rpc::request &req, const std::string &site);
     void dump_site(msgpack::rpc::request &req, const std::string &site);
+    // up to max_urls urls of the dump started by start_dump_site, empty
+    // at its end
+    void dump_site_chunk(msgpack::rpc::request &req, const std::string &site, int max_urls);
 
     void clear_empty_site(msgpack::rpc::request &req);
     int clear_empty_site();
 
+    // drops pushes of urls seen within the last one to two rotate_secs,
+    // answering them with QCONTENTHUB_WARN; bytes of filter are split
+    // over the shards, call it before start
+    void set_dedup(size_t bytes, double fp_rate, int rotate_secs);
+    // loop timer, rotates the filters every rotate_secs
+    bool rotate_filters();
+
+    // keeps the frontier in snapshots and operation logs below dir,
+    // snapshotting every snapshot_secs; call it before start
+    void set_store_dir(const std::string &dir, int snapshot_secs);
+    // the only directory dump_file writes to, off while empty; call it
+    // before start
+    void set_dump_dir(const std::string &dir);
+    // loads the snapshots and logs of the store directory
+    int recover();
+    // snapshots every shard and drops the files it makes obsolete
+    bool snapshot();
+    // writes the logged operations of every shard
+    bool flush_stores();
+
     void start(int multiple);
 public:
     void dispatch(msgpack::rpc::request req);
 
 public:
     static bool set_current_time();
+    // loop timer, sets the current time and answers the parked pop_waits
+    // once a site is due or their deadline has passed
+    bool tick();
     // micro secs
     static uint64_t get_current_time();
 private:
-    static int  m_default_interval;
-    uint64_t m_enqueue_items;
-    uint64_t m_dequeue_items;
+    static void replay(void *ctx, int op, const std::string &site, const char *arg, size_t arg_size);
+    static void *load_main(void *arg);
+    static void *flush_main(void *arg);
+    static void *dump_file_main(void *arg);
+
+    size_t shard_index(const std::string &site);
+    UrlShard *shard_of(const std::string &site);
+    void pop_site(UrlShard *shard, Site *s, uint64_t now, std::string &content);
+    bool pop_shard(UrlShard *shard, uint64_t now, std::string &content);
+    int site_interval(UrlShard *shard, const std::string &site);
+    int effective_interval(UrlShard *shard, Site *s);
+    Site *get_site(UrlShard *shard, const std::string &site);
+    int enqueue_url(UrlShard *shard, Site *&s, const std::string &site, const std::string &record, bool push_front, int priority);
+    bool wait_for_group(Site *s, uint64_t now);
+    SiteGroup *find_group(const std::string &name);
+    SiteGroup *group_of(const std::string &site);
+    void regroup_sites();
+    bool save_groups();
+    // appends up to max urls from cursor on, taking no shard lock for more
+    // than QURLQUEUE_DUMP_CHUNK; done once cursor.shard passes the last
+    size_t dump_urls(dump_cursor_t &cursor, size_t max, dump_chunk_t &chunk);
+
+    static volatile int m_default_interval;
+    volatile int m_adapt_min;
+    volatile int m_adapt_max;
 
-    std::priority_queue<Site *, std::vector<Site*>, SiteCmp>  ordered_sites;
-    interval_map_t m_interval_map;
-    mp::sync<site_map_t> m_site_map;
+    // guards the groups and the rules placing sites in them, taken inside
+    // a shard lock
+    pthread_rwlock_t m_group_lock;
+    // never freed before the server, so sites point at them unlocked
+    group_map_t m_groups;
+    std::map<std::string, std::string> m_site_groups;
+    std::set<std::string> m_group_rules;
+
+    std::vector<UrlShard *> m_shards;
+    // shard the next pop_url starts from, spreads pops over the shards
+    volatile unsigned int m_pop_cursor;
 
     volatile bool m_stop_all;
+
+    // guards the parked pop_waits, taken before any shard lock
+    pthread_mutex_t m_wait_lock;
+    url_waiter_list_t m_waiters;
+    // mirrors !m_waiters.empty() for tick()
+    volatile bool m_has_waiters;
+    uint64_t m_pop_waits;
+    uint64_t m_pop_wait_timeouts;
+    QContentHistogram m_pop_wait;
     static volatile uint64_t m_current_time;
     uint64_t m_start_time;
 
-    site_map_it_t m_dump_all_it;
+    std::string m_store_dir;
+    int m_snapshot_secs;
+    // generation of the current logs, raised by every snapshot
+    volatile uint64_t m_store_gen;
+    uint64_t m_snapshot_at;
+    // next shard index of the store a loader thread replays
+    volatile int m_load_next;
+    int m_load_shards;
+    volatile bool m_load_failed;
+
+    int m_dedup_rotate_secs;
+    uint64_t m_dedup_rotated_at;
+
+    // guards the dump_all cursor, taken before any shard lock
+    pthread_mutex_t m_dump_lock;
+    dump_cursor_t m_dump_all_cursor;
     bool m_dump_all_dumping;
+    volatile bool m_dump_file_running;
+    std::string m_dump_dir;
 };
 
 } // end namespace qurlqueue
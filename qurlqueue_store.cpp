@@ -0,0 +1,418 @@
+#include "qurlqueue_store.h"
+#include "qcontenthub.h"
+#include "qcontenthub_log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <vector>
+
+#define RECORD_HEADER_SIZE 8
+
+static std::string shard_path(const std::string &dir, int shard, uint64_t gen, const char *suffix)
+{
+    char buf[64];
+    sprintf(buf, "/shard-%04d.%016llx.%s", shard, (unsigned long long)gen, suffix);
+    return dir + buf;
+}
+
+// shard, generation and suffix of a store file name
+static bool parse_name(const char *name, int &shard, uint64_t &gen, std::string &suffix)
+{
+    unsigned long long g;
+    char s[8];
+    if (strlen(name) > 32 || sscanf(name, "shard-%4d.%16llx.%4s", &shard, &g, s) != 3) {
+        return false;
+    }
+    gen = g;
+    suffix = s;
+    return suffix == "snap" || suffix == "log";
+}
+
+static uint64_t file_size(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 ? st.st_size : 0;
+}
+
+static void sync_dir(const std::string &dir)
+{
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// replays the records of path, truncating a torn tail
+static int replay_file(const std::string &path, QUrlStore::replay_t fn, void *ctx)
+{
+    int fd = ::open(path.c_str(), O_RDWR);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path.c_str());
+        if (fd >= 0) {
+            close(fd);
+        }
+        return QCONTENTHUB_ERROR;
+    }
+
+    uint64_t size = st.st_size;
+    uint64_t pos = 0;
+    if (size > 0) {
+        char *data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror(path.c_str());
+            close(fd);
+            return QCONTENTHUB_ERROR;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+        std::string site;
+        while (pos + RECORD_HEADER_SIZE <= size) {
+            uint32_t len, crc, site_len;
+            memcpy(&len, data + pos, 4);
+            memcpy(&crc, data + pos + 4, 4);
+            const char *payload = data + pos + RECORD_HEADER_SIZE;
+            if (len < 5 || pos + RECORD_HEADER_SIZE + len > size || qcontenthub_crc32(payload, len) != crc) {
+                break;
+            }
+            memcpy(&site_len, payload + 1, 4);
+            if (5 + (uint64_t)site_len > len) {
+                break;
+            }
+            site.assign(payload + 5, site_len);
+            fn(ctx, (unsigned char)payload[0], site, payload + 5 + site_len, len - 5 - site_len);
+            pos += RECORD_HEADER_SIZE + len;
+        }
+        munmap(data, size);
+    }
+
+    if (pos < size) {
+        fprintf(stderr, "%s: torn record at %llu, truncated\n", path.c_str(), (unsigned long long)pos);
+        if (ftruncate(fd, pos) != 0) {
+            perror(path.c_str());
+        }
+    }
+    close(fd);
+    return QCONTENTHUB_OK;
+}
+
+QUrlStore::QUrlStore(const std::string &dir, int shard): m_dir(dir), m_shard(shard), m_fd(-1), m_fd_gen(0), m_fd_size(0), m_gen(0)
+{
+    pthread_mutex_init(&m_io_lock, NULL);
+    pthread_mutex_init(&m_lock, NULL);
+}
+
+QUrlStore::~QUrlStore()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+    pthread_mutex_destroy(&m_io_lock);
+    pthread_mutex_destroy(&m_lock);
+}
+
+int QUrlStore::load(const std::string &dir, int shard, replay_t fn, void *ctx, uint64_t &gen)
+{
+    std::vector<uint64_t> snaps;
+    std::vector<uint64_t> logs;
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        perror(dir.c_str());
+        return QCONTENTHUB_ERROR;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        int s;
+        uint64_t g;
+        std::string suffix;
+        if (parse_name(entry->d_name, s, g, suffix) && s == shard) {
+            if (suffix == "snap") {
+                snaps.push_back(g);
+            } else {
+                logs.push_back(g);
+            }
+            gen = std::max(gen, g);
+        }
+    }
+    closedir(d);
+    std::sort(logs.begin(), logs.end());
+
+    uint64_t base = 0;
+    if (!snaps.empty()) {
+        base = *std::max_element(snaps.begin(), snaps.end());
+        if (replay_file(shard_path(dir, shard, base, "snap"), fn, ctx) != QCONTENTHUB_OK) {
+            return QCONTENTHUB_ERROR;
+        }
+    }
+    for (size_t i = 0; i < logs.size(); i++) {
+        if (logs[i] >= base && replay_file(shard_path(dir, shard, logs[i], "log"), fn, ctx) != QCONTENTHUB_OK) {
+            return QCONTENTHUB_ERROR;
+        }
+    }
+    return QCONTENTHUB_OK;
+}
+
+int QUrlStore::shards_in(const std::string &dir)
+{
+    int shards = 0;
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        return 0;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        int s;
+        uint64_t g;
+        std::string suffix;
+        if (parse_name(entry->d_name, s, g, suffix) && s >= shards) {
+            shards = s + 1;
+        }
+    }
+    closedir(d);
+    return shards;
+}
+
+void QUrlStore::remove_before(const std::string &dir, uint64_t gen)
+{
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        int s;
+        uint64_t g;
+        std::string suffix;
+        if (parse_name(entry->d_name, s, g, suffix) && g < gen) {
+            unlink((dir + "/" + entry->d_name).c_str());
+        }
+    }
+    closedir(d);
+}
+
+bool QUrlStore::write_meta(const std::string &dir, int shards, int default_interval)
+{
+    std::string path = dir + "/meta";
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (fp == NULL) {
+        perror(tmp.c_str());
+        return false;
+    }
+    fprintf(fp, "%d %d\n", shards, default_interval);
+    fflush(fp);
+    fsync(fileno(fp));
+    fclose(fp);
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+bool QUrlStore::read_meta(const std::string &dir, int &shards, int &default_interval)
+{
+    FILE *fp = fopen((dir + "/meta").c_str(), "r");
+    if (fp == NULL) {
+        return false;
+    }
+    bool ret = fscanf(fp, "%d %d", &shards, &default_interval) == 2;
+    fclose(fp);
+    return ret;
+}
+
+void QUrlStore::encode(std::string &buf, int op, const std::string &site, const char *arg, size_t arg_size)
+{
+    uint32_t len = 5 + site.size() + arg_size;
+    uint32_t site_len = site.size();
+    size_t start = buf.size();
+    buf.resize(start + RECORD_HEADER_SIZE + len);
+    char *p = &buf[start];
+    p[RECORD_HEADER_SIZE] = (char)op;
+    memcpy(p + RECORD_HEADER_SIZE + 1, &site_len, 4);
+    memcpy(p + RECORD_HEADER_SIZE + 5, site.data(), site.size());
+    if (arg_size > 0) {
+        memcpy(p + RECORD_HEADER_SIZE + 5 + site.size(), arg, arg_size);
+    }
+    uint32_t crc = qcontenthub_crc32(p + RECORD_HEADER_SIZE, len);
+    memcpy(p, &len, 4);
+    memcpy(p + 4, &crc, 4);
+}
+
+bool QUrlStore::open(uint64_t gen)
+{
+    std::string path = shard_path(m_dir, m_shard, gen, "log");
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror(path.c_str());
+        return false;
+    }
+    pthread_mutex_lock(&m_io_lock);
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+    m_fd = fd;
+    m_fd_gen = gen;
+    m_fd_size = file_size(fd);
+    pthread_mutex_lock(&m_lock);
+    m_gen = gen;
+    pthread_mutex_unlock(&m_lock);
+    pthread_mutex_unlock(&m_io_lock);
+    return true;
+}
+
+void QUrlStore::append(int op, const std::string &site, const char *arg, size_t arg_size)
+{
+    pthread_mutex_lock(&m_lock);
+    encode(m_buf, op, site, arg, arg_size);
+    pthread_mutex_unlock(&m_lock);
+}
+
+void QUrlStore::roll(uint64_t gen)
+{
+    pthread_mutex_lock(&m_lock);
+    m_prev_buf.append(m_buf);
+    m_buf.clear();
+    m_gen = gen;
+    pthread_mutex_unlock(&m_lock);
+}
+
+bool QUrlStore::write_all(int fd, const std::string &buf)
+{
+    size_t written = 0;
+    while (written < buf.size()) {
+        ssize_t n = write(fd, buf.data() + written, buf.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return false;
+        }
+        written += n;
+    }
+    return true;
+}
+
+bool QUrlStore::write_log(const std::string &buf)
+{
+    if (buf.empty()) {
+        return true;
+    }
+    if (write_all(m_fd, buf) && fdatasync(m_fd) == 0) {
+        m_fd_size += buf.size();
+        return true;
+    }
+    perror(m_dir.c_str());
+    // a replay stops at a torn record and would drop whatever follows
+    if (ftruncate(m_fd, m_fd_size) != 0) {
+        perror(m_dir.c_str());
+    }
+    return false;
+}
+
+void QUrlStore::requeue(uint64_t gen, const std::string &prev, const std::string &buf)
+{
+    pthread_mutex_lock(&m_lock);
+    if (gen == m_gen) {
+        m_prev_buf.insert(0, prev);
+        m_buf.insert(0, buf);
+    } else {
+        // rolled meanwhile, buf belongs to the older generation now
+        m_prev_buf.insert(0, prev + buf);
+    }
+    pthread_mutex_unlock(&m_lock);
+}
+
+int QUrlStore::flush()
+{
+    std::string prev;
+    std::string buf;
+
+    pthread_mutex_lock(&m_io_lock);
+    pthread_mutex_lock(&m_lock);
+    prev.swap(m_prev_buf);
+    buf.swap(m_buf);
+    uint64_t gen = m_gen;
+    pthread_mutex_unlock(&m_lock);
+
+    if (m_fd < 0 || (prev.empty() && buf.empty() && gen == m_fd_gen)) {
+        pthread_mutex_unlock(&m_io_lock);
+        return QCONTENTHUB_AGAIN;
+    }
+
+    if (gen != m_fd_gen) {
+        // finish the log of the older generation before the snapshot of
+        // the new one can make it obsolete
+        if (!write_log(prev)) {
+            requeue(gen, prev, buf);
+            pthread_mutex_unlock(&m_io_lock);
+            return QCONTENTHUB_ERROR;
+        }
+        std::string path = shard_path(m_dir, m_shard, gen, "log");
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            // the records of gen must not go to the older log, the
+            // snapshot of gen would remove them with it
+            perror(path.c_str());
+            requeue(gen, std::string(), buf);
+            pthread_mutex_unlock(&m_io_lock);
+            return QCONTENTHUB_ERROR;
+        }
+        close(m_fd);
+        m_fd = fd;
+        m_fd_gen = gen;
+        m_fd_size = file_size(fd);
+    } else {
+        buf.insert(0, prev);
+    }
+
+    int ret = QCONTENTHUB_OK;
+    if (!write_log(buf)) {
+        requeue(gen, std::string(), buf);
+        ret = QCONTENTHUB_ERROR;
+    }
+    pthread_mutex_unlock(&m_io_lock);
+    return ret;
+}
+
+bool QUrlStore::write_snapshot(uint64_t gen, const std::string &data)
+{
+    std::string path = shard_path(m_dir, m_shard, gen, "snap");
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(tmp.c_str());
+        return false;
+    }
+    if (!write_all(fd, data) || fsync(fd) != 0) {
+        perror(tmp.c_str());
+        close(fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+    close(fd);
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        perror(path.c_str());
+        return false;
+    }
+    sync_dir(m_dir);
+
+    DIR *d = opendir(m_dir.c_str());
+    if (d != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(d)) != NULL) {
+            int s;
+            uint64_t g;
+            std::string suffix;
+            if (parse_name(entry->d_name, s, g, suffix) && s == m_shard && g < gen) {
+                unlink((m_dir + "/" + entry->d_name).c_str());
+            }
+        }
+        closedir(d);
+    }
+    return true;
+}
@@ -0,0 +1,108 @@
+#ifndef QURLQUEUE_STORE_H
+#define QURLQUEUE_STORE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+
+// Snapshot and operation log of one url queue shard.
+//
+// Below the store directory, shard-NNNN.G.snap holds the state of shard
+// NNNN when log generation G began and shard-NNNN.G.log the operations
+// since, G being 16 hex digits. Both are sequences of records: a 32 bit
+// length, a 32 bit crc of the payload and the payload, which is an op
+// byte, a 32 bit site name length, the site name and an argument. A
+// snapshot is written under a temporary name, synced and renamed, and
+// only then are the older files of the shard removed, so a crash always
+// leaves a snapshot and the logs that follow it.
+//
+// append() only copies into a buffer under the shard lock. flush(), run
+// by the flusher thread, writes and syncs it, so a crash loses the
+// operations of the last flush interval. A failed write or sync cuts the
+// log back to its last synced size and keeps the records buffered for
+// the next flush, so no record lands after torn bytes.
+class QUrlStore {
+public:
+    enum {
+        // snapshot record of a site, its state and urls
+        OP_SITE = 1,
+        OP_PUSH,
+        OP_PUSH_FRONT,
+        OP_POP,
+        OP_CLEAR_SITE,
+        OP_STOP_SITE,
+        OP_START_SITE,
+        OP_SITE_INTERVAL,
+        // pushes to a priority lane above 0, the lane byte then the url
+        OP_PUSH_LANE,
+        OP_PUSH_FRONT_LANE
+    };
+
+    typedef void (*replay_t)(void *ctx, int op, const std::string &site, const char *arg, size_t arg_size);
+
+    QUrlStore(const std::string &dir, int shard);
+    ~QUrlStore();
+
+    // replays the newest snapshot of shard and the logs after it into fn,
+    // cutting off a torn tail; raises gen to the newest generation seen
+    static int load(const std::string &dir, int shard, replay_t fn, void *ctx, uint64_t &gen);
+    // one more than the highest shard index with files in dir
+    static int shards_in(const std::string &dir);
+    // removes the files of every shard older than generation gen
+    static void remove_before(const std::string &dir, uint64_t gen);
+
+    // shard count and default interval the files were written with
+    static bool write_meta(const std::string &dir, int shards, int default_interval);
+    static bool read_meta(const std::string &dir, int &shards, int &default_interval);
+
+    // appends a record to buf
+    static void encode(std::string &buf, int op, const std::string &site, const char *arg, size_t arg_size);
+
+    // starts appending to the log of generation gen
+    bool open(uint64_t gen);
+
+    // the caller holds the shard lock
+    void append(int op, const std::string &site, const char *arg = NULL, size_t arg_size = 0);
+    // records appended from now on belong to generation gen; the caller
+    // holds the shard lock and snapshots the shard under it
+    void roll(uint64_t gen);
+
+    // writes and syncs the buffered records, moving to the log of a new
+    // generation after roll(); QCONTENTHUB_AGAIN when there was nothing
+    // to do, QCONTENTHUB_ERROR when the records stay buffered
+    int flush();
+    // writes the snapshot of generation gen, then removes the older files
+    // of the shard; call it only once flush() after roll() succeeded
+    bool write_snapshot(uint64_t gen, const std::string &data);
+
+private:
+    QUrlStore(const QUrlStore &);
+    QUrlStore &operator=(const QUrlStore &);
+
+    bool write_all(int fd, const std::string &buf);
+    // appends buf to the open log and syncs it, or cuts the log back
+    bool write_log(const std::string &buf);
+    // puts records a failed flush() took back in front of the buffers
+    void requeue(uint64_t gen, const std::string &prev, const std::string &buf);
+
+    std::string m_dir;
+    int m_shard;
+
+    // guards the file state, held by flush() during io so appenders are
+    // never stuck behind a fdatasync
+    pthread_mutex_t m_io_lock;
+    int m_fd;
+    uint64_t m_fd_gen;
+    // bytes of the open log known to be synced
+    uint64_t m_fd_size;
+
+    // guards the buffers, taken inside the shard lock by append()
+    pthread_mutex_t m_lock;
+    // records of m_gen, and those of the generation before a roll() that
+    // were not flushed yet
+    std::string m_buf;
+    std::string m_prev_buf;
+    uint64_t m_gen;
+};
+
+#endif
@@ -0,0 +1,132 @@
+// Push throughput of QContentHubClient against the blocking msgpack-rpc
+// client: threads keep a window of pushes in flight, with the client's
+// auto batching off and on, then the same items are drained with
+// pop_batch. The blocking client waits for every reply before the next.
+// g++ -O2 -I.. -o async-client-bench async-client-bench.cpp -L.. -lqcontenthub -lmsgpack-rpc -lmsgpack -lmpio -lpthread -lrt
+// async-client-bench [host] [port] [threads] [items per thread] [window] [item size]
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "../qcontenthub.h"
+#include "../qcontenthub_client.h"
+#include "../qcontenthub_metrics.h"
+
+static const char *queue_name = "async-client-bench";
+
+struct bench_arg_t {
+    QContentHubClient *client;
+    int items;
+    int window;
+    int item_size;
+    int errors;
+};
+
+static void *push_thread(void *p)
+{
+    bench_arg_t *arg = (bench_arg_t *)p;
+    std::string item(arg->item_size, 'x');
+    std::deque<QContentHubFuture> window;
+    for (int i = 0; i < arg->items; i++) {
+        if ((int)window.size() >= arg->window) {
+            if (window.front().status() != QCONTENTHUB_OK) {
+                arg->errors++;
+            }
+            window.pop_front();
+        }
+        window.push_back(arg->client->push(queue_name, item));
+    }
+    arg->client->flush();
+    while (!window.empty()) {
+        if (window.front().status() != QCONTENTHUB_OK) {
+            arg->errors++;
+        }
+        window.pop_front();
+    }
+    return NULL;
+}
+
+static void run_async(QContentHubClient &client, const char *label, int threads, int items, int window, int item_size)
+{
+    std::vector<pthread_t> tids(threads);
+    std::vector<bench_arg_t> args(threads);
+    uint64_t start = qcontenthub_usec();
+    for (int i = 0; i < threads; i++) {
+        args[i].client = &client;
+        args[i].items = items;
+        args[i].window = window;
+        args[i].item_size = item_size;
+        args[i].errors = 0;
+        pthread_create(&tids[i], NULL, push_thread, &args[i]);
+    }
+    int errors = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        errors += args[i].errors;
+    }
+    double secs = (qcontenthub_usec() - start) / 1000000.0;
+    printf("%-16s %10d items %8.2fs %12.0f items/s\n", label, threads * items, secs, threads * items / secs);
+    if (errors > 0) {
+        printf("ERROR!! %d pushes failed\n", errors);
+    }
+
+    // drain for the next round
+    int popped = 0;
+    start = qcontenthub_usec();
+    while (popped < threads * items) {
+        QContentHubFuture f = client.pop_batch(queue_name, 256, 1000);
+        if (f.status() != QCONTENTHUB_OK) {
+            break;
+        }
+        popped += f.items().size();
+    }
+    secs = (qcontenthub_usec() - start) / 1000000.0;
+    printf("%-16s %10d items %8.2fs %12.0f items/s\n", "  pop_batch", popped, secs, popped / secs);
+    if (popped != threads * items) {
+        printf("ERROR!! popped %d of %d\n", popped, threads * items);
+    }
+}
+
+static void run_blocking(const std::string &host, int port, int items, int item_size)
+{
+    msgpack::rpc::client c(host, port);
+    std::string item(item_size, 'x');
+    int errors = 0;
+    uint64_t start = qcontenthub_usec();
+    for (int i = 0; i < items; i++) {
+        if (c.call("push", std::string(queue_name), item).get<int>() != QCONTENTHUB_OK) {
+            errors++;
+        }
+    }
+    double secs = (qcontenthub_usec() - start) / 1000000.0;
+    printf("%-16s %10d items %8.2fs %12.0f items/s\n", "blocking", items, secs, items / secs);
+    if (errors > 0) {
+        printf("ERROR!! %d pushes failed\n", errors);
+    }
+    for (int i = 0; i < items; i++) {
+        c.call("pop_nowait", std::string(queue_name)).get<std::string>();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 7676;
+    int threads = argc > 3 ? atoi(argv[3]) : 4;
+    int items = argc > 4 ? atoi(argv[4]) : 100000;
+    int window = argc > 5 ? atoi(argv[5]) : 1000;
+    int item_size = argc > 6 ? atoi(argv[6]) : 100;
+
+    QContentHubClient client(host, port);
+    run_blocking(host, port, items / 10, item_size);
+
+    client.set_batching(0, 1);
+    run_async(client, "async", threads, items, window, item_size);
+
+    client.set_batching(QCONTENTHUB_CLIENT_WINDOW, QCONTENTHUB_CLIENT_BATCH);
+    run_async(client, "async batched", threads, items, window, item_size);
+    return 0;
+}
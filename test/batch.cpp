@@ -0,0 +1,89 @@
+#include <msgpack/rpc/client.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <sys/time.h>
+
+#undef ASSERT
+#define ASSERT(x) \
+    if (! (x)) \
+    { \
+        cout << "ERROR!! Assert " << #x << " failed\n"; \
+        cout << " on line " << __LINE__  << "\n"; \
+        cout << " in file " << __FILE__ << "\n";  \
+    }
+
+using namespace std;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void report(const char *name, int items, double start)
+{
+    double secs = now() - start;
+    std::cout << name << ": " << items << " items in " << secs << "s, "
+        << (int)(items / secs) << " items/s" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int result;
+    int items = 100000;
+    int batch_size = 100;
+    if (argc > 1) {
+        items = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        batch_size = atoi(argv[2]);
+    }
+
+    msgpack::rpc::client c("127.0.0.1", 7676);
+    c.set_timeout(1000000);
+
+    std::string queue_name = "batch_test_queue";
+    std::string content(1024, 'x');
+    result = c.call("add", queue_name, items + 1).get<int>();
+    std::cout << result << std::endl;
+
+    double start = now();
+    for (int i = 0; i < items; i++) {
+        result = c.call("push", queue_name, content).get<int>();
+        ASSERT(result == 0);
+    }
+    report("push", items, start);
+
+    start = now();
+    for (int i = 0; i < items; i++) {
+        std::string shift = c.call("pop", queue_name).get<std::string>();
+        ASSERT(shift == content);
+    }
+    report("pop", items, start);
+
+    std::vector<std::string> batch(batch_size, content);
+    start = now();
+    for (int i = 0; i < items; i += batch_size) {
+        result = c.call("push_batch", queue_name, batch).get<int>();
+        ASSERT(result == batch_size);
+    }
+    report("push_batch", items, start);
+
+    int popped = 0;
+    start = now();
+    while (popped < items) {
+        std::vector<std::string> shift;
+        shift = c.call("pop_batch", queue_name, batch_size, 1000).get<std::vector<std::string> >();
+        if (shift.size() == 0) {
+            break;
+        }
+        ASSERT(shift[0] == content);
+        popped += shift.size();
+    }
+    report("pop_batch", popped, start);
+
+    return 0;
+}
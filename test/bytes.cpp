@@ -0,0 +1,52 @@
+#include <msgpack/rpc/client.h>
+#include <iostream>
+#include <string>
+
+#include "../qcontenthub.h"
+
+#undef ASSERT
+#define ASSERT(x) \
+    if (! (x)) \
+    { \
+        cout << "ERROR!! Assert " << #x << " failed\n"; \
+        cout << " on line " << __LINE__  << "\n"; \
+        cout << " in file " << __FILE__ << "\n";  \
+    }
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+    int result;
+    msgpack::rpc::client c("127.0.0.1", 7676);
+
+    std::string queue_name = "bytes_test_queue";
+    std::string content(1000, 'x');
+    c.call("fdel", queue_name).get<int>();
+    result = c.call("add", queue_name, 1000).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    result = c.call("set_max_bytes", queue_name, 10000).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+
+    // the byte limit is hit long before the item capacity
+    int pushed = 0;
+    while (c.call("push_nowait", queue_name, content).get<int>() == QCONTENTHUB_OK) {
+        pushed++;
+    }
+    ASSERT(pushed == 10);
+    std::cout << c.call("stat_queue", queue_name).get<std::string>();
+
+    std::string shift = c.call("pop", queue_name).get<std::string>();
+    ASSERT(shift == content);
+    result = c.call("push_nowait", queue_name, content).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+
+    // an item larger than the limit still goes into an empty queue
+    c.call("clear", queue_name).get<int>();
+    result = c.call("push_nowait", queue_name, std::string(20000, 'x')).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+
+    result = c.call("fdel", queue_name).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    return 0;
+}
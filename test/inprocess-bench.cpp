@@ -0,0 +1,190 @@
+// Ceiling of the hub queues and the url queue embedded through
+// libqcontenthub, with no RPC in the way: producer threads push and as
+// many consumer threads pop, one item or url at a time and in batches.
+// Compare with bench/qcontenthub-bench against a daemon on the same box.
+// g++ -O2 -I.. -o inprocess-bench inprocess-bench.cpp -L.. -lqcontenthub -lmsgpack-rpc -lmsgpack -lmpio -lpthread -lrt
+// inprocess-bench [threads] [items per thread] [item size]
+#include <pthread.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../qcontenthub_rpc.h"
+#include "../qurlqueue_rpc.h"
+
+#define BATCH 64
+
+static int threads = 2;
+static int items = 500000;
+static int item_size = 100;
+
+struct worker_t {
+    QContentHubServer *hub;
+    qurlqueue::QUrlQueueServer *urls;
+    std::string name;
+    int id;
+    int batch;
+    // items popped by all consumers together
+    volatile long *popped;
+};
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void *hub_push(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    std::string payload(item_size, 'x');
+    std::vector<QContentItem> objs;
+    for (int i = 0; i < items; ) {
+        if (w->batch > 1) {
+            int n = std::min(w->batch, items - i);
+            objs.resize(n);
+            for (int j = 0; j < n; j++) {
+                std::string data(payload);
+                objs[j].take(data);
+            }
+            int pushed = w->hub->push_queue_batch(w->name, objs);
+            i += pushed > 0 ? pushed : 0;
+        } else {
+            QContentItem obj;
+            std::string data(payload);
+            obj.take(data);
+            if (w->hub->push_queue_nowait(w->name, obj) == QCONTENTHUB_OK) {
+                i++;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *hub_pop(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    long total = (long)threads * items;
+    std::vector<QContentItem> objs;
+    QContentItem obj;
+    while (*w->popped < total) {
+        if (w->batch > 1) {
+            objs.clear();
+            int popped = w->hub->pop_queue_batch(w->name, w->batch, objs);
+            if (popped > 0) {
+                __sync_fetch_and_add(w->popped, popped);
+            }
+        } else if (w->hub->pop_queue_nowait(w->name, obj) == QCONTENTHUB_OK) {
+            __sync_fetch_and_add(w->popped, 1);
+        }
+    }
+    return NULL;
+}
+
+static void *url_push(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    char buf[64];
+    qurlqueue::site_url_list_t batch;
+    std::vector<int> status;
+    for (int i = 0; i < items; i++) {
+        snprintf(buf, sizeof(buf), "site%d-%d.example.com", w->id, i % 1000);
+        std::string site(buf);
+        snprintf(buf, sizeof(buf), "/page%d.html", i);
+        if (w->batch > 1) {
+            batch.push_back(std::make_pair(site, "http://" + site + buf));
+            if ((int)batch.size() == w->batch || i == items - 1) {
+                w->urls->push_urls(batch, status);
+                batch.clear();
+            }
+        } else {
+            w->urls->push_url(site, "http://" + site + buf);
+        }
+    }
+    return NULL;
+}
+
+static void *url_pop(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    long total = (long)threads * items;
+    std::string url;
+    std::vector<std::string> urls;
+    while (*w->popped < total) {
+        if (w->batch > 1) {
+            urls.clear();
+            w->urls->pop_urls(w->batch, urls);
+            if (!urls.empty()) {
+                __sync_fetch_and_add(w->popped, (long)urls.size());
+            }
+        } else {
+            w->urls->pop_url(url);
+            if (url != QCONTENTHUB_STRAGAIN) {
+                __sync_fetch_and_add(w->popped, 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+// items moved per second through threads producers and as many consumers
+static double run(void *(*push)(void *), void *(*pop)(void *), QContentHubServer *hub, qurlqueue::QUrlQueueServer *urls, const std::string &name, int batch)
+{
+    std::vector<worker_t> workers(threads * 2);
+    std::vector<pthread_t> tids(threads * 2);
+    volatile long popped = 0;
+    double start = now();
+    for (int i = 0; i < threads * 2; i++) {
+        worker_t &w = workers[i];
+        w.hub = hub;
+        w.urls = urls;
+        w.name = name;
+        w.id = i;
+        w.batch = batch;
+        w.popped = &popped;
+        pthread_create(&tids[i], NULL, i < threads ? push : pop, &w);
+    }
+    for (int i = 0; i < threads * 2; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    return (double)threads * items / (now() - start);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        threads = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        items = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        item_size = atoi(argv[3]);
+    }
+
+    printf("%d producers and %d consumers, %d items of %d bytes each, items/s\n", threads, threads, items, item_size);
+    printf("%-24s %12s %12s\n", "", "single", "batch 64");
+
+    QContentHubServer hub;
+    hub.add_queue("locked", 100000, 0);
+    hub.add_queue("ring", 100000, QCONTENTHUB_QUEUE_RING);
+    const char *queues[] = { "locked", "ring" };
+    for (int i = 0; i < 2; i++) {
+        double single = run(hub_push, hub_pop, &hub, NULL, queues[i], 1);
+        double batched = run(hub_push, hub_pop, &hub, NULL, queues[i], BATCH);
+        printf("hub %-20s %12.0f %12.0f\n", queues[i], single, batched);
+    }
+
+    // every site is due again at once, so pops never wait on politeness
+    qurlqueue::QUrlQueueServer::set_default_interval(0);
+    qurlqueue::QUrlQueueServer::set_current_time();
+    qurlqueue::QUrlQueueServer urls;
+    double single = run(url_push, url_pop, NULL, &urls, "", 1);
+    double batched = run(url_push, url_pop, NULL, &urls, "", BATCH);
+    printf("%-24s %12.0f %12.0f\n", "url queue", single, batched);
+    return 0;
+}
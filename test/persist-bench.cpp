@@ -0,0 +1,101 @@
+// Push throughput of a plain and a persistent hub queue, from several
+// clients at once so the flusher can group their fdatasyncs.
+// Run the hub with --store, then: persist-bench [threads] [items] [batch]
+#include <msgpack/rpc/client.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../qcontenthub.h"
+
+using namespace std;
+
+static int items = 10000;
+static int batch_size = 0;
+
+struct bench_t {
+    std::string queue_name;
+    long failed;
+};
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void *push_main(void *arg)
+{
+    bench_t *b = (bench_t *)arg;
+    msgpack::rpc::client c("127.0.0.1", 7676);
+    c.set_timeout(60);
+
+    std::string content(1024, 'x');
+    if (batch_size > 0) {
+        std::vector<std::string> batch(batch_size, content);
+        for (int i = 0; i < items; i += batch_size) {
+            int result = c.call("push_batch", b->queue_name, batch).get<int>();
+            if (result != batch_size) {
+                __sync_fetch_and_add(&b->failed, 1);
+            }
+        }
+    } else {
+        for (int i = 0; i < items; i++) {
+            int result = c.call("push", b->queue_name, content).get<int>();
+            if (result != QCONTENTHUB_OK) {
+                __sync_fetch_and_add(&b->failed, 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+static double run(const char *name, int flags, int threads)
+{
+    msgpack::rpc::client c("127.0.0.1", 7676);
+    bench_t b;
+    b.queue_name = std::string("persist_bench_") + name;
+    b.failed = 0;
+    c.call("fdel", b.queue_name).get<int>();
+    c.call("add", b.queue_name, threads * items + 1, flags).get<int>();
+
+    std::vector<pthread_t> tids(threads);
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, push_main, &b);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double secs = now() - start;
+    long total = (long)threads * items;
+    printf("%-8s %3d clients: %ld items in %.3fs, %.0f items/s, %ld failed\n",
+            name, threads, total, secs, total / secs, b.failed);
+
+    c.call("fdel", b.queue_name).get<int>();
+    return total / secs;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 16;
+    if (argc > 1) {
+        threads = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        items = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        batch_size = atoi(argv[3]);
+    }
+
+    double plain = run("plain", 0, threads);
+    double persist = run("persist", QCONTENTHUB_QUEUE_PERSIST, threads);
+    printf("persist/plain: %.2f\n", persist / plain);
+    return 0;
+}
@@ -0,0 +1,147 @@
+// Lookup cost of the hub queue registry with 10k queues, in process.
+// g++ -O2 -o registry-bench registry-bench.cpp ../qcontenthub_registry.cpp -lpthread
+#include <pthread.h>
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../qcontenthub_registry.h"
+
+struct queue_t {
+    int id;
+};
+
+static int queues = 10000;
+static int lookups = 1000000;
+static std::vector<std::string> names;
+
+static QueueRegistry *registry;
+static std::map<std::string, queue_t *> locked_map;
+static pthread_mutex_t locked_map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_queue(queue_t *q)
+{
+    delete q;
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// std::map under one mutex, what the hub would need to be safe without
+// the registry
+static void *locked_main(void *arg)
+{
+    long found = 0;
+    unsigned int seed = (unsigned long)arg;
+    for (int i = 0; i < lookups; i++) {
+        const std::string &name = names[rand_r(&seed) % queues];
+        pthread_mutex_lock(&locked_map_lock);
+        if (locked_map.find(name) != locked_map.end()) {
+            found++;
+        }
+        pthread_mutex_unlock(&locked_map_lock);
+    }
+    return (void *)found;
+}
+
+static void *registry_main(void *arg)
+{
+    long found = 0;
+    unsigned int seed = (unsigned long)arg;
+    for (int i = 0; i < lookups; i++) {
+        const std::string &name = names[rand_r(&seed) % queues];
+        QueueRegistry::guard guard(*registry);
+        if (guard.find(name) != NULL) {
+            found++;
+        }
+    }
+    return (void *)found;
+}
+
+// a writer adding and deleting queues while the readers run
+static volatile int writer_stop = 0;
+
+static void *writer_main(void *)
+{
+    int i = 0;
+    while (!__atomic_load_n(&writer_stop, __ATOMIC_RELAXED)) {
+        char buf[32];
+        sprintf(buf, "churn_%d", i++ % 16);
+        queue_t *q = new queue_t();
+        if (registry->add(buf, q) != 0) {
+            delete q;
+            QueueRegistry::guard guard(*registry);
+            queue_t *old = guard.find(buf);
+            if (old != NULL) {
+                registry->remove(buf, old);
+            }
+        }
+        usleep(1000);
+    }
+    return NULL;
+}
+
+static void run(const char *name, void *(*fn)(void *), int threads)
+{
+    std::vector<pthread_t> tids(threads);
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, fn, (void *)(long)(i + 1));
+    }
+    long found = 0;
+    for (int i = 0; i < threads; i++) {
+        void *ret;
+        pthread_join(tids[i], &ret);
+        found += (long)ret;
+    }
+    double secs = now() - start;
+    long total = (long)threads * lookups;
+    printf("%-10s %3d threads: %ld lookups (%ld hits) in %.3fs, %.1f ns/lookup/thread\n",
+            name, threads, total, found, secs, secs * 1e9 / lookups);
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 4;
+    if (argc > 1) {
+        threads = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        queues = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        lookups = atoi(argv[3]);
+    }
+
+    registry = new QueueRegistry(&free_queue);
+    for (int i = 0; i < queues; i++) {
+        char buf[32];
+        sprintf(buf, "queue_%d", i);
+        names.push_back(buf);
+        locked_map[buf] = new queue_t();
+        registry->add(buf, new queue_t());
+    }
+
+    run("locked", &locked_main, threads);
+    run("registry", &registry_main, threads);
+
+    pthread_t writer;
+    pthread_create(&writer, NULL, &writer_main, NULL);
+    run("registry+w", &registry_main, threads);
+    __atomic_store_n(&writer_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(writer, NULL);
+
+    delete registry;
+    for (std::map<std::string, queue_t *>::iterator it = locked_map.begin(); it != locked_map.end(); it++) {
+        delete it->second;
+    }
+    return 0;
+}
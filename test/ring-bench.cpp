@@ -0,0 +1,134 @@
+// Contention benchmark of the two hub queue implementations, in process.
+// g++ -O2 -o ring-bench ring-bench.cpp -lpthread
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "../qcontenthub_ring.h"
+
+using namespace std;
+
+static int capacity = 1000;
+static int ops = 100000;
+
+// std::queue guarded by a mutex, the default queue_t storage
+struct locked_queue_t {
+    pthread_mutex_t lock;
+    std::queue<std::string> str_q;
+
+    bool push(std::string &obj) {
+        pthread_mutex_lock(&lock);
+        if ((int)str_q.size() > capacity) {
+            pthread_mutex_unlock(&lock);
+            return false;
+        }
+        str_q.push(std::string());
+        str_q.back().swap(obj);
+        pthread_mutex_unlock(&lock);
+        return true;
+    }
+
+    bool pop(std::string &obj) {
+        pthread_mutex_lock(&lock);
+        if (str_q.empty()) {
+            pthread_mutex_unlock(&lock);
+            return false;
+        }
+        obj.swap(str_q.front());
+        str_q.pop();
+        pthread_mutex_unlock(&lock);
+        return true;
+    }
+};
+
+struct ring_queue_t {
+    ring_queue_t(): ring(capacity + 1) {}
+    QContentRing<std::string> ring;
+
+    bool push(std::string &obj) {
+        return ring.push(obj, capacity);
+    }
+
+    bool pop(std::string &obj) {
+        return ring.pop(obj);
+    }
+};
+
+template <typename Q>
+static void *push_main(void *arg)
+{
+    Q *q = (Q *)arg;
+    for (int i = 0; i < ops; i++) {
+        std::string content(100, 'x');
+        while (!q->push(content)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+template <typename Q>
+static void *pop_main(void *arg)
+{
+    Q *q = (Q *)arg;
+    for (int i = 0; i < ops; i++) {
+        std::string content;
+        while (!q->pop(content)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+template <typename Q>
+static void run(const char *name, Q *q, int threads)
+{
+    std::vector<pthread_t> pushers(threads);
+    std::vector<pthread_t> poppers(threads);
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&pushers[i], NULL, push_main<Q>, q);
+        pthread_create(&poppers[i], NULL, pop_main<Q>, q);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(pushers[i], NULL);
+        pthread_join(poppers[i], NULL);
+    }
+    double secs = now() - start;
+    long items = (long)threads * ops;
+    printf("%-8s %3d pushers %3d poppers: %ld items in %.3fs, %.0f items/s\n",
+            name, threads, threads, items, secs, items / secs);
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 25;
+    if (argc > 1) {
+        threads = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        ops = atoi(argv[2]);
+    }
+
+    locked_queue_t locked;
+    pthread_mutex_init(&locked.lock, NULL);
+    run("locked", &locked, threads);
+
+    ring_queue_t ring;
+    run("ring", &ring, threads);
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+// Pop latency of the url queue site scheduler with millions of sites of
+// mixed intervals, in process: the indexed heap against a priority_queue
+// that leaves stopped and emptied sites behind for pop to skip.
+// g++ -O2 -o scheduler-bench scheduler-bench.cpp
+// scheduler-bench [sites] [pops]
+#include <time.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "../qurlqueue_heap.h"
+
+static int sites = 5000000;
+static int pops = 10000000;
+static const int intervals[] = { 100, 1000, 5000, 30000 };
+
+struct site_t {
+    site_t(): next_crawl_time(0), heap_index(-1), urls(0), interval(0), ref_cnt(0) {}
+    uint64_t next_crawl_time;
+    int heap_index;
+    int urls;
+    int interval;
+    int ref_cnt;
+};
+
+struct site_cmp_t {
+    bool operator() (const site_t *lhs, const site_t *rhs) const {
+        return lhs->next_crawl_time > rhs->next_crawl_time;
+    }
+};
+
+typedef std::priority_queue<site_t *, std::vector<site_t *>, site_cmp_t> lazy_heap_t;
+
+static uint64_t nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void init(std::vector<site_t> &all)
+{
+    srand(1);
+    for (int i = 0; i < sites; i++) {
+        all[i] = site_t();
+        all[i].urls = 1 + rand() % 20;
+        all[i].interval = intervals[rand() % 4];
+    }
+}
+
+static void report(const char *name, std::vector<uint32_t> &lat, double secs, size_t entries)
+{
+    std::sort(lat.begin(), lat.end());
+    size_t n = lat.size();
+    printf("%-14s %10.0f ops/s  p50 %5uns  p99 %6uns  p999 %7uns  max %8uns  heap %lu\n",
+            name, n / secs, lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000], lat[n - 1], entries);
+}
+
+// every 4th op pushes a url to a random site, the rest pop the earliest
+static void run_lazy(std::vector<site_t> &all)
+{
+    lazy_heap_t heap;
+    for (int i = 0; i < sites; i++) {
+        all[i].ref_cnt++;
+        heap.push(&all[i]);
+    }
+    std::vector<uint32_t> lat;
+    lat.reserve(pops);
+    uint64_t now = 0;
+    uint64_t start = nsec();
+    for (int i = 0; i < pops; i++) {
+        site_t *p = &all[rand() % sites];
+        uint64_t t0 = nsec();
+        if (i % 4 == 0) {
+            if (p->urls++ == 0) {
+                p->ref_cnt++;
+                heap.push(p);
+            }
+        } else {
+            while (!heap.empty() && heap.top()->urls == 0) {
+                heap.top()->ref_cnt--;
+                heap.pop();
+            }
+            if (!heap.empty()) {
+                site_t *s = heap.top();
+                heap.pop();
+                now = std::max(now, s->next_crawl_time);
+                s->urls--;
+                s->next_crawl_time = now + s->interval;
+                heap.push(s);
+            }
+        }
+        lat.push_back(nsec() - t0);
+    }
+    report("priority_queue", lat, (nsec() - start) / 1e9, heap.size());
+}
+
+static void run_indexed(std::vector<site_t> &all)
+{
+    QUrlHeap<site_t> heap;
+    for (int i = 0; i < sites; i++) {
+        heap.push(&all[i]);
+    }
+    std::vector<uint32_t> lat;
+    lat.reserve(pops);
+    uint64_t now = 0;
+    uint64_t start = nsec();
+    for (int i = 0; i < pops; i++) {
+        site_t *p = &all[rand() % sites];
+        uint64_t t0 = nsec();
+        if (i % 4 == 0) {
+            p->urls++;
+            if (!QUrlHeap<site_t>::contains(p)) {
+                heap.push(p);
+            }
+        } else if (!heap.empty()) {
+            site_t *s = heap.top();
+            now = std::max(now, s->next_crawl_time);
+            s->urls--;
+            s->next_crawl_time = now + s->interval;
+            if (s->urls == 0) {
+                heap.erase(s);
+            } else {
+                heap.update(s);
+            }
+        }
+        lat.push_back(nsec() - t0);
+    }
+    report("indexed heap", lat, (nsec() - start) / 1e9, heap.size());
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        sites = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        pops = atoi(argv[2]);
+    }
+    printf("%d sites, intervals 100ms to 30s, %d ops\n", sites, pops);
+
+    std::vector<site_t> all(sites);
+    init(all);
+    run_lazy(all);
+    init(all);
+    run_indexed(all);
+    return 0;
+}
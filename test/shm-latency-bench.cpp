@@ -0,0 +1,71 @@
+// Latency of hub pushes and pops over loopback msgpack-rpc against the
+// shared memory channel, one client doing push then pop of the same item
+// to an otherwise idle queue. Run the hub with --shm.
+// g++ -O2 -I.. -o shm-latency-bench shm-latency-bench.cpp -L.. -lqcontenthub -lmsgpack-rpc -lmsgpack -lmpio -lpthread -lrt
+// shm-latency-bench [host] [port] [ops] [item size]
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "../qcontenthub.h"
+#include "../qcontenthub_metrics.h"
+#include "../qcontenthub_shm.h"
+
+static void run(QContentHubShmClient &c, const char *label, int ops, int item_size)
+{
+    std::string item(item_size, 'x');
+    std::string out;
+    QContentHistogram push_us;
+    QContentHistogram pop_us;
+    int errors = 0;
+
+    uint64_t start = qcontenthub_usec();
+    for (int i = 0; i < ops; i++) {
+        uint64_t t0 = qcontenthub_usec();
+        if (c.push("shm-latency", item) != QCONTENTHUB_OK) {
+            errors++;
+        }
+        uint64_t t1 = qcontenthub_usec();
+        if (c.pop("shm-latency", out) != QCONTENTHUB_OK || out.size() != item.size()) {
+            errors++;
+        }
+        uint64_t t2 = qcontenthub_usec();
+        push_us.add(t1 - t0);
+        pop_us.add(t2 - t1);
+    }
+    double secs = (qcontenthub_usec() - start) / 1000000.0;
+
+    printf("%-6s %8d %10.1f %8lu %8lu %10.1f %8lu %8lu %12.0f\n", label, item_size,
+           (double)push_us.sum() / ops, push_us.percentile(50), push_us.percentile(99),
+           (double)pop_us.sum() / ops, pop_us.percentile(50), pop_us.percentile(99),
+           2.0 * ops / secs);
+    if (errors > 0) {
+        printf("ERROR!! %d of %d calls failed\n", errors, 2 * ops);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 7676;
+    int ops = argc > 3 ? atoi(argv[3]) : 100000;
+    int sizes[] = { 100, 4096, 65536 };
+    if (argc > 4) {
+        sizes[0] = atoi(argv[4]);
+    }
+
+    QContentHubShmClient tcp(host, port, false);
+    QContentHubShmClient shm(host, port, true);
+    if (!shm.using_shm()) {
+        printf("ERROR!! no shared memory channel, is the hub running with --shm on this host?\n");
+        return 1;
+    }
+
+    // percentiles are the upper bound of a power of two bucket
+    printf("%-6s %8s %10s %8s %8s %10s %8s %8s %12s\n", "", "bytes", "push avg", "p50", "p99", "pop avg", "p50", "p99", "calls/s");
+    for (int i = 0; i < (argc > 4 ? 1 : 3); i++) {
+        run(tcp, "tcp", ops, sizes[i]);
+        run(shm, "shm", ops, sizes[i]);
+    }
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <msgpack/rpc/client.h>
 #include <iostream>
+#include <map>
 #include <string>
 
 #undef ASSERT
@@ -26,5 +27,25 @@ int main(void)
     std::cout << stats << std::endl;
     ASSERT(stats.find(queue_name) != std::string::npos);
 
+    stats = c.call("stat_queue", queue_name).get<std::string>();
+    std::cout << stats << std::endl;
+    ASSERT(stats.find("STAT residence_p99_us") != std::string::npos);
+
+    // the objects point into the zone of the future, keep it around
+    typedef std::map<std::string, msgpack::object> metric_set_t;
+    msgpack::rpc::future metrics_reply = c.call("queue_metrics", queue_name);
+    metric_set_t metrics = metrics_reply.get<metric_set_t>();
+    std::map<std::string, uint64_t> counters;
+    metrics["counters"].convert(&counters);
+    for (std::map<std::string, uint64_t>::iterator it = counters.begin(); it != counters.end(); it++) {
+        std::cout << it->first << " " << it->second << std::endl;
+    }
+    ASSERT(counters.count("enqueued") == 1);
+
+    msgpack::rpc::future all_reply = c.call("metrics");
+    metric_set_t all = all_reply.get<metric_set_t>();
+    ASSERT(all.count("queues") == 1);
+    std::cout << c.call("metrics", std::string("text")).get<std::string>() << std::endl;
+
     return 0;
 }
@@ -0,0 +1,105 @@
+// Simulated crawl of sites that answer 503 when fetched faster than they
+// can take, with the static default interval against intervals adapted by
+// report_fetch. In process, every site always has urls.
+// g++ -O2 -o url-adaptive-bench url-adaptive-bench.cpp ../qurlqueue_rpc.cpp ../qurlqueue_list.cpp ../qurlqueue_filter.cpp ../qurlqueue_store.cpp ../qcontenthub_log.cpp ../qcontenthub_metrics.cpp -lmsgpack-rpc -lmsgpack -lmpio -lpthread
+// url-adaptive-bench [sites] [secs]
+#include <pthread.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../qurlqueue_rpc.h"
+
+using qurlqueue::QUrlQueueServer;
+
+static int sites = 200;
+static int secs = 30;
+static volatile bool running;
+
+struct site_model_t {
+    // shortest gap between fetches the site serves without a 503
+    int min_gap;
+    uint64_t last_fetch;
+};
+
+static void *clock_main(void *)
+{
+    while (running) {
+        QUrlQueueServer::set_current_time();
+        usleep(1000);
+    }
+    return NULL;
+}
+
+static void run(const char *name, bool adaptive)
+{
+    QUrlQueueServer svr;
+    QUrlQueueServer::set_default_interval(1000);
+    svr.set_adaptive_interval(100, 30000);
+    if (!adaptive) {
+        svr.set_adaptive_interval(0, 0);
+    }
+
+    std::map<std::string, site_model_t> models;
+    char buf[64];
+    for (int i = 0; i < sites; i++) {
+        snprintf(buf, sizeof(buf), "site%d.example.com", i);
+        site_model_t &m = models[buf];
+        // from 50ms to 5s, most sites between
+        m.min_gap = 50 << (i % 7);
+        m.last_fetch = 0;
+        for (int j = 0; j < 10; j++) {
+            svr.push_url(buf, std::string("http://") + buf + "/");
+        }
+    }
+
+    running = true;
+    pthread_t tid;
+    pthread_create(&tid, NULL, clock_main, NULL);
+    uint64_t end = QUrlQueueServer::get_current_time() + secs * 1000;
+    uint64_t fetches = 0;
+    uint64_t errors = 0;
+    std::vector<std::string> urls;
+    while (QUrlQueueServer::get_current_time() < end) {
+        urls.clear();
+        int64_t wait = svr.pop_urls(100, urls);
+        uint64_t now = QUrlQueueServer::get_current_time();
+        for (size_t i = 0; i < urls.size(); i++) {
+            std::string site = urls[i].substr(7, urls[i].size() - 8);
+            site_model_t &m = models[site];
+            int status = now - m.last_fetch < (uint64_t)m.min_gap ? 503 : 200;
+            m.last_fetch = now;
+            fetches++;
+            if (status != 200) {
+                errors++;
+            }
+            svr.report_fetch(site, 20, status);
+            svr.push_url(site, urls[i]);
+        }
+        if (urls.empty()) {
+            usleep(wait > 0 && wait < 10 ? wait * 1000 : 1000);
+        }
+    }
+    running = false;
+    pthread_join(tid, NULL);
+
+    printf("%-9s %10llu fetches %10.1f ok/s %8llu 503s (%.1f%%)\n", name, (unsigned long long)fetches,
+            (fetches - errors) / (double)secs, (unsigned long long)errors, fetches ? 100.0 * errors / fetches : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        sites = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        secs = atoi(argv[2]);
+    }
+    printf("%d sites, %ds each, default interval 1000ms, adaptive 100-30000ms\n", sites, secs);
+    run("static", false);
+    run("adaptive", true);
+    return 0;
+}
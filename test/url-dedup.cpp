@@ -0,0 +1,44 @@
+// Run against a url queue started with --dedup.
+#include <msgpack/rpc/client.h>
+#include <iostream>
+#include <string>
+
+#include "../qcontenthub.h"
+
+#undef ASSERT
+#define ASSERT(x) \
+    if (! (x)) \
+    { \
+        cout << "ERROR!! Assert " << #x << " failed\n"; \
+        cout << " on line " << __LINE__  << "\n"; \
+        cout << " in file " << __FILE__ << "\n";  \
+    }
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+    int result;
+    msgpack::rpc::client c("127.0.0.1", 19854);
+
+    std::string site = "dedup.example.com";
+    std::string record = "http://dedup.example.com/index.html";
+    result = c.call("push", site, record).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    result = c.call("push", site, record).get<int>();
+    ASSERT(result == QCONTENTHUB_WARN);
+    result = c.call("push", site, std::string("http://dedup.example.com/other.html")).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+
+    // push_list puts a url back even if it was seen
+    result = c.call("push_list", site, record).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+
+    std::string stats = c.call("stat_site", site).get<std::string>();
+    std::cout << stats;
+    ASSERT(stats.find("STAT dedup_rejects 1\n") != std::string::npos);
+    std::cout << c.call("stats").get<std::string>();
+
+    c.call("clear_site", site).get<int>();
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <msgpack/rpc/client.h>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#undef ASSERT
+#define ASSERT(x) \
+    if (! (x)) \
+    { \
+        cout << "ERROR!! Assert " << #x << " failed\n"; \
+        cout << " on line " << __LINE__  << "\n"; \
+        cout << " in file " << __FILE__ << "\n";  \
+    }
+#include "../qcontenthub.h"
+
+using namespace std;
+
+typedef std::vector<std::pair<std::string, std::vector<std::string> > > dump_chunk_t;
+
+// url-dump [urls]: pushes urls over 100 sites, then dumps them in chunks
+// and to a file, popping while the chunks are read; run the url queue
+// with --dump-dir /tmp
+int main(int argc, char *argv[])
+{
+    int urls = 100000;
+    if (argc > 1) {
+        urls = atoi(argv[1]);
+    }
+    msgpack::rpc::client c("127.0.0.1", 19854);
+    c.set_timeout(600);
+
+    int result = c.call("clear_all").get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    char buf[64];
+    std::vector<std::pair<std::string, std::string> > batch;
+    for (int i = 0; i < urls; i++) {
+        snprintf(buf, sizeof(buf), "dump-%d.com", i % 100);
+        std::string site = buf;
+        snprintf(buf, sizeof(buf), "/%d", i);
+        batch.push_back(std::make_pair(site, "http://" + site + buf));
+        if (batch.size() == 1000 || i == urls - 1) {
+            c.call("push_urls", batch).get<std::vector<int> >();
+            batch.clear();
+        }
+    }
+
+    result = c.call("start_dump_all").get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    int dumped = 0;
+    int calls = 0;
+    for (;;) {
+        dump_chunk_t chunk = c.call("dump_all_chunk", 5000).get<dump_chunk_t>();
+        if (chunk.empty()) {
+            break;
+        }
+        calls++;
+        for (size_t i = 0; i < chunk.size(); i++) {
+            dumped += chunk[i].second.size();
+        }
+        // the cursor survives pops in the middle of a dump
+        c.call("pop").get<std::string>();
+    }
+    std::cout << "dump_all_chunk: " << dumped << " urls in " << calls << " calls" << std::endl;
+    ASSERT(dumped >= urls - calls && dumped <= urls);
+
+    result = c.call("start_dump_site", std::string("dump-1.com")).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    std::vector<std::string> site_urls = c.call("dump_site_chunk", std::string("dump-1.com"), 100000).get<std::vector<std::string> >();
+    std::cout << "dump_site_chunk: " << site_urls.size() << " urls" << std::endl;
+    ASSERT(site_urls.size() > 0 && site_urls.size() <= (size_t)urls / 100);
+
+    int64_t written = c.call("dump_file", std::string("url-dump.out")).get<int64_t>();
+    std::cout << "dump_file: " << written << " urls" << std::endl;
+    ASSERT(written > 0 && written <= urls);
+    remove("/tmp/url-dump.out");
+
+    // only plain names below the dump directory
+    written = c.call("dump_file", std::string("/tmp/url-dump.out")).get<int64_t>();
+    ASSERT(written == QCONTENTHUB_ERROR);
+    written = c.call("dump_file", std::string("../url-dump.out")).get<int64_t>();
+    ASSERT(written == QCONTENTHUB_ERROR);
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include <msgpack/rpc/client.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#undef ASSERT
+#define ASSERT(x) \
+    if (! (x)) \
+    { \
+        cout << "ERROR!! Assert " << #x << " failed\n"; \
+        cout << " on line " << __LINE__  << "\n"; \
+        cout << " in file " << __FILE__ << "\n";  \
+    }
+#include "../qcontenthub.h"
+
+using namespace std;
+
+typedef msgpack::type::tuple<std::vector<std::string>, int64_t> pop_urls_t;
+
+int main(void)
+{
+    int result;
+    msgpack::rpc::client c("127.0.0.1", 19854);
+
+    result = c.call("set_default_interval", 0).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    result = c.call("add_group_rule", std::string("groups.example.com")).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    result = c.call("set_group_interval", std::string("groups.example.com"), 1000).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+
+    // three virtual hosts of one server
+    const char *sites[] = { "a.groups.example.com", "b.groups.example.com", "groups.example.com" };
+    for (int i = 0; i < 3; i++) {
+        std::string site = sites[i];
+        result = c.call("push", site, "http://" + site + "/").get<int>();
+        ASSERT(result == QCONTENTHUB_OK);
+    }
+
+    std::string stats = c.call("stat_site", std::string("a.groups.example.com")).get<std::string>();
+    std::cout << stats << std::endl;
+    ASSERT(stats.find("STAT group groups.example.com") != std::string::npos);
+
+    // one url of the group per group interval
+    pop_urls_t ret = c.call("pop_urls", 10).get<pop_urls_t>();
+    std::cout << ret.get<0>().size() << " urls, wait " << ret.get<1>() << std::endl;
+    ASSERT(ret.get<0>().size() == 1);
+    ASSERT(ret.get<1>() > 0 && ret.get<1>() <= 1000);
+
+    // a site of its own crawls apart from the group
+    result = c.call("set_site_group", std::string("b.groups.example.com"), std::string()).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    ret = c.call("pop_urls", 10).get<pop_urls_t>();
+    std::cout << ret.get<0>().size() << " urls" << std::endl;
+
+    result = c.call("del_group_rule", std::string("groups.example.com")).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+// Heap bytes per url of the site url queues, std::list<std::string>
+// against the chunked QUrlList, in process.
+// g++ -O2 -o url-memory-bench url-memory-bench.cpp ../qurlqueue_list.cpp
+// url-memory-bench [urls] [sites]
+#include <malloc.h>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "../qurlqueue_list.h"
+
+static int urls = 5000000;
+static int sites = 100000;
+
+static size_t heap_used()
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static void make_url(int i, std::string &url)
+{
+    char buf[160];
+    snprintf(buf, sizeof(buf), "http://www.site%d.example.com/articles/2012/%d/page-%d.html?ref=list",
+            i % sites, i % 97, i);
+    url = buf;
+}
+
+template <typename L>
+static void run(const char *name)
+{
+    std::string url;
+    size_t before = heap_used();
+    std::vector<L *> queues(sites);
+    for (int i = 0; i < sites; i++) {
+        queues[i] = new L();
+    }
+    for (int i = 0; i < urls; i++) {
+        make_url(i, url);
+        queues[i % sites]->push_back(url);
+    }
+    size_t used = heap_used() - before;
+    printf("%-24s %10.1f MB  %6.1f bytes/url\n", name, used / 1048576.0, (double)used / urls);
+    for (int i = 0; i < sites; i++) {
+        delete queues[i];
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        urls = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        sites = atoi(argv[2]);
+    }
+    std::string url;
+    make_url(urls - 1, url);
+    printf("%d urls in %d sites, like %s\n", urls, sites, url.c_str());
+
+    run<std::list<std::string> >("std::list<std::string>");
+    run<QUrlList>("QUrlList");
+    return 0;
+}
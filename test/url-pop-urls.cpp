@@ -0,0 +1,57 @@
+#include <msgpack/rpc/client.h>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#undef ASSERT
+#define ASSERT(x) \
+    if (! (x)) \
+    { \
+        cout << "ERROR!! Assert " << #x << " failed\n"; \
+        cout << " on line " << __LINE__  << "\n"; \
+        cout << " in file " << __FILE__ << "\n";  \
+    }
+#include "../qcontenthub.h"
+
+using namespace std;
+
+typedef msgpack::type::tuple<std::vector<std::string>, int64_t> pop_urls_t;
+
+int main(void)
+{
+    int result;
+    msgpack::rpc::client c("127.0.0.1", 19854);
+
+    result = c.call("set_default_interval", 2000).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+
+    // three urls for each of three sites
+    const char *sites[] = { "pop-urls-a.com", "pop-urls-b.com", "pop-urls-c.com" };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            std::string site = sites[i];
+            result = c.call("push", site, "http://" + site + "/" + (char)('0' + j)).get<int>();
+            ASSERT(result == QCONTENTHUB_OK);
+        }
+    }
+
+    // one url per due site, then the wait until the next one is due
+    pop_urls_t ret = c.call("pop_urls", 10).get<pop_urls_t>();
+    std::vector<std::string> &urls = ret.get<0>();
+    std::set<std::string> seen;
+    for (size_t i = 0; i < urls.size(); i++) {
+        std::cout << urls[i] << std::endl;
+        seen.insert(urls[i].substr(0, urls[i].rfind('/')));
+    }
+    std::cout << "wait " << ret.get<1>() << std::endl;
+    ASSERT(urls.size() == 3);
+    ASSERT(seen.size() == 3);
+    ASSERT(ret.get<1>() > 0 && ret.get<1>() <= 2000);
+
+    ret = c.call("pop_urls", 10).get<pop_urls_t>();
+    ASSERT(ret.get<0>().empty());
+    ASSERT(ret.get<1>() > 0);
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <msgpack/rpc/client.h>
+#include <iostream>
+#include <string>
+#include <sys/time.h>
+
+#undef ASSERT
+#define ASSERT(x) \
+    if (! (x)) \
+    { \
+        cout << "ERROR!! Assert " << #x << " failed\n"; \
+        cout << " on line " << __LINE__  << "\n"; \
+        cout << " in file " << __FILE__ << "\n";  \
+    }
+#include "../qcontenthub.h"
+
+using namespace std;
+
+static long now_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int main(void)
+{
+    msgpack::rpc::client c("127.0.0.1", 19854);
+    msgpack::rpc::client pusher("127.0.0.1", 19854);
+
+    std::string site = "pop-wait.com";
+    int result = c.call("set_site_interval", site, 500).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    result = c.call("push", site, std::string("http://pop-wait.com/1")).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    result = c.call("push", site, std::string("http://pop-wait.com/2")).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+
+    std::string url = c.call("pop_wait", 1000).get<std::string>();
+    ASSERT(url == "http://pop-wait.com/1");
+
+    // parked until the site is due again
+    long start = now_ms();
+    url = c.call("pop_wait", 2000).get<std::string>();
+    long waited = now_ms() - start;
+    cout << url << " after " << waited << "ms" << endl;
+    ASSERT(url == "http://pop-wait.com/2");
+    ASSERT(waited >= 400 && waited < 1000);
+
+    // nothing left, answered with again at the deadline
+    start = now_ms();
+    url = c.call("pop_wait", 200).get<std::string>();
+    waited = now_ms() - start;
+    cout << url << " after " << waited << "ms" << endl;
+    ASSERT(url == QCONTENTHUB_STRAGAIN);
+    ASSERT(waited >= 150 && waited < 1000);
+
+    // woken by a push to a new site
+    std::string other = "pop-wait.org";
+    start = now_ms();
+    msgpack::rpc::future f = c.call("pop_wait", 5000);
+    result = pusher.call("push", other, std::string("http://pop-wait.org/1")).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    url = f.get<std::string>();
+    waited = now_ms() - start;
+    cout << url << " after " << waited << "ms" << endl;
+    ASSERT(url == "http://pop-wait.org/1");
+    ASSERT(waited < 1000);
+
+    std::string stats = c.call("stats").get<std::string>();
+    ASSERT(stats.find("STAT pop_waiters 0") != std::string::npos);
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include <msgpack/rpc/client.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#undef ASSERT
+#define ASSERT(x) \
+    if (! (x)) \
+    { \
+        cout << "ERROR!! Assert " << #x << " failed\n"; \
+        cout << " on line " << __LINE__  << "\n"; \
+        cout << " in file " << __FILE__ << "\n";  \
+    }
+#include "../qcontenthub.h"
+
+using namespace std;
+
+int main(void)
+{
+    msgpack::rpc::client c("127.0.0.1", 19854);
+
+    std::string site = "priority.com";
+    int result = c.call("set_site_interval", site, 0).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+
+    result = c.call("push", site, std::string("http://priority.com/low")).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    result = c.call("push", site, std::string("http://priority.com/high"), 7).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    result = c.call("push", site, std::string("http://priority.com/mid"), 3).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    result = c.call("push", site, std::string("http://priority.com/bad"), 8).get<int>();
+    ASSERT(result == QCONTENTHUB_ERROR);
+
+    // [site, url] and [site, url, priority] items may be mixed
+    std::vector<msgpack::type::tuple<std::string, std::string, int> > items;
+    items.push_back(msgpack::type::tuple<std::string, std::string, int>(site, "http://priority.com/mid2", 3));
+    std::vector<int> status = c.call("push_urls", items).get<std::vector<int> >();
+    ASSERT(status.size() == 1 && status[0] == QCONTENTHUB_OK);
+
+    std::string stats = c.call("stat_site", site).get<std::string>();
+    std::cout << stats << std::endl;
+    ASSERT(stats.find("STAT lane_7 1") != std::string::npos);
+    ASSERT(stats.find("STAT lane_3 2") != std::string::npos);
+    ASSERT(stats.find("STAT lane_0 1") != std::string::npos);
+
+    // the dump walks the lanes from the highest down
+    const char *expected[] = { "http://priority.com/high", "http://priority.com/mid", "http://priority.com/mid2", "http://priority.com/low" };
+    result = c.call("start_dump_site", site).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    for (int i = 0; i < 4; i++) {
+        std::string dump = c.call("dump_site", site).get<std::string>();
+        ASSERT(dump == expected[i]);
+    }
+
+    for (int i = 0; i < 4; i++) {
+        std::string url = c.call("pop").get<std::string>();
+        std::cout << url << std::endl;
+        ASSERT(url == expected[i]);
+    }
+
+    return 0;
+}
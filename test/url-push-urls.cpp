@@ -0,0 +1,62 @@
+#include <msgpack/rpc/client.h>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#undef ASSERT
+#define ASSERT(x) \
+    if (! (x)) \
+    { \
+        cout << "ERROR!! Assert " << #x << " failed\n"; \
+        cout << " on line " << __LINE__  << "\n"; \
+        cout << " in file " << __FILE__ << "\n";  \
+    }
+#include "../qcontenthub.h"
+
+using namespace std;
+
+typedef std::vector<std::pair<std::string, std::string> > site_url_list_t;
+
+int main(void)
+{
+    msgpack::rpc::client c("127.0.0.1", 19854);
+
+    std::string site = "push-urls.com";
+    std::string other = "push-urls.org";
+    site_url_list_t urls;
+    urls.push_back(std::make_pair(site, std::string("http://push-urls.com/1")));
+    urls.push_back(std::make_pair(other, std::string("http://push-urls.org/1")));
+    urls.push_back(std::make_pair(site, std::string("http://push-urls.com/2")));
+
+    std::vector<int> status = c.call("push_urls", urls).get<std::vector<int> >();
+    ASSERT(status.size() == urls.size());
+    for (size_t i = 0; i < status.size(); i++) {
+        ASSERT(status[i] == QCONTENTHUB_OK);
+    }
+
+    // back to the front of the site, in the order given
+    urls.clear();
+    urls.push_back(std::make_pair(site, std::string("http://push-urls.com/a")));
+    urls.push_back(std::make_pair(site, std::string("http://push-urls.com/b")));
+    status = c.call("push_list_bulk", urls).get<std::vector<int> >();
+    ASSERT(status.size() == 2 && status[0] == QCONTENTHUB_OK && status[1] == QCONTENTHUB_OK);
+
+    const char *expected[] = { "http://push-urls.com/a", "http://push-urls.com/b", "http://push-urls.com/1", "http://push-urls.com/2" };
+    std::string dump;
+    int result = c.call("start_dump_site", site).get<int>();
+    ASSERT(result == QCONTENTHUB_OK);
+    for (int i = 0; i < 4; i++) {
+        dump = c.call("dump_site", site).get<std::string>();
+        std::cout << dump << std::endl;
+        ASSERT(dump == expected[i]);
+    }
+    dump = c.call("dump_site", site).get<std::string>();
+    ASSERT(dump == QCONTENTHUB_STREND);
+
+    std::string stats = c.call("stat_site", site).get<std::string>();
+    std::cout << stats << std::endl;
+    ASSERT(stats.find("STAT enqueue_items 4") != std::string::npos);
+
+    return 0;
+}
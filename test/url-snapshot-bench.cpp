@@ -0,0 +1,91 @@
+// Restart time of a url queue with a large frontier, in process: fills a
+// store with a snapshot and a log tail, then times the load of a fresh
+// server and checks that every url came back.
+// g++ -O2 -o url-snapshot-bench url-snapshot-bench.cpp ../qurlqueue_rpc.cpp ../qurlqueue_list.cpp ../qurlqueue_filter.cpp ../qurlqueue_store.cpp ../qcontenthub_log.cpp ../qcontenthub_metrics.cpp -lmsgpack-rpc -lmsgpack -lmpio -lpthread
+// url-snapshot-bench dir [urls] [sites]
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "../qurlqueue_rpc.h"
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void push(qurlqueue::QUrlQueueServer &svr, int from, int to, int sites)
+{
+    char site[64];
+    char url[128];
+    for (int i = from; i < to; i++) {
+        snprintf(site, sizeof(site), "site%d.example.com", i % sites);
+        snprintf(url, sizeof(url), "http://%s/dir/page-%d.html", site, i);
+        svr.push_url(site, url);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: url-snapshot-bench dir [urls] [sites]\n");
+        return 1;
+    }
+    std::string dir = argv[1];
+    int urls = argc > 2 ? atoi(argv[2]) : 5000000;
+    int sites = argc > 3 ? atoi(argv[3]) : 100000;
+    int tail = urls / 10;
+
+    qurlqueue::QUrlQueueServer::set_default_interval(0);
+    qurlqueue::QUrlQueueServer::set_current_time();
+
+    {
+        qurlqueue::QUrlQueueServer svr;
+        svr.set_store_dir(dir, 0);
+        if (svr.recover() != QCONTENTHUB_OK) {
+            return 1;
+        }
+        double start = now();
+        push(svr, 0, urls - tail, sites);
+        printf("pushed %d urls to %d sites in %.3fs\n", urls - tail, sites, now() - start);
+
+        start = now();
+        svr.snapshot();
+        printf("snapshot in %.3fs\n", now() - start);
+
+        // a log tail of pushes and pops after the snapshot
+        push(svr, urls - tail, urls, sites);
+        std::string url;
+        for (int i = 0; i < tail; i++) {
+            svr.pop_url(url);
+        }
+        svr.flush_stores();
+    }
+
+    qurlqueue::QUrlQueueServer svr;
+    svr.set_store_dir(dir, 0);
+    double start = now();
+    if (svr.recover() != QCONTENTHUB_OK) {
+        return 1;
+    }
+    double secs = now() - start;
+
+    int left = 0;
+    std::string url;
+    for (;;) {
+        svr.pop_url(url);
+        if (url == QCONTENTHUB_STRAGAIN) {
+            break;
+        }
+        left++;
+    }
+    printf("loaded %d urls in %.3fs, %.0f urls/s\n", left, secs, left / secs);
+    if (left != urls - tail) {
+        printf("ERROR!! expected %d urls\n", urls - tail);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+// Scaling of url queue push and pop over 1 to 32 threads, in process, with
+// one shard (the old single lock) against the default shard count.
+// g++ -O2 -o urlqueue-bench urlqueue-bench.cpp ../qurlqueue_rpc.cpp ../qurlqueue_list.cpp ../qurlqueue_filter.cpp ../qurlqueue_store.cpp ../qcontenthub_log.cpp ../qcontenthub_metrics.cpp -lmsgpack-rpc -lmsgpack -lmpio -lpthread
+// urlqueue-bench [sites] [ops per thread]
+#include <pthread.h>
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../qurlqueue_rpc.h"
+
+static int sites = 100000;
+static int ops = 200000;
+static std::vector<std::string> site_names;
+
+struct worker_t {
+    qurlqueue::QUrlQueueServer *svr;
+    unsigned int seed;
+    int popped;
+};
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void *work(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    std::string url;
+    for (int i = 0; i < ops; i++) {
+        const std::string &site = site_names[rand_r(&w->seed) % sites];
+        w->svr->push_url(site, "http://" + site + "/page.html");
+        w->svr->pop_url(url);
+        if (url != QCONTENTHUB_STRAGAIN) {
+            w->popped++;
+        }
+    }
+    return NULL;
+}
+
+static double run(int shards, int threads)
+{
+    qurlqueue::QUrlQueueServer svr(msgpack::rpc::loop(), shards);
+    std::vector<worker_t> workers(threads);
+    std::vector<pthread_t> tids(threads);
+
+    double start = now();
+    for (int i = 0; i < threads; i++) {
+        workers[i].svr = &svr;
+        workers[i].seed = i + 1;
+        workers[i].popped = 0;
+        pthread_create(&tids[i], NULL, work, &workers[i]);
+    }
+    int popped = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        popped += workers[i].popped;
+    }
+    double secs = now() - start;
+    if (popped < threads * ops / 2) {
+        printf("ERROR!! only %d of %d pops returned a url\n", popped, threads * ops);
+    }
+    return 2.0 * threads * ops / secs;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        sites = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        ops = atoi(argv[2]);
+    }
+    char buf[64];
+    for (int i = 0; i < sites; i++) {
+        snprintf(buf, sizeof(buf), "site%d.example.com", i);
+        site_names.push_back(buf);
+    }
+
+    // every site is due again at once, so pops never wait on politeness
+    qurlqueue::QUrlQueueServer::set_default_interval(0);
+    qurlqueue::QUrlQueueServer::set_current_time();
+
+    printf("%d sites, %d push+pop per thread, ops/s\n", sites, ops);
+    printf("%8s %12s %12s\n", "threads", "1 shard", "64 shards");
+    for (int threads = 1; threads <= 32; threads *= 2) {
+        double single = run(1, threads);
+        double sharded = run(QURLQUEUE_DEFAULT_SHARDS, threads);
+        printf("%8d %12.0f %12.0f\n", threads, single, sharded);
+    }
+    return 0;
+}
@@ -0,0 +1,75 @@
+// Hub CPU time per GB of pages pushed and popped, taken from the
+// rusage lines of stats. Run against builds before and after a change.
+// zerocopy-bench [pages] [page size in KB]
+#include <msgpack/rpc/client.h>
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+static double stat_value(const std::string &stats, const char *name)
+{
+    std::string key = std::string("STAT ") + name + " ";
+    size_t pos = stats.find(key);
+    if (pos == std::string::npos) {
+        return 0;
+    }
+    return atof(stats.c_str() + pos + key.size());
+}
+
+static double server_cpu(msgpack::rpc::client &c)
+{
+    std::string stats = c.call("stats").get<std::string>();
+    return stat_value(stats, "rusage_user") + stat_value(stats, "rusage_system");
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    int pages = 1000;
+    int page_kb = 1024;
+    if (argc > 1) {
+        pages = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        page_kb = atoi(argv[2]);
+    }
+
+    msgpack::rpc::client c("127.0.0.1", 7676);
+    c.set_timeout(60);
+
+    std::string queue_name = "zerocopy_bench_queue";
+    std::string content(page_kb * 1024, 'x');
+    c.call("fdel", queue_name).get<int>();
+    c.call("add", queue_name, 16).get<int>();
+
+    double cpu = server_cpu(c);
+    double start = now();
+    for (int i = 0; i < pages; i++) {
+        c.call("push", queue_name, content).get<int>();
+        std::string shift = c.call("pop", queue_name).get<std::string>();
+        if (shift.size() != content.size()) {
+            std::cout << "ERROR!! short page " << shift.size() << std::endl;
+            return 1;
+        }
+    }
+    double secs = now() - start;
+    cpu = server_cpu(c) - cpu;
+
+    double gb = (double)pages * content.size() / (1024.0 * 1024 * 1024);
+    printf("%d pages of %d KB: %.2f GB in %.3fs, hub cpu %.3fs, %.3f cpu s/GB\n",
+            pages, page_kb, gb, secs, cpu, cpu / gb);
+
+    c.call("fdel", queue_name).get<int>();
+    return 0;
+}